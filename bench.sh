@@ -0,0 +1,29 @@
+#!/bin/bash
+#
+# Run fs_bench against a fresh server on a scratch disk.
+# Arguments are passed to fs_bench, e.g. ./bench.sh -t 8 -n 2000 -s 7
+#
+export FS_CRYPT=${FS_CRYPT:-CLEAR}
+export FS_QUIET=1
+export USER=fs_bench               # the scratch disk is /tmp/fs_tmp.fs_bench.disk
+
+[ -x ./createfs ] || chmod +x ./createfs
+./createfs > /dev/null || exit 1
+
+log=$(mktemp)
+./server 0 < passwords > $log 2>&1 &
+pid=$!
+trap 'kill $pid 2> /dev/null; rm -f $log /tmp/fs_tmp.$USER.disk' EXIT
+
+port=
+for i in $(seq 50); do
+    port=$(sed -n 's/^@@@ port \([0-9]*\)$/\1/p' $log)
+    [ -n "$port" ] && break
+    sleep 0.1
+done
+if [ -z "$port" ]; then
+    echo "error: server did not start" >&2
+    exit 1
+fi
+
+./fs_bench localhost $port "$@"
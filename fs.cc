@@ -1,4 +1,5 @@
 #include "fs_server.h"
+#include "fs_core.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,9 +7,15 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <sched.h>
+#include <errno.h>
+#include <dirent.h>
 
 #include <iostream>
 #include <sstream>
@@ -16,32 +23,329 @@
 #include <string>
 #include <regex>
 #include <deque>
+#include <list>
 #include <unordered_map>
 #include <unordered_set>
 #include <algorithm>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <atomic>
 #include <cassert>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
 static const unsigned int BLOCK_NUMBER = FS_DISKSIZE/FS_BLOCKSIZE;
 static const unsigned int MAXSIZE_INT = 10;
+// fs_inode.blocks entry of a hole: a block of a sparse file that was never written
+// and reads back as zeros. Block 0 holds the root inode, so it is never a data block.
+static const uint32_t HOLE = 0;
+// A block pointer with PACKED set refers to a compressed block stored in slot
+// (bits 16-23) of a shared pack block (bits 0-15)
+static const uint32_t PACKED = 0x80000000;
+static const unsigned int PACK_SLOTS = 15;           // compressed blocks per pack block
+static inline uint32_t data_block(uint32_t ptr) { return ptr & 0xffff; }
+
+enum request_type { SESSION, READ, WRITE, CREATE, DELETE, PIPELINE, RELEASE, READDIR,
+                    DELETE_TREE, STAT, APPEND, RENAME, INVALID };
+#ifndef FS_CORE_ONLY
+static const char* request_names[] = { "SESSION", "READ", "WRITE", "CREATE", "DELETE",
+                                       "PIPELINE", "RELEASE", "READDIR", "DELETE_TREE",
+                                       "STAT", "APPEND", "RENAME", "INVALID" };
+#endif /* FS_CORE_ONLY */
+
+
+/* Metrics */
+
+// Latency of each request type is broken down into the phases of its life. The time a
+// thread spends in a phase is accumulated in phase_ns, and charged to the request the
+// thread works on. Counters are spread over per-CPU shards updated with relaxed
+// atomics, since threads only live as long as a connection.
+enum phase_t { PHASE_RECV, PHASE_DECRYPT, PHASE_PARSE, PHASE_LOCK, PHASE_DISK,
+               PHASE_ENCRYPT, PHASE_SEND, PHASE_TOTAL, NUM_PHASES };
+#ifndef FS_CORE_ONLY
+static const char* phase_names[] = { "recv", "decrypt", "parse", "lock_wait", "disk",
+                                     "encrypt", "send", "total" };
+#endif /* FS_CORE_ONLY */
+
+static bool metrics_enabled = false;                 // FS_METRICS
+static thread_local uint64_t phase_ns[NUM_PHASES];   // time this thread spent per phase
+
+static inline uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Charge the lifetime of the timer to a phase of the current thread
+struct phase_timer_t {
+    phase_t phase;
+    uint64_t start;
+    phase_timer_t(phase_t p) : phase(p) {
+        if (metrics_enabled) { start = now_ns(); }
+    }
+    ~phase_timer_t() {
+        if (metrics_enabled) { phase_ns[phase] += now_ns()-start; }
+    }
+};
+
+// Log-linear latency histogram in nanoseconds, HDR style: 8 buckets per power of two,
+// so a reported value is within 12.5% of the recorded one.
+struct histogram_t {
+    static const unsigned int SUB_BITS = 3;
+    static const unsigned int SUB_COUNT = 1 << SUB_BITS;
+    static const unsigned int MAX_EXP = 40;          // values are capped at 2^40 ns
+    static const unsigned int BUCKETS = SUB_COUNT+(MAX_EXP-SUB_BITS+1)*SUB_COUNT;
+    atomic<uint64_t> counts[BUCKETS];
+    atomic<uint64_t> sum;
+
+    static unsigned int bucket(uint64_t ns) {
+        if (ns < SUB_COUNT) { return ns; }
+        unsigned int e = 63-__builtin_clzll(ns);
+        if (e > MAX_EXP) { return BUCKETS-1; }
+        return SUB_COUNT+(e-SUB_BITS)*SUB_COUNT+((ns >> (e-SUB_BITS)) & (SUB_COUNT-1));
+    }
+    // highest value that falls in bucket b
+    static uint64_t bucket_value(unsigned int b) {
+        if (b < SUB_COUNT) { return b; }
+        unsigned int e = (b-SUB_COUNT)/SUB_COUNT+SUB_BITS;
+        uint64_t sub = (b-SUB_COUNT)%SUB_COUNT;
+        return ((SUB_COUNT+sub+1) << (e-SUB_BITS))-1;
+    }
+    void record(uint64_t ns) {
+        counts[bucket(ns)].fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(ns, memory_order_relaxed);
+    }
+};
+
+#ifndef FS_CORE_ONLY
+struct metrics_shard_t {
+    histogram_t hist[INVALID+1][NUM_PHASES];         // request type, phase
+};
+static metrics_shard_t* metrics_shards = nullptr;
+static unsigned int num_metrics_shards = 0;
+
+static void metrics_init() {
+    num_metrics_shards = max(1u, min(16u, thread::hardware_concurrency()));
+    metrics_shards = new metrics_shard_t[num_metrics_shards]();
+}
+
+// Copy the phase times of the current thread, to charge what follows to a request
+static void metrics_snapshot(uint64_t *base) {
+    memcpy(base, phase_ns, sizeof(phase_ns));
+}
+
+// Record a request whose phases so far are in ns, plus what this thread spent
+// since base. start is the arrival time of its first byte.
+static void metrics_record(request_type type, uint64_t start, const uint64_t *ns,
+                           const uint64_t *base) {
+    int cpu = sched_getcpu();
+    metrics_shard_t &shard = metrics_shards[(cpu < 0? 0: cpu) % num_metrics_shards];
+    for (unsigned int p = 0; p < PHASE_TOTAL; p++) {
+        uint64_t spent = ns[p]+phase_ns[p]-base[p];
+        if (spent > 0) {
+            shard.hist[type][p].record(spent);
+        }
+    }
+    shard.hist[type][PHASE_TOTAL].record(now_ns()-start);
+}
+
+// Write the JSON fields of a histogram with the given bucket counts and sum:
+// "count":..,"mean_ns":..,"p50_ns":..,"p90_ns":..,"p99_ns":..,"p999_ns":..,"max_ns":..
+static void histogram_fields(ostringstream &out, const vector<uint64_t> &counts,
+                             uint64_t sum) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char* quantile_names[] = { "p50_ns", "p90_ns", "p99_ns", "p999_ns" };
+    uint64_t total = 0, max_ns = 0;
+    for (uint64_t c : counts) {
+        total += c;
+    }
+    out << "\"count\":" << total << ",\"mean_ns\":" << (total == 0? 0: sum/total);
+    uint64_t seen = 0;
+    unsigned int q = 0;
+    for (unsigned int b = 0; b < histogram_t::BUCKETS; b++) {
+        if (counts[b] == 0) { continue; }
+        seen += counts[b];
+        max_ns = histogram_t::bucket_value(b);
+        while (q < 4 && seen >= quantiles[q]*total) {
+            out << ",\"" << quantile_names[q++] << "\":" << max_ns;
+        }
+    }
+    out << ",\"max_ns\":" << max_ns;
+}
+
+// Report all histograms as JSON:
+// {"READ":{"total":{"count":..,"mean_ns":..,"p50_ns":..,..},..},..}
+static string metrics_report() {
+    if (!metrics_enabled) { return "{}\n"; }
+    ostringstream out;
+    out << "{";
+    bool first_type = true;
+    for (unsigned int t = 0; t <= INVALID; t++) {
+        bool first_phase = true;
+        for (unsigned int p = 0; p < NUM_PHASES; p++) {
+            // merge the shards
+            vector<uint64_t> counts(histogram_t::BUCKETS, 0);
+            uint64_t total = 0, sum = 0;
+            for (unsigned int s = 0; s < num_metrics_shards; s++) {
+                histogram_t &h = metrics_shards[s].hist[t][p];
+                for (unsigned int b = 0; b < histogram_t::BUCKETS; b++) {
+                    uint64_t c = h.counts[b].load(memory_order_relaxed);
+                    counts[b] += c;
+                    total += c;
+                }
+                sum += h.sum.load(memory_order_relaxed);
+            }
+            if (total == 0) { continue; }
+            if (first_phase) {
+                out << (first_type? "": ",") << "\"" << request_names[t] << "\":{";
+                first_type = false;
+            }
+            out << (first_phase? "": ",") << "\"" << phase_names[p] << "\":{";
+            first_phase = false;
+            histogram_fields(out, counts, sum);
+            out << "}";
+        }
+        if (!first_phase) { out << "}"; }
+    }
+    out << "}\n";
+    return out.str();
+}
+#endif /* FS_CORE_ONLY */
+
+
+/* Lock profiling */
+
+// With FS_LOCKPROF=1, the global mutexes and the rw-lock of every inode count their
+// acquisitions and record how long threads waited for them and held them.
+static bool lockprof_enabled = false;
+
+// Contention counters of one lock
+struct lock_stats_t {
+    atomic<uint64_t> acquisitions{0};
+    atomic<uint64_t> contended{0};         // acquisitions that had to wait
+    atomic<uint64_t> wait_ns{0};
+    atomic<uint64_t> max_wait_ns{0};
+    atomic<uint64_t> hold_ns{0};
+
+    void acquired(uint64_t waited, bool had_to_wait) {
+        acquisitions.fetch_add(1, memory_order_relaxed);
+        if (had_to_wait) {
+            contended.fetch_add(1, memory_order_relaxed);
+        }
+        wait_ns.fetch_add(waited, memory_order_relaxed);
+        uint64_t max_wait = max_wait_ns.load(memory_order_relaxed);
+        while (waited > max_wait &&
+               !max_wait_ns.compare_exchange_weak(max_wait, waited, memory_order_relaxed));
+    }
+    void released(uint64_t held) {
+        hold_ns.fetch_add(held, memory_order_relaxed);
+    }
+    void merge(const lock_stats_t &other) {
+        acquisitions += other.acquisitions;
+        contended += other.contended;
+        wait_ns += other.wait_ns;
+        max_wait_ns = max(max_wait_ns.load(), other.max_wait_ns.load());
+        hold_ns += other.hold_ns;
+    }
+    void reset() {
+        acquisitions = 0;
+        contended = 0;
+        wait_ns = 0;
+        max_wait_ns = 0;
+        hold_ns = 0;
+    }
+    string json() const {
+        return "{\"acquisitions\":"+to_string(acquisitions.load())+
+               ",\"contended\":"+to_string(contended.load())+
+               ",\"wait_ns\":"+to_string(wait_ns.load())+
+               ",\"max_wait_ns\":"+to_string(max_wait_ns.load())+
+               ",\"hold_ns\":"+to_string(hold_ns.load())+"}";
+    }
+};
+
+// A mutex that keeps lock_stats_t when lock profiling is on
+struct profiled_mutex_t {
+    mutex mtx;
+    lock_stats_t stats;
+    uint64_t locked_at = 0;                // written by the holder only
+
+    void lock() {
+        if (!lockprof_enabled) {
+            mtx.lock();
+            return;
+        }
+        uint64_t start = now_ns();
+        bool had_to_wait = !mtx.try_lock();
+        if (had_to_wait) {
+            mtx.lock();
+        }
+        locked_at = now_ns();
+        stats.acquired(locked_at-start, had_to_wait);
+    }
+    void unlock() {
+        if (lockprof_enabled) {
+            stats.released(now_ns()-locked_at);
+        }
+        mtx.unlock();
+    }
+};
+
+// Read locks held by this thread and when they were taken, to time shared holds
+static thread_local vector<pair<const void*, uint64_t> > read_holds;
+
 
 /* Data structures */
 
 // session id, sequence, username, password and lock
+#ifndef FS_CORE_ONLY
 static unsigned int session_id = 0;                                    // increase by one
 static bool session_max = false;                                       // Set if num of session reaches the maximum
+#endif /* FS_CORE_ONLY */
 static unordered_map <unsigned int, unsigned int>            SS_map;   // session id -> largest sequence id received 
 static unordered_map <string, unordered_set<unsigned int> >  US_map;   // username -> session id
 static unordered_map <string, string>                        UP_map;   // username -> password
-mutex ssmap_lock;                                                      // lock for US_map and SS_map
+profiled_mutex_t ssmap_lock;                                           // lock for US_map and SS_map
+
+#ifndef FS_CORE_ONLY
+// Length of a read lease in milliseconds (FS_LEASE_MS)
+static unsigned int lease_ms = 2000;
+#endif /* FS_CORE_ONLY */
 
 // In-memory free block list and lock
 static unsigned int num_block_remain;
 static deque<unsigned int> free_blocks;
-mutex free_blocks_lock;
+profiled_mutex_t free_blocks_lock;
+
+// Blocks [segment_next, segment_end) of the active log segment (see "Log-structured
+// writes"): free and counted in num_block_remain, but not on the list
+static unsigned int segment_next = 0, segment_end = 0;
+
+// Snapshot sequence number, and for every block the sequence number when its content
+// was allocated or last preserved: a block born before a snapshot may be part of it
+static atomic<uint32_t> snap_seq{0};
+static atomic<uint32_t> block_born[FS_DISKSIZE];
+
+// Take a block off the free list; caller holds free_blocks_lock and has reserved it
+// in num_block_remain
+static unsigned int pop_free_block() {
+    unsigned int block;
+    if (free_blocks.empty()) {
+        // the last free blocks are in the active log segment
+        block = segment_next++;
+    } else {
+        block = free_blocks.front();
+        free_blocks.pop_front();
+    }
+    block_born[block] = snap_seq.load();
+    return block;
+}
+// pop_free_block for a block of file data, from the log with log-structured writes
+static unsigned int pop_data_block();
 
 // Read-write lock for every file server entity
 struct rw_mutex_t {
@@ -50,6 +354,9 @@ struct rw_mutex_t {
     pthread_cond_t *waiting_writers;
     unsigned int reading_num = 0;
     unsigned int writing_num = 0;
+    lock_stats_t read_stats;
+    lock_stats_t write_stats;
+    uint64_t write_locked_at = 0;
     rw_mutex_t() {
         mtx = new pthread_mutex_t();
         waiting_readers = new pthread_cond_t();
@@ -73,14 +380,31 @@ struct rw_mutex_t {
         delete waiting_writers;
     }
     void read_lock() {
+        uint64_t start = lockprof_enabled? now_ns(): 0;
+        bool had_to_wait = false;
         pthread_mutex_lock(mtx);
         while(writing_num > 0){
+            had_to_wait = true;
             pthread_cond_wait(waiting_readers, mtx);
         }
         reading_num++;
         pthread_mutex_unlock(mtx);
+        if (lockprof_enabled) {
+            uint64_t now = now_ns();
+            read_stats.acquired(now-start, had_to_wait);
+            read_holds.push_back(make_pair(this, now));
+        }
     } 
     void read_unlock() {
+        if (lockprof_enabled) {
+            for (auto it = read_holds.rbegin(); it != read_holds.rend(); it++) {
+                if (it->first == this) {
+                    read_stats.released(now_ns()-it->second);
+                    read_holds.erase(next(it).base());
+                    break;
+                }
+            }
+        }
         pthread_mutex_lock(mtx);
         reading_num--;
         if (reading_num == 0) {
@@ -89,14 +413,24 @@ struct rw_mutex_t {
         pthread_mutex_unlock(mtx);
     }
     void write_lock() {
+        uint64_t start = lockprof_enabled? now_ns(): 0;
+        bool had_to_wait = false;
         pthread_mutex_lock(mtx);
         while(reading_num + writing_num > 0){
+            had_to_wait = true;
             pthread_cond_wait(waiting_writers, mtx);
         }
         writing_num++;
         pthread_mutex_unlock(mtx);
+        if (lockprof_enabled) {
+            write_locked_at = now_ns();
+            write_stats.acquired(write_locked_at-start, had_to_wait);
+        }
     }
     void write_unlock() {
+        if (lockprof_enabled) {
+            write_stats.released(now_ns()-write_locked_at);
+        }
         pthread_mutex_lock(mtx);
         writing_num--;
         pthread_cond_broadcast(waiting_readers);
@@ -105,186 +439,1391 @@ struct rw_mutex_t {
     }
 };
 
+// Striped rw-locks for the data blocks of files, keyed by (inode, offset).
+// Taken inside the shared lock of the file's inode, so that overwrites and
+// reads of different blocks of one file run in parallel.
+struct block_locks_t {
+    static const unsigned int STRIPES = 256;
+    rw_mutex_t stripes[STRIPES];
+
+    rw_mutex_t &stripe(unsigned int inode, unsigned int offset) {
+        return stripes[(inode*FS_MAXFILEBLOCKS+offset)%STRIPES];
+    }
+    void r_lock(unsigned int inode, unsigned int offset) {
+        phase_timer_t timer(PHASE_LOCK);
+        stripe(inode, offset).read_lock();
+    }
+    void w_lock(unsigned int inode, unsigned int offset) {
+        phase_timer_t timer(PHASE_LOCK);
+        stripe(inode, offset).write_lock();
+    }
+    void r_unlock(unsigned int inode, unsigned int offset) {
+        stripe(inode, offset).read_unlock();
+    }
+    void w_unlock(unsigned int inode, unsigned int offset) {
+        stripe(inode, offset).write_unlock();
+    }
+
+    // Contention counters summed over the stripes, as JSON
+    string json() {
+        lock_stats_t read, write;
+        for (rw_mutex_t &lock : stripes) {
+            read.merge(lock.read_stats);
+            write.merge(lock.write_stats);
+        }
+        return "{\"read\":"+read.json()+",\"write\":"+write.json()+"}";
+    }
+    void reset_stats() {
+        for (rw_mutex_t &lock : stripes) {
+            lock.read_stats.reset();
+            lock.write_stats.reset();
+        }
+    }
+};
+static block_locks_t block_locks;
+
 // A rw-lock manager for the entire file server. 
 // The lock of a particular fs entity can be manipulated 
 // by passing in the inode number as parameter.
+// There is one lock per disk block, so the lock of an inode stays valid after the
+// inode is deleted, for lookups that reach it without holding its directory.
 struct mm_fs_locks_t {
-    unordered_map<unsigned int, rw_mutex_t*> fs_locks; 
-    mutex rwmap_lock;
+    rw_mutex_t fs_locks[FS_DISKSIZE]; 
 
-    void add_lock(unsigned int inode) {
-        rwmap_lock.lock(); 
-        fs_locks[inode] = new rw_mutex_t();
-        rwmap_lock.unlock(); 
-    }
-    void delete_lock(unsigned int inode) {
-        rwmap_lock.lock(); 
-        delete fs_locks[inode];
-        fs_locks.erase(inode); 
-        rwmap_lock.unlock(); 
-    }
     void r_lock(unsigned int inode) {
-        rwmap_lock.lock(); 
-        rw_mutex_t* lock = fs_locks[inode];
-        rwmap_lock.unlock(); 
-        lock->read_lock();
+        phase_timer_t timer(PHASE_LOCK);
+        fs_locks[inode].read_lock();
     }
     void w_lock(unsigned int inode) {
-        rwmap_lock.lock(); 
-        rw_mutex_t* lock = fs_locks[inode];
-        rwmap_lock.unlock(); 
-        lock->write_lock();
+        phase_timer_t timer(PHASE_LOCK);
+        fs_locks[inode].write_lock();
     }
     void r_unlock(unsigned int inode) {
-        rwmap_lock.lock(); 
-        rw_mutex_t* lock = fs_locks[inode];
-        rwmap_lock.unlock(); 
-        lock->read_unlock();
+        fs_locks[inode].read_unlock();
     }
     void w_unlock(unsigned int inode) {
-        rwmap_lock.lock(); 
-        rw_mutex_t* lock = fs_locks[inode];
-        rwmap_lock.unlock(); 
-        lock->write_unlock();
+        fs_locks[inode].write_unlock();
+    }
+
+    // Contention report: the global mutexes, then the "top" inodes that were waited
+    // for longest, as JSON
+    string report(unsigned int top) {
+        vector<pair<uint64_t, unsigned int> > waits;   // total wait, inode
+        for (unsigned int inode = 0; inode < FS_DISKSIZE; inode++) {
+            rw_mutex_t &lock = fs_locks[inode];
+            if (lock.read_stats.acquisitions+lock.write_stats.acquisitions == 0) continue;
+            waits.push_back(make_pair(lock.read_stats.wait_ns+lock.write_stats.wait_ns,
+                                      inode));
+        }
+        sort(waits.rbegin(), waits.rend());
+        ostringstream out;
+        out << "{\"ssmap_lock\":" << ssmap_lock.stats.json()
+            << ",\"free_blocks_lock\":" << free_blocks_lock.stats.json()
+            << ",\"block_locks\":" << block_locks.json()
+            << ",\"inodes\":[";
+        for (unsigned int i = 0; i < waits.size() && i < top; i++) {
+            rw_mutex_t &lock = fs_locks[waits[i].second];
+            out << (i == 0? "": ",") << "{\"inode\":" << waits[i].second
+                << ",\"read\":" << lock.read_stats.json()
+                << ",\"write\":" << lock.write_stats.json() << "}";
+        }
+        out << "]}\n";
+        return out.str();
+    }
+    void reset_stats() {
+        ssmap_lock.stats.reset();
+        free_blocks_lock.stats.reset();
+        block_locks.reset_stats();
+        for (rw_mutex_t &lock : fs_locks) {
+            lock.read_stats.reset();
+            lock.write_stats.reset();
+        }
     }
 };
 static mm_fs_locks_t mm_fs_locks;
 
+// Generation of every inode block, incremented when its inode is deleted (under the
+// inode's write lock), so a lookup that found the inode unlocked can tell whether it
+// is still the same file or directory once it holds the lock
+static atomic<uint32_t> inode_gen[FS_DISKSIZE];
+
+// Entry of a directory snapshot
+struct dir_ref_t {
+    uint32_t inode_block;
+    uint32_t gen;                          // inode_gen of inode_block when it was linked
+};
+
+// Immutable in-memory copy of a directory, published RCU-style: CREATE and DELETE
+// build a new snapshot under the directory's write lock and swap the pointer, and
+// path lookups read the snapshots of the ancestors without taking their locks.
+// The entries are split by name hash into shards that successive snapshots share,
+// so a change copies one shard rather than the whole directory.
+struct dir_snapshot_t {
+    static const unsigned int SHARDS = 32;
+    typedef unordered_map<string, dir_ref_t> shard_t;
+
+    uint32_t gen;                          // inode_gen of the directory
+    string owner;
+    shared_ptr<const shard_t> shards[SHARDS];
+
+    static unsigned int shard_of(const string &name) {
+        return hash<string>()(name)%SHARDS;
+    }
+    const dir_ref_t* find(const string &name) const {
+        const shard_t *shard = shards[shard_of(name)].get();
+        if (shard == nullptr) { return nullptr; }
+        auto entry = shard->find(name);
+        return entry == shard->end()? nullptr: &entry->second;
+    }
+    // A copy of this snapshot with "name" linked to ref, or unlinked if ref is nullptr
+    dir_snapshot_t* with(const string &name, const dir_ref_t *ref) const {
+        dir_snapshot_t *copy = new dir_snapshot_t(*this);
+        shared_ptr<const shard_t> &shard = copy->shards[shard_of(name)];
+        shard_t *changed = shard? new shard_t(*shard): new shard_t();
+        if (ref != nullptr) {
+            (*changed)[name] = *ref;
+        } else {
+            changed->erase(name);
+        }
+        shard.reset(changed);
+        return copy;
+    }
+};
+static atomic<dir_snapshot_t*> dir_snapshots[FS_DISKSIZE];   // nullptr for files
+
+// Epoch-based reclamation of the snapshots. Readers count themselves in the counter
+// of the current epoch's parity (per CPU, to keep them off one cache line). A retired
+// snapshot is freed after the epoch flips and the readers of the old parity are gone.
+struct epoch_t {
+    static const unsigned int SLOTS = 16;
+    static const unsigned int RETIRE_BATCH = 64;
+    struct alignas(64) slot_t {
+        atomic<long> readers[2];
+    };
+    slot_t slots[SLOTS];
+    atomic<unsigned int> current{0};
+    mutex retire_lock;
+    vector<dir_snapshot_t*> retired;
+
+    void retire(dir_snapshot_t *snapshot) {
+        lock_guard<mutex> lock(retire_lock);
+        retired.push_back(snapshot);
+        if (retired.size() < RETIRE_BATCH) {
+            return;
+        }
+        // every retired snapshot is unpublished: readers of the new parity can't see them
+        unsigned int parity = current.fetch_add(1)&1;
+        for (;;) {
+            long readers = 0;
+            for (slot_t &slot : slots) {
+                readers += slot.readers[parity].load();
+            }
+            if (readers == 0) break;
+            this_thread::yield();
+        }
+        for (dir_snapshot_t *old : retired) {
+            delete old;
+        }
+        retired.clear();
+    }
+};
+static epoch_t epoch;
+
+// Read-side critical section of the snapshots
+struct epoch_guard_t {
+    unsigned int slot;
+    unsigned int parity;
+    epoch_guard_t() {
+        int cpu = sched_getcpu();
+        slot = (cpu < 0? 0: cpu)%epoch_t::SLOTS;
+        // count in an epoch that was still current after the count was made, so
+        // that the flip away from it waits for this reader
+        for (;;) {
+            unsigned int current = epoch.current.load();
+            parity = current&1;
+            epoch.slots[slot].readers[parity].fetch_add(1);
+            if (epoch.current.load() == current) break;
+            epoch.slots[slot].readers[parity].fetch_sub(1);
+        }
+    }
+    ~epoch_guard_t() {
+        epoch.slots[slot].readers[parity].fetch_sub(1);
+    }
+};
+
+// Publish the new snapshot of directory "inode" and retire the previous one
+static void dir_publish(unsigned int inode, dir_snapshot_t *snapshot) {
+    dir_snapshot_t *old = dir_snapshots[inode].exchange(snapshot);
+    if (old != nullptr) {
+        epoch.retire(old);
+    }
+}
+
+// Name tags of every directory: a 16-bit hash of the name in each direntry slot (0 for
+// a free slot), in the order of the directory's blocks. CREATE and DELETE, under the
+// directory's write lock, scan the tags instead of the blocks on disk, and read only
+// the blocks whose tags match.
+static vector<uint16_t> dir_tags[FS_DISKSIZE];
+
+static uint16_t name_tag(const char* name) {
+    uint32_t h = 2166136261u;
+    for (; *name != '\0'; name++) {
+        h = (h^(unsigned char)*name)*16777619u;
+    }
+    uint16_t tag = (uint16_t)(h^(h >> 16));
+    return tag == 0? 1: tag;
+}
+
+// Index of the first of n tags, from index "from" on, equal to tag; n if none. SSE2
+// compares 8 tags (one direntry block) per instruction.
+static unsigned int tag_find(const vector<uint16_t> &tags, uint16_t tag, unsigned int from) {
+    unsigned int i = from, n = tags.size();
+#ifdef __SSE2__
+    __m128i needle = _mm_set1_epi16((short)tag);
+    for (; i+8 <= n; i += 8) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)&tags[i]);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(chunk, needle));
+        if (mask != 0) {
+            return i+__builtin_ctz(mask)/2;
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (tags[i] == tag) { return i; }
+    }
+    return n;
+}
+
+// Index of the entry named name in a direntry block, or FS_DIRENTRIES. SSE2 compares
+// the first 16 bytes of a name in one instruction, and strcmp confirms a match.
+static unsigned int direntry_find(const fs_direntry* dirs, const char* name) {
+#ifdef __SSE2__
+    // the first 16 bytes of name, up to its terminator
+    char prefix[16] = {};
+    size_t length = strnlen(name, sizeof(prefix));
+    memcpy(prefix, name, length);
+    int want = (length < sizeof(prefix))? (1 << (length+1))-1: 0xffff;
+    __m128i needle = _mm_loadu_si128((const __m128i*)prefix);
+#endif
+    for (unsigned int j = 0; j < FS_DIRENTRIES; j++) {
+        if (dirs[j].inode_block == 0) continue;
+#ifdef __SSE2__
+        __m128i entry = _mm_loadu_si128((const __m128i*)dirs[j].name);
+        if ((_mm_movemask_epi8(_mm_cmpeq_epi8(entry, needle)) & want) != want) continue;
+#endif
+        if (strcmp(dirs[j].name, name) == 0) { return j; }
+    }
+    return FS_DIRENTRIES;
+}
+
 // Request: header+body+type
 struct request_t {
     string header;
     char *request_body;
+    unsigned long charge;                  // bytes held against the ingress budget
+    uint64_t start_ns;                     // arrival of the first byte
+    uint64_t recv_ns;                      // time to receive the whole request
+};
+struct pipeline_t;
+
+// Decoded request: everything needed to conduct it and to send the response
+struct operation_t {
+    request_type type = INVALID;
+    string username;
+    const char* password = nullptr;
+    unsigned int session = 0;
+    unsigned int sequence = 0;
+    bool tagged = false;                   // set once session and sequence are parsed
+    string pathname;
+    string new_pathname;                   // RENAME only
+    unsigned int block = 0;
+    char cr_type = '\0';
+    char write_data[FS_BLOCKSIZE];
+    char read_data[FS_BLOCKSIZE];
+    unsigned long order = 0;               // arrival order on a pipelined connection
+    bool started = false;                  // conducting began (pipelined requests)
+    shared_ptr<pipeline_t> pipe;           // pipelined connection the request came from
+    unsigned int lease_ms = 0;             // length of the read lease granted, if any
+    uint64_t start_ns = 0;                 // arrival of the first byte
+    uint64_t phase_times[NUM_PHASES] = {}; // time spent per phase before conducting
+    unsigned long charge = 0;              // bytes held against the ingress budget
+    bool replica = false;                  // replayed from the primary's log
 };
-enum request_type { SESSION, READ, WRITE, CREATE, DELETE, INVALID };
 
 
 /* Disk operations */
 
-// Traverse the path and conduct the corresponding operation on file system and disk.
-static bool conduct_operation(const string &path, const char* username, unsigned int offset,
-                              const char cr_type, const void* write_data, void* read_data,
-                              request_type rtype) {
-    if (rtype == SESSION) { return true; }
-    
-    // divide the path into tokens
-    vector<string> paths;
-    // '/' root directory is not valid here, get all tokens 
-    unsigned int i = 0, j;
-    unsigned int n = path.size();
-    string path_str(path);
-    /*
-        error handling:
-        1. Empty path name
-        2. The last character is '/'
-        3. The path isn't start from root directory
-    */
-    if (path_str.empty()) { return false; }
-    if (path_str[path_str.size()-1] == '/') { return false; }
-    if (path_str[0] != '/')  { return false; }
+static thread_local unsigned long disk_reads = 0;    // blocks read by this thread
+static thread_local unsigned long disk_writes = 0;   // blocks written by this thread
 
-    // parse the path name to file(dir)names
-    while (i < n) {
-        j = i+1;
-        while (j < n && path_str.at(j) != '/' && path_str.at(j) != '\0') {
-            j++;
-        }
-        if (j == i+1) { return false; }
-        if (j-i-1 > FS_MAXFILENAME) { return false; }
-        paths.push_back(path_str.substr(i+1, j-i-1));
-        i = j;
+// Timed access to the disk
+static void disk_read(unsigned int block, void* buf) {
+    phase_timer_t timer(PHASE_DISK);
+    disk_reads++;
+    disk_readblock(block, buf);
+}
+static void preserve_block(unsigned int block);
+static void disk_write(unsigned int block, const void* buf) {
+    phase_timer_t timer(PHASE_DISK);
+    if (block_born[block] < snap_seq) {
+        preserve_block(block);
     }
+    disk_writes++;
+    disk_writeblock(block, buf);
+}
 
-    // find inode pointing to aimed block
-    int inode_block = 0, inode_tmp;
-    int dir_block;
-    fs_inode *inode_buf = new fs_inode();
-    fs_direntry *dirs_buf = new fs_direntry[FS_DIRENTRIES];
-    
-    //if the operation is CREATE or DELETE, then reserve the former directory block
-    unsigned int path_depth = ((rtype == CREATE) || (rtype == DELETE))? paths.size()-1: paths.size();
-    if (path_depth == 0 && (rtype == DELETE || rtype == CREATE)) {              
-        mm_fs_locks.w_lock(inode_block);
-    } else {
-        mm_fs_locks.r_lock(inode_block);
+
+/* Snapshots */
+
+// A snapshot freezes the whole file system by bumping snap_seq, in O(1). Blocks are
+// shared with the live tree until the live tree overwrites or frees them: the first
+// write of a block born before a snapshot copies its old content to a free block,
+// and a freed block still in a snapshot is held instead of going back to the free
+// list. Each snapshot maps the live block numbers it diverged on to the block that
+// keeps its content (an exception table), and snap_refs counts the snapshots sharing
+// each such block. Snapshots are read through /.snapshot/<name>/<path>. They live in
+// memory only and are gone after a restart, which reclaims their blocks.
+static const char* SNAPSHOT_DIR = ".snapshot";
+
+struct fs_snapshot_t {
+    string name;
+    uint32_t seq;
+    bool valid;                                    // false once out of space for copies
+    unordered_map<uint32_t, uint32_t> exceptions;  // live block -> preserved block
+};
+
+struct snapshot_table_t {
+    list<fs_snapshot_t> snapshots;         // oldest first
+    unsigned int snap_refs[FS_DISKSIZE] = {};
+    mutex snap_lock;
+
+    fs_snapshot_t* find(const string &name) {
+        for (fs_snapshot_t &snap : snapshots) {
+            if (snap.name == name) { return &snap; }
+        }
+        return nullptr;
     }
-    
-    //Traverse the path, find the target inode and hold the relatived lock
-    for (i = 0; i < path_depth; i++) {
-        disk_readblock(inode_block, (void*)inode_buf);
-        char type = inode_buf->type; 
-        
-        // directory type check
-        if (type != 'd') { 
-            delete inode_buf;
-            delete [] dirs_buf;
-            mm_fs_locks.r_unlock(inode_block);
-            return false; 
+    // Snapshots that still share the live content of block; caller holds snap_lock
+    vector<fs_snapshot_t*> sharing(unsigned int block) {
+        vector<fs_snapshot_t*> found;
+        for (fs_snapshot_t &snap : snapshots) {
+            if (snap.valid && snap.seq > block_born[block] &&
+                snap.exceptions.find(block) == snap.exceptions.end()) {
+                found.push_back(&snap);
+            }
         }
-        // owners check
-        const char* owners = inode_buf->owner;
-        if (strcmp(owners, username) != 0 && strcmp("", owners) != 0) {
-            delete inode_buf;
-            delete [] dirs_buf;
-            mm_fs_locks.r_unlock(inode_block);
-            return false;
+        return found;
+    }
+    // Whether snapshots still share the live content of block. Stays true while the
+    // caller holds the mutation gate (shared), as no snapshot is taken meanwhile.
+    bool shared(unsigned int block) {
+        if (block_born[block] >= snap_seq) { return false; }
+        lock_guard<mutex> lock(snap_lock);
+        return !sharing(block).empty();
+    }
+    // Drop a snapshot's hold on its exception blocks; caller holds snap_lock
+    void release(fs_snapshot_t &snap) {
+        for (auto &exception : snap.exceptions) {
+            if (--snap_refs[exception.second] == 0) {
+                free_blocks_lock.lock();
+                num_block_remain++;
+                free_blocks.push_back(exception.second);
+                free_blocks_lock.unlock();
+            }
         }
-        uint32_t size = inode_buf->size;
-        // validate filename
-        bool find = false;
-        for (j = 0; j < size; j++) {
-            uint32_t blocknum = inode_buf->blocks[j];
-            dir_block = blocknum;
-            disk_readblock(dir_block, (void*)dirs_buf);
-            // one block 
-            for (unsigned int k = 0; k < FS_DIRENTRIES; k++) {
-                const char* name = dirs_buf[k].name;
-                if (strcmp(name, paths[i].c_str()) == 0) {
-                    inode_tmp = dirs_buf[k].inode_block;
-                    find = true;
-                    break;
+        snap.exceptions.clear();
+    }
+
+    // Copy the content of a live block about to be overwritten for the snapshots
+    // that share it. A snapshot that finds no free block for it becomes invalid.
+    void preserve(unsigned int block) {
+        lock_guard<mutex> lock(snap_lock);
+        vector<fs_snapshot_t*> found = sharing(block);
+        if (!found.empty()) {
+            free_blocks_lock.lock();
+            bool space = (num_block_remain >= 1);
+            unsigned int copy = 0;
+            if (space) {
+                num_block_remain--;
+                copy = pop_free_block();
+            }
+            free_blocks_lock.unlock();
+            if (space) {
+                char buf[FS_BLOCKSIZE];
+                disk_read(block, buf);
+                disk_write(copy, buf);
+                for (fs_snapshot_t *snap : found) {
+                    snap->exceptions[block] = copy;
+                }
+                snap_refs[copy] = found.size();
+            } else {
+                for (fs_snapshot_t *snap : found) {
+                    snap->valid = false;
+                    release(*snap);
                 }
             }
-            if (find == true) {
-                // hand-over-hand
-                if (path_depth == i+1 && (rtype != READ)) {
-                    mm_fs_locks.w_lock(inode_tmp);
-                } else {
-                    mm_fs_locks.r_lock(inode_tmp);
+        }
+        block_born[block] = snap_seq.load();
+    }
+    // Return a block the live tree no longer uses to the free list, unless snapshots
+    // still share it: then they hold it where it is
+    void free(unsigned int block) {
+        unique_lock<mutex> lock(snap_lock, defer_lock);
+        if (block_born[block] < snap_seq) {
+            lock.lock();
+            vector<fs_snapshot_t*> found = sharing(block);
+            if (!found.empty()) {
+                for (fs_snapshot_t *snap : found) {
+                    snap->exceptions[block] = block;
                 }
-                mm_fs_locks.r_unlock(inode_block);
-                inode_block = inode_tmp;
-                break;
+                snap_refs[block] = found.size();
+                return;
             }
         }
-        if (find == false) {
-            delete inode_buf;
-            delete [] dirs_buf;
-            mm_fs_locks.r_unlock(inode_block);
-            return false;
+        free_blocks_lock.lock();
+        num_block_remain++;
+        free_blocks.push_back(block);
+        free_blocks_lock.unlock();
+    }
+    // free() of many blocks, taking the locks once
+    void free_all(const vector<unsigned int> &blocks) {
+        lock_guard<mutex> lock(snap_lock);
+        vector<unsigned int> freed;
+        for (unsigned int block : blocks) {
+            if (block_born[block] < snap_seq) {
+                vector<fs_snapshot_t*> found = sharing(block);
+                if (!found.empty()) {
+                    for (fs_snapshot_t *snap : found) {
+                        snap->exceptions[block] = block;
+                    }
+                    snap_refs[block] = found.size();
+                    continue;
+                }
+            }
+            freed.push_back(block);
+        }
+        free_blocks_lock.lock();
+        num_block_remain += freed.size();
+        free_blocks.insert(free_blocks.end(), freed.begin(), freed.end());
+        free_blocks_lock.unlock();
+    }
+    // Read block of the file system as it was when snapshot "name" was taken
+    bool read(const string &name, unsigned int block, void *buf) {
+        lock_guard<mutex> lock(snap_lock);
+        fs_snapshot_t *snap = find(name);
+        if (snap == nullptr || !snap->valid) { return false; }
+        auto exception = snap->exceptions.find(block);
+        disk_read(exception == snap->exceptions.end()? block: exception->second, buf);
+        return true;
+    }
+
+    // Take a snapshot; caller holds the mutation gate exclusively
+    string create(const string &name) {
+        lock_guard<mutex> lock(snap_lock);
+        if (name.empty() || name.size() > FS_MAXFILENAME ||
+            name.find('/') != string::npos || find(name) != nullptr) {
+            return "error: invalid or existing snapshot name\n";
+        }
+        snapshots.push_back(fs_snapshot_t{name, ++snap_seq, true, {}});
+        return "ok\n";
+    }
+    string remove(const string &name) {
+        lock_guard<mutex> lock(snap_lock);
+        for (auto it = snapshots.begin(); it != snapshots.end(); it++) {
+            if (it->name == name) {
+                release(*it);
+                snapshots.erase(it);
+                return "ok\n";
+            }
+        }
+        return "error: no such snapshot\n";
+    }
+    string report() {
+        lock_guard<mutex> lock(snap_lock);
+        ostringstream out;
+        out << "{\"snapshots\":[";
+        for (fs_snapshot_t &snap : snapshots) {
+            out << (&snap == &snapshots.front()? "": ",") << "{\"name\":\"" << snap.name
+                << "\",\"seq\":" << snap.seq << ",\"valid\":" << (snap.valid? "true": "false")
+                << ",\"diverged_blocks\":" << snap.exceptions.size() << "}";
         }
+        unsigned int held = 0;
+        for (unsigned int refs : snap_refs) {
+            held += (refs > 0);
+        }
+        out << "],\"held_blocks\":" << held << "}\n";
+        return out.str();
     }
+};
+static snapshot_table_t snapshots;
 
-    delete [] dirs_buf;
+// Mutations hold the gate shared; taking a snapshot holds it exclusively, so that a
+// snapshot never sees an operation half done
+static rw_mutex_t mutation_gate;
 
-    // judge whether the finding inode is valid
-    disk_readblock(inode_block, (void*)inode_buf);
+static void preserve_block(unsigned int block) {
+    snapshots.preserve(block);
+}
 
-    // check owners
-    const char* owners = inode_buf->owner;
-    if (strcmp(owners, username)!=0 && strcmp("", owners)!=0) {
-        if (rtype != READ) {                        
-            mm_fs_locks.w_unlock(inode_block);
-        } else {
-            mm_fs_locks.r_unlock(inode_block);
+
+/* Log shipping */
+
+// While a hot standby is attached (see "Hot standby"), every successful mutation is
+// appended to the log, as a record the standby replays through conduct_operation. A
+// record names the operation's pathname, and is appended before the operation releases
+// its inode locks, and before lookups can find a name it creates. Paths are looked up
+// before anything is locked, though, so a rename could move what a path leads to in
+// between; the rename gate below orders renames against the other mutations, so that
+// each record is logged under the path its operation took effect at. Records are framed
+// as <size><NULL><record>, where the record is
+//     <kind> <username> <offset> <type><NULL><pathname><NULL><new pathname><NULL>[data]
+// kind is WRITE (APPEND is logged as the WRITE it became), CREATE, DELETE, DELETE_TREE,
+// RENAME, SNAPSHOT_CREATE or SNAPSHOT_DELETE (with the snapshot name as pathname);
+// type is the CREATE type, '-' otherwise.
+static const unsigned int MAX_RECORD = 32+FS_MAXUSERNAME+2*(FS_MAXPATHNAME+1)+FS_BLOCKSIZE;
+
+// While the log is active, a rename holds the gate exclusively from relinking the entry
+// until it is logged. Other mutations hold it shared, after taking their inode locks,
+// from checking that their path still leads to the inode they locked until they are
+// logged (see path_check_t).
+static rw_mutex_t rename_gate;
+
+struct log_t {
+    atomic<bool> active{false};            // a standby is attached
+    unsigned long limit = 64ul << 20;      // FS_LOG_KB: queued bytes before giving up
+    deque<string> records;                 // framed, not sent yet
+    unsigned long queued = 0;              // bytes in records
+    uint64_t appended = 0;
+    uint64_t dropped = 0;                  // standbys detached for falling behind
+    mutex lock;                            // lock for all of the above but active
+    condition_variable ready;              // signaled when records are appended
+
+    void append(const char* kind, const char* username, const string &path,
+                const string &new_path = "", unsigned int offset = 0, char type = '-',
+                const void* data = nullptr) {
+        if (!active.load(memory_order_relaxed)) { return; }
+        string record(string(kind)+" "+username+" "+to_string(offset)+" "+type);
+        record += '\0';
+        record += path;
+        record += '\0';
+        record += new_path;
+        record += '\0';
+        if (data != nullptr) {
+            record.append((const char*)data, FS_BLOCKSIZE);
         }
-        delete inode_buf;
-        return false;
+        string frame(to_string(record.size()));
+        frame += '\0';
+        frame += record;
+        lock_guard<mutex> lk(lock);
+        if (!active) { return; }
+        if (queued+frame.size() > limit) {
+            // the standby can't keep up; it has to attach again
+            detach();
+            dropped++;
+            return;
+        }
+        queued += frame.size();
+        records.push_back(move(frame));
+        appended++;
+        ready.notify_one();
+    }
+    // Stop logging and drop what wasn't sent; caller holds lock
+    void detach() {
+        active = false;
+        records.clear();
+        queued = 0;
+        ready.notify_all();
     }
+};
+static log_t op_log;
 
-    // Now: we have inode lock, and inode is owned by me. 
-    // Do error handling work according to request type.
-    fs_inode* inode = inode_buf;
+
+/* Deduplication */
+
+// Data blocks carry a reference count, since several files may share one. With
+// FS_DEDUP=1, written blocks are fingerprinted and a block whose content is already
+// stored becomes a reference to the stored block. A shared block is never written in
+// place: overwriting it through one file breaks the sharing. The startup scan counts
+// the references, and rebuilds the index of fingerprints when dedup is on.
+static bool dedup_enabled = false;                   // FS_DEDUP
+
+// Fast non-cryptographic fingerprint of a block, 8 bytes at a time. Matches are
+// checked against the stored content, so collisions only cost a comparison.
+static uint64_t block_fingerprint(const void* data) {
+    const char* bytes = (const char*)data;
+    uint64_t h = 0x9e3779b97f4a7c15ULL^FS_BLOCKSIZE;
+    for (unsigned int i = 0; i < FS_BLOCKSIZE; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes+i, 8);
+        h ^= word*0xff51afd7ed558ccdULL;
+        h = ((h << 31) | (h >> 33))*0x9e3779b97f4a7c15ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h^(h >> 29);
+}
+
+static bool data_read(uint32_t ptr, void* buf);
+
+// Reference counts are kept per disk block; a pack block counts each of its slots
+// in use. The index maps fingerprints to block pointers.
+struct dedup_t {
+    atomic<unsigned int> refs[FS_DISKSIZE];          // files referencing a data block
+    unordered_map<uint64_t, uint32_t> index;         // fingerprint -> block pointer
+    unordered_map<uint32_t, uint64_t> indexed;       // block pointer -> its fingerprint
+    mutex dedup_lock;
+    atomic<uint64_t> hashed{0};                      // blocks fingerprinted
+    atomic<uint64_t> hash_ns{0};
+    atomic<uint64_t> matched{0};                     // writes that found their content stored
+
+    uint64_t fingerprint(const void* data) {
+        uint64_t start = now_ns();
+        uint64_t h = block_fingerprint(data);
+        hash_ns.fetch_add(now_ns()-start, memory_order_relaxed);
+        hashed.fetch_add(1, memory_order_relaxed);
+        return h;
+    }
+    // caller holds dedup_lock
+    void unindex(uint32_t ptr) {
+        auto found = indexed.find(ptr);
+        if (found != indexed.end()) {
+            index.erase(found->second);
+            indexed.erase(found);
+        }
+    }
+    // A stored block with this content, with a reference taken for the caller
+    bool lookup(const void* data, uint64_t h, uint32_t &ptr) {
+        lock_guard<mutex> lock(dedup_lock);
+        auto found = index.find(h);
+        if (found == index.end()) { return false; }
+        char stored[FS_BLOCKSIZE];
+        if (!data_read(found->second, stored) || memcmp(stored, data, FS_BLOCKSIZE) != 0) {
+            return false;
+        }
+        ptr = found->second;
+        refs[data_block(ptr)]++;
+        matched.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+    void insert(uint64_t h, uint32_t ptr) {
+        lock_guard<mutex> lock(dedup_lock);
+        if (index.find(h) != index.end()) { return; }
+        index[h] = ptr;
+        indexed[ptr] = h;
+    }
+    // Whether the caller's file is the only one referencing an uncompressed block, in
+    // which case it may be overwritten in place (and leaves the index until it is written)
+    bool unshare(uint32_t ptr) {
+        lock_guard<mutex> lock(dedup_lock);
+        if ((ptr & PACKED) || refs[ptr] != 1) { return false; }
+        unindex(ptr);
+        return true;
+    }
+    // Drop a reference to a block; true if it was the last one, and the caller frees
+    // the block. Without dedup, no lookup can take a reference meanwhile and the count
+    // alone decides.
+    bool drop(unsigned int block) {
+        if (!dedup_enabled) {
+            return --refs[block] == 0;
+        }
+        lock_guard<mutex> lock(dedup_lock);
+        if (--refs[block] > 0) { return false; }
+        unindex(block);
+        for (uint32_t slot = 0; slot < PACK_SLOTS; slot++) {
+            unindex(PACKED | (slot << 16) | block);
+        }
+        return true;
+    }
+    void put(unsigned int block) {
+        if (drop(block)) {
+            snapshots.free(block);
+        }
+    }
+
+    string report() {
+        unsigned int blocks = 0, references = 0;
+        for (unsigned int block = 0; block < FS_DISKSIZE; block++) {
+            unsigned int n = refs[block];
+            blocks += (n > 0);
+            references += n;
+        }
+        uint64_t n = hashed;
+        return "{\"enabled\":"+string(dedup_enabled? "true": "false")+
+               ",\"data_blocks\":"+to_string(blocks)+
+               ",\"references\":"+to_string(references)+
+               ",\"blocks_saved\":"+to_string(references-blocks)+
+               ",\"writes_matched\":"+to_string(matched.load())+
+               ",\"blocks_hashed\":"+to_string(n)+
+               ",\"hash_ns_per_write\":"+to_string(n == 0? 0: hash_ns/n)+"}\n";
+    }
+};
+static dedup_t dedup;
+
+
+/* Compression */
+
+// With FS_COMPRESS=1, WRITE compresses each block with an LZ4-style codec: sequences
+// of literals and matches coded as in the LZ4 block format, without its end-of-block
+// rules (the decoder only needs the output to fill the block exactly). A block that
+// shrinks to at most half of a pack's space is appended to the pack block being
+// filled, which holds up to PACK_SLOTS of them, and the file points at its slot.
+// Other blocks are stored as they are. Slots are never rewritten: overwriting a
+// compressed block stores the new content elsewhere, and a pack block is freed
+// once none of its slots is referenced. Reads decompress either way, so a disk
+// written with compression on can be served with it off.
+static bool compress_enabled = false;                // FS_COMPRESS
+
+// Layout of a pack block: slot i holds the bytes from the end of slot i-1 (or the
+// header) to ends[i]
+struct pack_header_t {
+    uint16_t count;
+    uint16_t ends[PACK_SLOTS];
+};
+static const unsigned int PACK_MAX = (FS_BLOCKSIZE-sizeof(pack_header_t))/2;
+
+static const unsigned int LZ_MINMATCH = 4;
+static const unsigned int LZ_HASH_BITS = 10;
+
+static inline uint32_t lz_load32(const char* p) {
+    uint32_t word;
+    memcpy(&word, p, 4);
+    return word;
+}
+
+// Append a length that didn't fit its token nibble; false if out of room
+static bool lz_length(char* out, unsigned int &op, unsigned int cap, unsigned int length) {
+    for (; length >= 255; length -= 255) {
+        if (op >= cap) { return false; }
+        out[op++] = (char)255;
+    }
+    if (op >= cap) { return false; }
+    out[op++] = (char)length;
+    return true;
+}
+
+// One sequence: literals in[anchor..anchor+literals), then a match of length bytes
+// at offset back (none for the last sequence)
+static bool lz_sequence(const char* in, unsigned int anchor, unsigned int literals,
+                        unsigned int offset, unsigned int length,
+                        char* out, unsigned int &op, unsigned int cap) {
+    if (op >= cap) { return false; }
+    unsigned int token = op++;
+    unsigned int match = (length == 0)? 0: length-LZ_MINMATCH;
+    out[token] = (char)((min(literals, 15u) << 4) | min(match, 15u));
+    if (literals >= 15 && !lz_length(out, op, cap, literals-15)) { return false; }
+    if (op+literals > cap) { return false; }
+    memcpy(out+op, in+anchor, literals);
+    op += literals;
+    if (length == 0) { return true; }
+    if (op+2 > cap) { return false; }
+    out[op++] = (char)(offset & 0xff);
+    out[op++] = (char)(offset >> 8);
+    return match < 15 || lz_length(out, op, cap, match-15);
+}
+
+// Compress n bytes into at most cap bytes. Returns the compressed size, or 0 if it
+// doesn't fit.
+static unsigned int lz_compress(const char* in, unsigned int n, char* out, unsigned int cap) {
+    uint16_t table[1 << LZ_HASH_BITS] = {};    // last position of each hashed 4 bytes
+    unsigned int anchor = 0, op = 0;
+    for (unsigned int i = 1; i+LZ_MINMATCH <= n; ) {
+        uint32_t sequence = lz_load32(in+i);
+        uint32_t h = (sequence*2654435761u) >> (32-LZ_HASH_BITS);
+        unsigned int candidate = table[h];
+        table[h] = i;
+        if (lz_load32(in+candidate) != sequence) {
+            i++;
+            continue;
+        }
+        unsigned int length = LZ_MINMATCH;
+        while (i+length < n && in[candidate+length] == in[i+length]) {
+            length++;
+        }
+        if (!lz_sequence(in, anchor, i-anchor, i-candidate, length, out, op, cap)) { return 0; }
+        i += length;
+        anchor = i;
+    }
+    if (!lz_sequence(in, anchor, n-anchor, 0, 0, out, op, cap)) { return 0; }
+    return op;
+}
+
+// Decompress n bytes into exactly size bytes; false if the input is corrupt
+static bool lz_decompress(const char* in, unsigned int n, char* out, unsigned int size) {
+    unsigned int ip = 0, op = 0;
+    while (ip < n) {
+        unsigned int token = (unsigned char)in[ip++];
+        unsigned int literals = token >> 4;
+        if (literals == 15) {
+            unsigned int more;
+            do {
+                if (ip >= n) { return false; }
+                more = (unsigned char)in[ip++];
+                literals += more;
+            } while (more == 255);
+        }
+        if (ip+literals > n || op+literals > size) { return false; }
+        memcpy(out+op, in+ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == n) { break; }                // the last sequence has no match
+
+        if (ip+2 > n) { return false; }
+        unsigned int offset = (unsigned char)in[ip] | ((unsigned char)in[ip+1] << 8);
+        ip += 2;
+        unsigned int length = (token & 15)+LZ_MINMATCH;
+        if ((token & 15) == 15) {
+            unsigned int more;
+            do {
+                if (ip >= n) { return false; }
+                more = (unsigned char)in[ip++];
+                length += more;
+            } while (more == 255);
+        }
+        if (offset == 0 || offset > op || op+length > size) { return false; }
+        if (offset >= length) {
+            memcpy(out+op, out+op-offset, length);
+        } else if (offset == 1) {
+            memset(out+op, out[op-1], length);
+        } else {
+            for (unsigned int i = 0; i < length; i++) {
+                out[op+i] = out[op+i-offset];  // overlaps the bytes it produces
+            }
+        }
+        op += length;
+    }
+    return op == size;
+}
+
+// Content of the block ptr refers to, given the disk block holding it
+static bool unpack(uint32_t ptr, const char* block, void* buf) {
+    if (!(ptr & PACKED)) {
+        memcpy(buf, block, FS_BLOCKSIZE);
+        return true;
+    }
+    pack_header_t header;
+    memcpy(&header, block, sizeof(header));
+    unsigned int slot = (ptr >> 16) & 0xff;
+    if (slot >= header.count || slot >= PACK_SLOTS) { return false; }
+    unsigned int start = (slot == 0)? sizeof(header): header.ends[slot-1];
+    if (start > header.ends[slot] || header.ends[slot] > FS_BLOCKSIZE) { return false; }
+    return lz_decompress(block+start, header.ends[slot]-start, (char*)buf, FS_BLOCKSIZE);
+}
+
+static bool data_read(uint32_t ptr, void* buf) {
+    if (!(ptr & PACKED)) {
+        disk_read(ptr, buf);
+        return true;
+    }
+    char block[FS_BLOCKSIZE];
+    disk_read(data_block(ptr), block);
+    return unpack(ptr, block, buf);
+}
+
+struct packer_t {
+    mutex pack_lock;
+    uint32_t open = HOLE;                  // pack block being filled, with a reference
+    char buf[FS_BLOCKSIZE];                // ... and its content
+    unsigned int used = 0;
+    atomic<uint64_t> compressed{0};        // blocks stored compressed
+    atomic<uint64_t> stored{0};            // blocks stored as they are
+    atomic<uint64_t> bytes{0};             // compressed size of the compressed blocks
+    atomic<uint64_t> packs{0};             // pack blocks allocated
+    atomic<uint64_t> compress_ns{0};
+
+    // Compress a block into out; the size, or 0 if it isn't worth packing
+    unsigned int compress(const void* data, char* out) {
+        uint64_t start = now_ns();
+        unsigned int size = lz_compress((const char*)data, FS_BLOCKSIZE, out, PACK_MAX);
+        compress_ns.fetch_add(now_ns()-start, memory_order_relaxed);
+        if (size == 0) {
+            stored.fetch_add(1, memory_order_relaxed);
+        }
+        return size;
+    }
+    // Append compressed data to the pack being filled, with a reference taken for the
+    // caller. Returns the block pointer to it, or HOLE if the disk is out of space.
+    uint32_t store(const char* data, unsigned int size) {
+        lock_guard<mutex> lock(pack_lock);
+        pack_header_t header;
+        memcpy(&header, buf, sizeof(header));
+        if (open == HOLE || header.count == PACK_SLOTS || used+size > FS_BLOCKSIZE) {
+            free_blocks_lock.lock();
+            if (num_block_remain < 1) {
+                free_blocks_lock.unlock();
+                return HOLE;
+            }
+            num_block_remain--;
+            uint32_t block = pop_data_block();
+            free_blocks_lock.unlock();
+            dedup.refs[block] = 1;
+            if (open != HOLE) {
+                dedup.put(open);
+            }
+            open = block;
+            memset(buf, 0, FS_BLOCKSIZE);
+            header.count = 0;
+            used = sizeof(header);
+            packs.fetch_add(1, memory_order_relaxed);
+        }
+        uint32_t slot = header.count++;
+        memcpy(buf+used, data, size);
+        used += size;
+        header.ends[slot] = used;
+        memcpy(buf, &header, sizeof(header));
+        disk_write(open, buf);
+        dedup.refs[open]++;
+        compressed.fetch_add(1, memory_order_relaxed);
+        bytes.fetch_add(size, memory_order_relaxed);
+        return PACKED | (slot << 16) | open;
+    }
+
+    string report() {
+        uint64_t n = compressed+stored;
+        return "{\"enabled\":"+string(compress_enabled? "true": "false")+
+               ",\"blocks_compressed\":"+to_string(compressed.load())+
+               ",\"blocks_stored\":"+to_string(stored.load())+
+               ",\"compressed_bytes\":"+to_string(bytes.load())+
+               ",\"pack_blocks\":"+to_string(packs.load())+
+               ",\"compress_ns_per_write\":"+to_string(n == 0? 0: compress_ns/n)+"}\n";
+    }
+};
+static packer_t packer;
+
+// Fill page with the entries of directory inode dir from slot "from" on (see parse_req).
+// read_block(block, direts) reads a direntry block, entry_type(inode_block) gives the
+// type of an entry.
+template <typename read_block_t, typename entry_type_t>
+static bool readdir_page(const fs_inode *dir, unsigned int from, void *page,
+                         read_block_t read_block, entry_type_t entry_type) {
+    string entries;
+    fs_direntry direts[FS_DIRENTRIES];
+    unsigned int slot, slots = dir->size*FS_DIRENTRIES;
+    for (slot = from; slot < slots; slot++) {
+        if (slot == from || slot%FS_DIRENTRIES == 0) {
+            if (!read_block(dir->blocks[slot/FS_DIRENTRIES], direts)) { return false; }
+        }
+        const fs_direntry &entry = direts[slot%FS_DIRENTRIES];
+        if (entry.inode_block == 0) continue;
+        string record(1, entry_type(entry.inode_block));
+        record += entry.name;
+        record += '\0';
+        // room for the next slot, the entries and the empty entry that ends them
+        if (to_string(slot).size()+1+entries.size()+record.size()+1 > FS_BLOCKSIZE) {
+            break;
+        }
+        entries += record;
+    }
+    string next(slot < slots? to_string(slot): "0");
+    memset(page, 0, FS_BLOCKSIZE);
+    memcpy(page, next.c_str(), next.size()+1);
+    memcpy((char*)page+next.size()+1, entries.data(), entries.size());
+    return true;
+}
+
+// READ, READDIR or STAT of /.snapshot/<name>/<path>: the same traversal and checks as a
+// live request, on the blocks of the snapshot, without locks since they no longer change
+static bool snapshot_read(const vector<string> &paths, const char* username,
+                          request_type rtype, unsigned int offset, void* read_data) {
+    const string &name = paths[1];
+    fs_inode inode;
+    fs_direntry dirs[FS_DIRENTRIES];
+    unsigned int inode_block = 0;
+    for (unsigned int i = 2; i < paths.size(); i++) {
+        if (!snapshots.read(name, inode_block, &inode)) { return false; }
+        if (inode.type != 'd') { return false; }
+        if (strcmp(inode.owner, username) != 0 && strcmp("", inode.owner) != 0) { return false; }
+        bool find = false;
+        for (unsigned int j = 0; j < inode.size && !find; j++) {
+            if (!snapshots.read(name, inode.blocks[j], dirs)) { return false; }
+            unsigned int k = direntry_find(dirs, paths[i].c_str());
+            if (k < FS_DIRENTRIES) {
+                inode_block = dirs[k].inode_block;
+                find = true;
+            }
+        }
+        if (!find) { return false; }
+    }
+    if (!snapshots.read(name, inode_block, &inode)) { return false; }
+    if (strcmp(inode.owner, username) != 0 && strcmp("", inode.owner) != 0) { return false; }
+    if (rtype == STAT) {
+        memcpy(read_data, &inode, sizeof(inode));
+        return true;
+    }
+    if (rtype == READDIR) {
+        if (inode.type != 'd') { return false; }
+        fs_inode entry;
+        return readdir_page(&inode, offset, read_data,
+                            [&](unsigned int block, fs_direntry *direts) {
+            return snapshots.read(name, block, direts);
+        }, [&](unsigned int entry_block) {
+            return snapshots.read(name, entry_block, &entry)? entry.type: 'f';
+        });
+    }
+    if (inode.type != 'f' || offset >= inode.size) { return false; }
+    if (inode.blocks[offset] == HOLE) {
+        memset(read_data, 0, FS_BLOCKSIZE);
+        return true;
+    }
+    char block[FS_BLOCKSIZE];
+    if (!snapshots.read(name, data_block(inode.blocks[offset]), block)) { return false; }
+    return unpack(inode.blocks[offset], block, read_data);
+}
+
+// Holds the mutation gate shared for the scope of a mutating operation
+struct mutation_guard_t {
+    bool held;
+    mutation_guard_t(bool mutating) : held(mutating) {
+        if (held) { mutation_gate.read_lock(); }
+    }
+    ~mutation_guard_t() {
+        if (held) { mutation_gate.read_unlock(); }
+    }
+};
+
+// Find the entry "name" of directory inode dir (at dir_block) in the blocks whose tags
+// match it, and read the direntry block holding it into direts. Caller holds the
+// directory's lock.
+static bool dir_find(const fs_inode *dir, unsigned int dir_block, const char* name,
+                     unsigned int &block_num, unsigned int &dir_num, fs_direntry *direts) {
+    const vector<uint16_t> &tags = dir_tags[dir_block];
+    uint16_t tag = name_tag(name);
+    for (unsigned int i = tag_find(tags, tag, 0); i < tags.size();
+         i = tag_find(tags, tag, (i/FS_DIRENTRIES+1)*FS_DIRENTRIES)) {
+        disk_read(dir->blocks[i/FS_DIRENTRIES], direts);
+        dir_num = direntry_find(direts, name);
+        if (dir_num < FS_DIRENTRIES) {
+            block_num = i/FS_DIRENTRIES;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Remove entry dir_num of direntry block block_num (read into direts) from directory
+// inode dir (at dir_block), and unpublish it. A direntry block left empty is freed.
+// Caller holds the directory's write lock.
+static void dir_unlink(fs_inode *dir, unsigned int dir_block, unsigned int block_num,
+                       unsigned int dir_num, fs_direntry *direts) {
+    vector<uint16_t> &tags = dir_tags[dir_block];
+    string name(direts[dir_num].name);
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < FS_DIRENTRIES; i++) {
+        if (direts[i].inode_block != 0) {
+            count++;
+        }
+    }
+    bool empty = (count == 1);
+    if (empty) {
+        // modify inode
+        // shift following blocks in inode
+        unsigned int empty_block = dir->blocks[block_num];
+        for (unsigned int i = block_num; i+1 < dir->size; i++) {
+            dir->blocks[i] = dir->blocks[i+1];
+        }
+        dir->size--;
+        disk_write(dir_block, (void*)dir);
+        tags.erase(tags.begin()+block_num*FS_DIRENTRIES,
+                   tags.begin()+(block_num+1)*FS_DIRENTRIES);
+
+        // free the direntry block
+        snapshots.free(empty_block);
+    } else {
+        // modify direntry
+        direts[dir_num].inode_block = 0;
+        direts[dir_num].name[0] = '\0';
+        disk_write(dir->blocks[block_num], (void*)direts);
+        tags[block_num*FS_DIRENTRIES+dir_num] = 0;
+    }
+    dir_publish(dir_block, dir_snapshots[dir_block].load()->with(name, nullptr));
+}
+
+// Link "name" to ref in directory inode dir (at dir_block), in a free slot or in a new
+// direntry block, and publish it; before_publish, if given, runs once the entry is on
+// disk. False if the directory or the disk is full. Caller holds the directory's write
+// lock.
+static bool dir_link(fs_inode *dir, unsigned int dir_block, const char* name,
+                     const dir_ref_t &ref, const function<void()> &before_publish = nullptr) {
+    vector<uint16_t> &tags = dir_tags[dir_block];
+    fs_direntry direts[FS_DIRENTRIES];
+    unsigned int free_slot = tag_find(tags, 0, 0);
+    bool diret_found = (free_slot < tags.size());
+    unsigned int block_num = free_slot/FS_DIRENTRIES;
+    unsigned int dir_num = free_slot%FS_DIRENTRIES;
+    if (diret_found) {
+        disk_read(dir->blocks[block_num], direts);
+    } else {
+        if (dir->size == FS_MAXFILEBLOCKS) { return false; }
+        free_blocks_lock.lock();
+        if (num_block_remain < 1) {
+            free_blocks_lock.unlock();
+            return false;
+        }
+        num_block_remain--;
+        unsigned int block = pop_free_block();
+        free_blocks_lock.unlock();
+        for (unsigned int i = 0; i < FS_DIRENTRIES; i++) {
+            direts[i].inode_block = 0;
+        }
+        dir->blocks[dir->size++] = block;
+        block_num = dir->size-1;
+        dir_num = 0;
+        tags.resize(dir->size*FS_DIRENTRIES, 0);
+    }
+
+    strcpy(direts[dir_num].name, name);
+    direts[dir_num].inode_block = ref.inode_block;
+    disk_write(dir->blocks[block_num], (void*)direts);
+    tags[block_num*FS_DIRENTRIES+dir_num] = name_tag(name);
+    if (!diret_found) {
+        disk_write(dir_block, (void*)dir);
+    }
+    if (before_publish) {
+        before_publish();
+    }
+    dir_publish(dir_block, dir_snapshots[dir_block].load()->with(name, &ref));
+    return true;
+}
+
+// A tree locked by DELETE_TREE: its inodes and the blocks they use
+struct tree_t {
+    vector<unsigned int> inodes;           // parents before children
+    vector<unsigned int> dirs;             // the directories among them
+    vector<unsigned int> blocks;           // direntry blocks
+    vector<uint32_t> data;                 // file block pointers
+};
+
+// Write-lock the tree under inode_block, parents before children, and add it to tree.
+// False, with the inodes locked so far in tree, if any of them isn't owned by username.
+static bool lock_tree(unsigned int inode_block, const char* username, tree_t &tree) {
+    mm_fs_locks.w_lock(inode_block);
+    tree.inodes.push_back(inode_block);
+    fs_inode inode;
+    disk_read(inode_block, (void*)&inode);
+    if (strcmp(inode.owner, username) != 0) { return false; }
+    if (inode.type != 'd') {
+        for (unsigned int i = 0; i < inode.size; i++) {
+            if (inode.blocks[i] != HOLE) {
+                tree.data.push_back(inode.blocks[i]);
+            }
+        }
+        return true;
+    }
+
+    tree.dirs.push_back(inode_block);
+    fs_direntry direts[FS_DIRENTRIES];
+    for (unsigned int i = 0; i < inode.size; i++) {
+        tree.blocks.push_back(inode.blocks[i]);
+        disk_read(inode.blocks[i], direts);
+        for (unsigned int j = 0; j < FS_DIRENTRIES; j++) {
+            if (direts[j].inode_block == 0) continue;
+            if (!lock_tree(direts[j].inode_block, username, tree)) { return false; }
+        }
+    }
+    return true;
+}
+
+// Free every block of a tree locked by lock_tree, unpublish its directories, tell
+// lookups that its inodes are gone, and unlock it
+static void free_tree(tree_t &tree) {
+    for (unsigned int dir : tree.dirs) {
+        dir_publish(dir, nullptr);
+        dir_tags[dir].clear();
+    }
+    for (unsigned int inode : tree.inodes) {
+        inode_gen[inode]++;
+    }
+    vector<unsigned int> &blocks = tree.blocks;
+    blocks.insert(blocks.end(), tree.inodes.begin(), tree.inodes.end());
+    for (uint32_t ptr : tree.data) {
+        if (dedup.drop(data_block(ptr))) {
+            blocks.push_back(data_block(ptr));
+        }
+    }
+    snapshots.free_all(blocks);
+    for (unsigned int inode : tree.inodes) {
+        mm_fs_locks.w_unlock(inode);
+    }
+}
+
+// Divide pathname into its file(dir)names; none for the root directory, which is valid
+// only if root is set
+static bool split_path(const string &path, bool root, vector<string> &paths) {
+    // '/' root directory is not valid here, get all tokens 
+    unsigned int i = 0, j;
+    unsigned int n = path.size();
+    /*
+        error handling:
+        1. Empty path name
+        2. The last character is '/'
+        3. The path isn't start from root directory
+    */
+    if (path.empty()) { return false; }
+    if (path[n-1] == '/' && !(root && path == "/")) { return false; }
+    if (path[0] != '/')  { return false; }
+
+    // parse the path name to file(dir)names
+    if (n == 1) { n = 0; }
+    while (i < n) {
+        j = i+1;
+        while (j < n && path.at(j) != '/' && path.at(j) != '\0') {
+            j++;
+        }
+        if (j == i+1) { return false; }
+        if (j-i-1 > FS_MAXFILENAME) { return false; }
+        paths.push_back(path.substr(i+1, j-i-1));
+        i = j;
+    }
+    return true;
+}
+
+// Traverse the first depth names of paths in the directory snapshots, without locks.
+// Every directory on the way must be owned by username (or by everyone). Gives the inode
+// found, and its generation when it was linked.
+static bool path_lookup(const vector<string> &paths, unsigned int depth, const char* username,
+                        unsigned int &inode_block, uint32_t &gen) {
+    inode_block = 0;
+    gen = 0;
+    epoch_guard_t guard;
+    for (unsigned int i = 0; i < depth; i++) {
+        dir_snapshot_t *dir = dir_snapshots[inode_block].load();
+
+        // directory type check (and that it was not deleted since it was found)
+        if (dir == nullptr || dir->gen != gen) { return false; }
+        // owners check
+        if (dir->owner != username && !dir->owner.empty()) { return false; }
+        // validate filename
+        const dir_ref_t *entry = dir->find(paths[i]);
+        if (entry == nullptr) { return false; }
+        inode_block = entry->inode_block;
+        gen = entry->gen;
+    }
+    return true;
+}
+
+// Holds the rename gate shared for the scope of a mutation that passed check(), while
+// the log is active
+struct path_check_t {
+    bool held = false;
+    // Check that paths (to depth) still leads to inode_block, which the caller has
+    // locked, along with any other inode it locks. If a rename moved it since the lookup,
+    // the operation fails as if the lookup had come later.
+    bool check(const vector<string> &paths, unsigned int depth, const char* username,
+               unsigned int inode_block, uint32_t gen) {
+        if (!op_log.active) { return true; }
+        rename_gate.read_lock();
+        held = true;
+        unsigned int found_block;
+        uint32_t found_gen;
+        return path_lookup(paths, depth, username, found_block, found_gen) &&
+               found_block == inode_block && found_gen == gen;
+    }
+    ~path_check_t() {
+        if (held) { rename_gate.read_unlock(); }
+    }
+};
+
+// Traverse the path and conduct the corresponding operation on file system and disk.
+static bool conduct_operation(const string &path, const char* username, unsigned int offset,
+                              const char cr_type, const void* write_data, void* read_data,
+                              request_type rtype) {
+    if (rtype == SESSION) { return true; }
+    
+    // divide the path into tokens
+    vector<string> paths;
+    if (!split_path(path, rtype == READDIR || rtype == STAT, paths)) { return false; }
+
+    // snapshots are read-only
+    if (!paths.empty() && paths[0] == SNAPSHOT_DIR) {
+        if (rtype == READ && paths.size() >= 3) {
+            return snapshot_read(paths, username, rtype, offset, read_data);
+        }
+        if ((rtype == READDIR || rtype == STAT) && paths.size() >= 2) {
+            return snapshot_read(paths, username, rtype, offset, read_data);
+        }
+        return false;
+    }
+    mutation_guard_t guard(rtype != READ && rtype != READDIR && rtype != STAT);
+
+    // find inode pointing to aimed block
+    unsigned int inode_block = 0;
+    uint32_t gen = 0;
+    fs_inode *inode_buf = new fs_inode();
+    
+    //if the operation is CREATE or DELETE, then reserve the former directory block
+    unsigned int path_depth = ((rtype == CREATE) || (rtype == DELETE) || (rtype == DELETE_TREE))?
+                              paths.size()-1: paths.size();
+
+    if (!path_lookup(paths, path_depth, username, inode_block, gen)) {
+        delete inode_buf;
+        return false;
+    }
+
+    // Lock the inode the operation works on. If it was deleted after the lookup found
+    // it, the operation fails as if the lookup had come later.
+    bool exclusive = (rtype != READ && rtype != WRITE && rtype != READDIR && rtype != STAT);
+    if (exclusive) {
+        mm_fs_locks.w_lock(inode_block);
+    } else {
+        mm_fs_locks.r_lock(inode_block);
+    }
+    if (inode_gen[inode_block] != gen) {
+        if (exclusive) {
+            mm_fs_locks.w_unlock(inode_block);
+        } else {
+            mm_fs_locks.r_unlock(inode_block);
+        }
+        delete inode_buf;
+        return false;
+    }
+
+    // judge whether the finding inode is valid
+    disk_read(inode_block, (void*)inode_buf);
+
+    // A WRITE within the file holds it shared, and locks just the block it overwrites.
+    // Growing the file, filling a hole, or changing which block it points to (with
+    // dedup or compression, or to stop sharing a block) needs the inode exclusively.
+    // No lock is held between dropping the shared lock and taking it exclusively, so
+    // the file may be deleted (and its inode block reused) in between: the generation
+    // check then fails the write, as if the lookup had come after the delete.
+    if (rtype == WRITE && (offset >= inode_buf->size || inode_buf->blocks[offset] == HOLE ||
+                           dedup_enabled || compress_enabled || (inode_buf->blocks[offset] & PACKED) ||
+                           dedup.refs[inode_buf->blocks[offset]] > 1)) {
+        mm_fs_locks.r_unlock(inode_block);
+        mm_fs_locks.w_lock(inode_block);
+        exclusive = true;
+        if (inode_gen[inode_block] != gen) {
+            mm_fs_locks.w_unlock(inode_block);
+            delete inode_buf;
+            return false;
+        }
+        disk_read(inode_block, (void*)inode_buf);
+    }
+
+    // check owners
+    const char* owners = inode_buf->owner;
+    if (strcmp(owners, username)!=0 && strcmp("", owners)!=0) {
+        if (exclusive) {                        
+            mm_fs_locks.w_unlock(inode_block);
+        } else {
+            mm_fs_locks.r_unlock(inode_block);
+        }
+        delete inode_buf;
+        return false;
+    }
+
+    // Now: we have inode lock, and inode is owned by me. 
+    // Do error handling work according to request type.
+    fs_inode* inode = inode_buf;
     bool error = false;
+    path_check_t path_check;
+
+    // APPEND is a WRITE at the end of the file, which can't move while the inode is
+    // held exclusively. The offset used goes to read_data.
+    if (rtype == APPEND) {
+        offset = inode->size;
+        memcpy(read_data, &offset, sizeof(offset));
+        rtype = WRITE;
+    }
     switch (rtype) {
         // READ: check inode type and read block offset
         case READ: {
@@ -305,8 +1844,20 @@ static bool conduct_operation(const string &path, const char* username, unsigned
 
             block_idx = inode->blocks[offset];
             
-            // read the data
-            disk_readblock(block_idx, read_data);
+            // read the data; a hole reads as zeros without touching the disk
+            if (block_idx == HOLE) {
+                memset(read_data, 0, FS_BLOCKSIZE);
+            } else {
+                block_locks.r_lock(inode_block, offset);
+                bool read = data_read(block_idx, read_data);
+                block_locks.r_unlock(inode_block, offset);
+                if (!read) {
+                    // corrupt compressed block
+                    delete inode;
+                    mm_fs_locks.r_unlock(inode_block);
+                    return false;
+                }
+            }
 
             mm_fs_locks.r_unlock(inode_block);
             break;
@@ -321,50 +1872,107 @@ static bool conduct_operation(const string &path, const char* username, unsigned
                 // not a file
                 error = true;
             }
-            if (offset > inode->size) {
-                // offset out of range
-                error = true;
-            }
             if (offset >= FS_MAXFILEBLOCKS) {
                 // file is out of space
                 error = true;
             }
+            if (!error && !path_check.check(paths, path_depth, username, inode_block, gen)) {
+                // moved by a rename
+                error = true;
+            }
             if (error) {
                 delete inode;
-                mm_fs_locks.w_unlock(inode_block);
+                if (exclusive) {
+                    mm_fs_locks.w_unlock(inode_block);
+                } else {
+                    mm_fs_locks.r_unlock(inode_block);
+                }
                 return false;
             }
 
-            if (offset == inode->size) {
-                //need to allocate new block
-                free_blocks_lock.lock();
-                if (num_block_remain < 1) {
-                    // disk is out of space
-                    delete inode;
-                    free_blocks_lock.unlock();
-                    mm_fs_locks.w_unlock(inode_block);
-                    return false;
-                }
-
-                num_block_remain--;
-                block_idx = free_blocks.front();
-                free_blocks.pop_front();
-                free_blocks_lock.unlock();
-            } else {
-                block_idx = inode->blocks[offset];
+            // the block the file has at offset: none past the end of the file or in a hole
+            uint32_t old_block = (offset < inode->size)? inode->blocks[offset]: HOLE;
+            uint64_t fingerprint = 0;
+            bool matched = false;              // the content is stored already
+            bool packed = false;               // the content went compressed into a pack
+            if (dedup_enabled) {
+                fingerprint = dedup.fingerprint(write_data);
+                matched = dedup.lookup(write_data, fingerprint, block_idx);
+            }
+            if (!matched && compress_enabled) {
+                char compressed[PACK_MAX];
+                unsigned int size = packer.compress(write_data, compressed);
+                if (size > 0) {
+                    block_idx = packer.store(compressed, size);
+                    if (block_idx == HOLE) {
+                        // disk is out of space
+                        delete inode;
+                        mm_fs_locks.w_unlock(inode_block);
+                        return false;
+                    }
+                    packed = true;
+                }
             }
 
-            // write file block
-            disk_writeblock(block_idx, write_data);
+            if (!matched && !packed) {
+                // overwrite in place a block no other file shares, otherwise allocate one
+                bool allocate = (old_block == HOLE || (exclusive && !dedup.unshare(old_block)));
+                if (allocate) {
+                    //need to allocate new block
+                    free_blocks_lock.lock();
+                    if (num_block_remain < 1) {
+                        // disk is out of space
+                        delete inode;
+                        free_blocks_lock.unlock();
+                        mm_fs_locks.w_unlock(inode_block);
+                        return false;
+                    }
+
+                    num_block_remain--;
+                    block_idx = pop_data_block();
+                    free_blocks_lock.unlock();
+                    dedup.refs[block_idx] = 1;
+                } else {
+                    block_idx = old_block;
+                }
+
+                // write file block
+                if (exclusive) {
+                    disk_write(block_idx, write_data);
+                } else {
+                    block_locks.w_lock(inode_block, offset);
+                    disk_write(block_idx, write_data);
+                    op_log.append("WRITE", username, path, "", offset, '-', write_data);
+                    block_locks.w_unlock(inode_block, offset);
+                }
+            }
+            if (dedup_enabled && !matched) {
+                dedup.insert(fingerprint, block_idx);
+            }
 
-            // modify inode
-            if (offset == inode->size) {
-                inode->size++;
+            // point the file at the new block; blocks skipped by a write past the end
+            // become holes
+            if (block_idx != old_block) {
+                for (unsigned int i = inode->size; i < offset; i++) {
+                    inode->blocks[i] = HOLE;
+                }
+                inode->size = max(inode->size, offset+1);
                 inode->blocks[offset] = block_idx;
-                disk_writeblock(inode_block, (void*)inode);            
+                disk_write(inode_block, (void*)inode);            
+                if (old_block != HOLE) {
+                    dedup.put(data_block(old_block));
+                }
+            } else if (matched) {
+                // the file had this content already
+                dedup.put(data_block(old_block));
             }
 
-            mm_fs_locks.w_unlock(inode_block);
+            if (exclusive) {
+                op_log.append("WRITE", username, path, "", offset, '-', write_data);
+                mm_fs_locks.w_unlock(inode_block);
+            } else {
+                mm_fs_locks.r_unlock(inode_block);
+            }
             break;
         }
         
@@ -379,77 +1987,36 @@ static bool conduct_operation(const string &path, const char* username, unsigned
                 return false;
             }
 
-            // not a directory
-            if (inode->type != 'd') {
+            // not a directory, or moved by a rename
+            if (inode->type != 'd' ||
+                !path_check.check(paths, path_depth, username, inode_block, gen)) {
                 delete inode;
                 mm_fs_locks.w_unlock(inode_block);
                 return false;
             }
             
-            // find an empty dir-entry in current size of inode
-            bool diret_found = false;
-            unsigned int block_num = 0, dir_num = 0;
-            fs_direntry *tmp_direts, *fd_direts;
-            tmp_direts = new fs_direntry[FS_DIRENTRIES];
-            fd_direts  = new fs_direntry[FS_DIRENTRIES];
-            for (unsigned int i = 0; i < inode->size; i++) {
-                unsigned int block_idx = inode->blocks[i];
-                disk_readblock(block_idx, tmp_direts);
-                for (unsigned int j = 0; j < FS_DIRENTRIES; j++) {
-                    if (tmp_direts[j].inode_block == 0 && !diret_found) { 
-                        diret_found = true;
-                        block_num = i;
-                        dir_num = j;
-                        memcpy(fd_direts, tmp_direts, sizeof(fs_direntry)*FS_DIRENTRIES);
-                    }
-                    if ((tmp_direts[j].inode_block != 0) && (strcmp(tmp_direts[j].name, name) == 0)) {
-                        delete [] tmp_direts;
-                        delete [] fd_direts;
-                        delete inode;
-                        mm_fs_locks.w_unlock(inode_block);
-                        return false;
-                    }
-                }
-            }
-            delete [] tmp_direts;
-
-            // error handling
-            if (!diret_found && inode->size == FS_MAXFILEBLOCKS) {
-                delete inode;
+            // duplicate creation
+            unsigned int block_num, dir_num;
+            fs_direntry *fd_direts = new fs_direntry[FS_DIRENTRIES];
+            if (dir_find(inode, inode_block, name, block_num, dir_num, fd_direts)) {
                 delete [] fd_direts;
+                delete inode;
                 mm_fs_locks.w_unlock(inode_block);
                 return false;
             }
 
-            free_blocks_lock.lock();
-            if (diret_found) {
-                // need 1 free block
-                if (num_block_remain < 1) {
-                    error = true;
-                } else {
-                    num_block_remain--;
-                }
-            } else {
-                // need 2 free block
-                if (num_block_remain < 2) {
-                    error = true;
-                } else {
-                    num_block_remain -= 2;
-                }
-            }
-            free_blocks_lock.unlock();
+            delete [] fd_direts;
 
-            if (error) {
+            // create new inode
+            free_blocks_lock.lock();
+            if (num_block_remain < 1) {
+                free_blocks_lock.unlock();
                 delete inode;
-                delete [] fd_direts;
                 mm_fs_locks.w_unlock(inode_block);
                 return false;
             }
-                
-            // create new inode
-            free_blocks_lock.lock();
-            unsigned int inode_idx = free_blocks.front();
-            free_blocks.pop_front();
+            num_block_remain--;
+            unsigned int inode_idx = pop_free_block();
             free_blocks_lock.unlock();
             fs_inode new_inode;
 
@@ -457,32 +2024,36 @@ static bool conduct_operation(const string &path, const char* username, unsigned
             new_inode.size = 0;
             strcpy(new_inode.owner, username);
 
-            disk_writeblock(inode_idx, (void*)(&new_inode));
-            mm_fs_locks.add_lock(inode_idx);
+            disk_write(inode_idx, (void*)(&new_inode));
+            if (cr_type == 'd') {
+                dir_tags[inode_idx].clear();
+            }
 
             // create direntry in directory
-            if (!diret_found) {
+            dir_ref_t ref{inode_idx, inode_gen[inode_idx]};
+            bool linked = dir_link(inode, inode_block, name, ref, [&] {
+                // log it before lookups can find the new entry and work below it
+                op_log.append("CREATE", username, path, "", 0, cr_type);
+
+                // publish the new directory to lookups, before its entry
+                if (cr_type == 'd') {
+                    dir_snapshot_t *created = new dir_snapshot_t();
+                    created->gen = inode_gen[inode_idx];
+                    created->owner = username;
+                    dir_publish(inode_idx, created);
+                }
+            });
+            if (!linked) {
+                // no room for the entry: give the inode block back
                 free_blocks_lock.lock();
-                int block = free_blocks.front();
-                free_blocks.pop_front();
+                num_block_remain++;
+                free_blocks.push_front(inode_idx);
                 free_blocks_lock.unlock();
-                dir_num = 0;
-                for (unsigned int i = 0; i < FS_DIRENTRIES; i++) {
-                    fd_direts[i].inode_block = 0;
-                }
-                inode->blocks[inode->size++] = block;
-                block_num = inode->size-1;
-            } 
-
-            strcpy(fd_direts[dir_num].name, name);
-            fd_direts[dir_num].inode_block = inode_idx;
-            disk_writeblock(inode->blocks[block_num], (void*)fd_direts);
-
-            if (!diret_found) {
-                disk_writeblock(inode_block, (void*)inode);
+                delete inode;
+                mm_fs_locks.w_unlock(inode_block);
+                return false;
             }
 
-            delete [] fd_direts;
             mm_fs_locks.w_unlock(inode_block);
             break;
         }
@@ -499,32 +2070,12 @@ static bool conduct_operation(const string &path, const char* username, unsigned
             }
 
             // find the direntry point to the directory or file
-            bool diret_found = false;
             unsigned int block_num = 0, dir_num = 0;
-            fs_direntry *tmp_direts, *fd_direts;
-            tmp_direts = new fs_direntry[FS_DIRENTRIES];
-            fd_direts  = new fs_direntry[FS_DIRENTRIES];
-            for (unsigned int i = 0; i < inode->size; i++) {
-                unsigned int block_idx = inode->blocks[i];
-                disk_readblock(block_idx, tmp_direts);
-                for (unsigned int j = 0; j < FS_DIRENTRIES; j++) {
-                    if (tmp_direts[j].inode_block == 0) continue; 
-                    if (strcmp(tmp_direts[j].name, name) != 0) continue;
-                    diret_found = true;
-                    block_num = i;
-                    dir_num = j;
-                    memcpy(fd_direts, tmp_direts, sizeof(fs_direntry)*FS_DIRENTRIES);
-                    break;
-                }
-                if (diret_found) {
-                    break;
-                }
-            }
-            delete [] tmp_direts;
-
-            if (!diret_found) { 
+            fs_direntry *fd_direts = new fs_direntry[FS_DIRENTRIES];
+            if (!dir_find(inode, inode_block, name, block_num, dir_num, fd_direts)) { 
                 // pathname not exist
                 delete inode;
+                delete [] fd_direts;
                 mm_fs_locks.w_unlock(inode_block);
                 return false;
             }
@@ -533,7 +2084,7 @@ static bool conduct_operation(const string &path, const char* username, unsigned
             fs_inode inode_del;
 
             mm_fs_locks.w_lock(inode_del_idx);
-            disk_readblock(inode_del_idx, (void*)(&inode_del));
+            disk_read(inode_del_idx, (void*)(&inode_del));
             if (inode_del.type == 'd' && inode_del.size > 0) {
                 // directory not empty
                 error = true;
@@ -542,6 +2093,10 @@ static bool conduct_operation(const string &path, const char* username, unsigned
                 // owner not right
                 error = true;
             }
+            if (!error && !path_check.check(paths, path_depth, username, inode_block, gen)) {
+                // moved by a rename
+                error = true;
+            }
             if (error) {
                 delete inode;
                 delete [] fd_direts;
@@ -551,33 +2106,7 @@ static bool conduct_operation(const string &path, const char* username, unsigned
             }
           
             // modify the directory
-            unsigned int count = 0;
-            for (unsigned int i = 0; i < FS_DIRENTRIES; i++) {
-                if (fd_direts[i].inode_block != 0) {
-                    count++;
-                }
-            }
-            bool empty = (count == 1);
-            if (empty) {
-                // modify inode
-                // shift following blocks in inode
-                for (unsigned int i = block_num; i+1 < inode->size; i++) {
-                    inode->blocks[i] = inode->blocks[i+1];
-                }
-                inode->size--;
-                disk_writeblock(inode_block, (void*)inode);
-
-                // free the direntry block
-                free_blocks_lock.lock();
-                num_block_remain++;
-                free_blocks.push_back(inode->blocks[block_num]);
-                free_blocks_lock.unlock();
-            } else {
-                // modify direntry
-                fd_direts[dir_num].inode_block = 0;
-                fd_direts[dir_num].name[0] = '\0';
-                disk_writeblock(inode->blocks[block_num], (void*)fd_direts);
-            }
+            dir_unlink(inode, inode_block, block_num, dir_num, fd_direts);
                 
             // clear the blocks of dir or file
             if (inode_del.type == 'f') {
@@ -585,425 +2114,2935 @@ static bool conduct_operation(const string &path, const char* username, unsigned
                 int size = inode_del.size;
                 inode_del.size = 0;
                 for (int i = 0; i < size; i++) {
-                    free_blocks_lock.lock();
-                    num_block_remain++;
-                    free_blocks.push_back(inode_del.blocks[i]);
-                    free_blocks_lock.unlock();
+                    if (inode_del.blocks[i] == HOLE) continue;
+                    dedup.put(data_block(inode_del.blocks[i]));
                 }
             }
-            free_blocks_lock.lock();
-            num_block_remain++;
-            free_blocks.push_back(inode_del_idx);
-            free_blocks_lock.unlock();
+            // unpublish the directory, and tell lookups that already found the inode
+            // that it is gone
+            if (inode_del.type == 'd') {
+                dir_publish(inode_del_idx, nullptr);
+            }
+            inode_gen[inode_del_idx]++;
+
+            snapshots.free(inode_del_idx);
 
             delete [] fd_direts;
+            op_log.append("DELETE", username, path);
             mm_fs_locks.w_unlock(inode_del_idx);
-            mm_fs_locks.delete_lock(inode_del_idx);
             mm_fs_locks.w_unlock(inode_block);
             break;
         }
 
+        // DELETE_TREE: like DELETE, for a file or a whole directory tree. The tree is
+        // write-locked, and checked to be all owned by the user, before any of it is
+        // deleted.
+        case DELETE_TREE: {
+            const char* name = paths.back().c_str();
+
+            // not a directory
+            if (inode->type != 'd') {
+                delete inode;
+                mm_fs_locks.w_unlock(inode_block);
+                return false;
+            }
+
+            unsigned int block_num = 0, dir_num = 0;
+            fs_direntry direts[FS_DIRENTRIES];
+            if (!dir_find(inode, inode_block, name, block_num, dir_num, direts)) {
+                // pathname not exist
+                delete inode;
+                mm_fs_locks.w_unlock(inode_block);
+                return false;
+            }
+
+            tree_t tree;
+            if (!lock_tree(direts[dir_num].inode_block, username, tree) ||
+                !path_check.check(paths, path_depth, username, inode_block, gen)) {
+                // owner not right, or moved by a rename
+                for (unsigned int locked : tree.inodes) {
+                    mm_fs_locks.w_unlock(locked);
+                }
+                delete inode;
+                mm_fs_locks.w_unlock(inode_block);
+                return false;
+            }
+
+            dir_unlink(inode, inode_block, block_num, dir_num, direts);
+            free_tree(tree);
+            op_log.append("DELETE_TREE", username, path);
+            mm_fs_locks.w_unlock(inode_block);
+            break;
+        }
+
+        // STAT: the inode goes to read_data
+        case STAT: {
+            memcpy(read_data, inode, sizeof(fs_inode));
+            mm_fs_locks.r_unlock(inode_block);
+            break;
+        }
+
+        // READDIR: one page of entries from slot offset on (see parse_req)
+        case READDIR: {
+            if (inode->type != 'd') {
+                delete inode;
+                mm_fs_locks.r_unlock(inode_block);
+                return false;
+            }
+
+            // While the directory is locked its entries can't be deleted, so the type
+            // of an entry is whether it has a directory snapshot
+            readdir_page(inode, offset, read_data, [](unsigned int block, fs_direntry *direts) {
+                disk_read(block, direts);
+                return true;
+            }, [](unsigned int entry_block) {
+                return dir_snapshots[entry_block].load() == nullptr? 'f': 'd';
+            });
+
+            mm_fs_locks.r_unlock(inode_block);
+            break;
+        }
+
         default: { break; }
     } 
     delete inode;
     return true;
 }
 
+// Serializes renames, so that no other rename moves a directory between the lookups of
+// a rename and its locks
+static mutex rename_lock;
 
-/* utility functions */
+// RENAME: move the entry of "from" to "to", in its directory or into another one,
+// without touching the inode it links or that inode's blocks. Besides the two parent
+// directories, a rename write-locks their nearest common ancestor before them:
+// DELETE_TREE locks parents before children, so it can't then hold one parent while
+// it waits for the other.
+static bool conduct_rename(const string &from, const string &to, const char* username) {
+    vector<string> src, dst;
+    if (!split_path(from, false, src) || !split_path(to, false, dst)) { return false; }
+    if (src[0] == SNAPSHOT_DIR || dst[0] == SNAPSHOT_DIR) { return false; }
+    // a directory can't move below itself
+    if (dst.size() >= src.size() && equal(src.begin(), src.end(), dst.begin())) {
+        return false;
+    }
+    mutation_guard_t guard(true);
+    lock_guard<mutex> rename_guard(rename_lock);
 
-// count the number of spaces in a c_string
-static unsigned int count_spaces(const char* str) {
-    int c = 0;
-    for (int i = 0; str[i] != '\0'; i++) {
-        if (str[i] == ' ') {
-            c++;
-        }
+    // the common ancestor, the source parent and the destination parent
+    unsigned int common = 0;
+    while (common+1 < src.size() && common+1 < dst.size() && src[common] == dst[common]) {
+        common++;
     }
-    return c;
-}
+    const vector<string> *paths[3] = {&src, &src, &dst};
+    unsigned int depths[3] = {common, (unsigned int)src.size()-1, (unsigned int)dst.size()-1};
+    unsigned int blocks[3];
+    uint32_t gens[3];
+    for (unsigned int k = 0; k < 3; k++) {
+        if (!path_lookup(*paths[k], depths[k], username, blocks[k], gens[k])) { return false; }
+    }
+    unsigned int src_block = blocks[1], dst_block = blocks[2];
 
-// Transfer a c-string to an unsigned integer.
-// Return true if success, false if failed
-static bool cvt_int(const char* str, int size, unsigned int &num) {
-    if (size==0) { return false; }
-    long long long_int = 0;
-    for (int i = 0; i < size; i++) {
-        if (!isdigit(str[i])) { return false; }
-        long_int = long_int*10 + str[i]-'0';
-    } 
-    if (size > 1 && str[0] == '0') { return false; }
-    if (long_int > numeric_limits<unsigned int>::max()) { return false; }
-    num = (unsigned int)long_int;
-    return true;
-}
+    // lock, and check that none was deleted since its lookup; the ancestor is only
+    // needed while the parents are locked
+    vector<unsigned int> locked;
+    bool error = false;
+    for (unsigned int k = 0; k < 3; k++) {
+        if (find(locked.begin(), locked.end(), blocks[k]) != locked.end()) continue;
+        mm_fs_locks.w_lock(blocks[k]);
+        locked.push_back(blocks[k]);
+        if (inode_gen[blocks[k]] != gens[k]) { error = true; }
+    }
+    if (blocks[0] != src_block && blocks[0] != dst_block) {
+        mm_fs_locks.w_unlock(blocks[0]);
+        locked.erase(locked.begin());
+    }
+    auto unlock = [&]() {
+        for (unsigned int block : locked) {
+            mm_fs_locks.w_unlock(block);
+        }
+    };
+    if (error) {
+        unlock();
+        return false;
+    }
 
-// Send response message to the client, it will not be called if the request was invalid
-// READ request: <session> <sequence><NULL><data>
-// Other request: <session> <sequence><NULL>
-static void send_response(request_type type, size_t session_id, size_t sequence, 
-                         void* rd_data, int socket, const char* password) {
-    char *header, *cleartext, *ciphertext;
-    unsigned int size_cleartext, size_ciphertext;
+    // both parents are directories owned by the user (or by everyone)
+    fs_inode src_dir, dst_dir_buf;
+    disk_read(src_block, (void*)&src_dir);
+    fs_inode &dst_dir = (src_block == dst_block)? src_dir: dst_dir_buf;
+    if (src_block != dst_block) {
+        disk_read(dst_block, (void*)&dst_dir);
+    }
+    for (const fs_inode *dir : {&src_dir, &dst_dir}) {
+        if (dir->type != 'd' ||
+            (strcmp(dir->owner, username) != 0 && strcmp("", dir->owner) != 0)) {
+            unlock();
+            return false;
+        }
+    }
 
-    string tmp(to_string(session_id)+" "+to_string(sequence));
-    unsigned int tmp_size = tmp.size();
+    // the source exists and is owned by the user, the destination doesn't exist
+    const char* src_name = src.back().c_str();
+    const char* dst_name = dst.back().c_str();
+    unsigned int block_num, dir_num, other_block_num, other_dir_num;
+    fs_direntry direts[FS_DIRENTRIES], other_direts[FS_DIRENTRIES];
+    if (!dir_find(&src_dir, src_block, src_name, block_num, dir_num, direts) ||
+        dir_find(&dst_dir, dst_block, dst_name, other_block_num, other_dir_num, other_direts)) {
+        unlock();
+        return false;
+    }
+    // the moved inode stays locked, after its parent, until the rename is logged, so a
+    // mutation of it is logged before or after the rename as it took effect
+    unsigned int moved = direts[dir_num].inode_block;
+    fs_inode moved_inode;
+    mm_fs_locks.w_lock(moved);
+    locked.push_back(moved);
+    disk_read(moved, (void*)&moved_inode);
+    if (strcmp(moved_inode.owner, username) != 0) {
+        unlock();
+        return false;
+    }
+    dir_ref_t ref{moved, inode_gen[moved]};
 
-    // get the clear text
-    if (type != READ) {
-        // only session + sequence
-        cleartext = new char[tmp_size+1];
-        strcpy(cleartext, tmp.c_str());
-        size_cleartext = strlen(cleartext)+1;
+    // mutations below the moved entry wait at the gate until the rename is logged
+    bool gated = op_log.active;
+    if (gated) {
+        rename_gate.write_lock();
+    }
+    bool linked = true;
+    if (src_block == dst_block) {
+        // rename in place
+        strcpy(direts[dir_num].name, dst_name);
+        disk_write(src_dir.blocks[block_num], (void*)direts);
+        dir_tags[src_block][block_num*FS_DIRENTRIES+dir_num] = name_tag(dst_name);
+        dir_snapshot_t *unlinked = dir_snapshots[src_block].load()->with(src_name, nullptr);
+        dir_publish(src_block, unlinked->with(dst_name, &ref));
+        delete unlinked;
     } else {
-        // session + sequence + data
-        cleartext = new char[tmp_size+1+FS_BLOCKSIZE];
-        strcpy(cleartext, tmp.c_str());
-        for (unsigned int i = 0; i < FS_BLOCKSIZE; i++) {
-            cleartext[tmp_size+1+i] = ((char*)rd_data)[i];  
+        // link the new name before the old one goes, so a crash leaves both
+        linked = dir_link(&dst_dir, dst_block, dst_name, ref);
+        if (linked) {
+            dir_unlink(&src_dir, src_block, block_num, dir_num, direts);
         }
-        size_cleartext = tmp_size+1+FS_BLOCKSIZE;  
     }
+    if (linked) {
+        op_log.append("RENAME", username, from, to);
+    }
+    if (gated) {
+        rename_gate.write_unlock();
+    }
+    unlock();
+    return linked;
+}
 
-    // ciphertext and header
-    ciphertext = (char*)fs_encrypt(password, cleartext, size_cleartext, &size_ciphertext);
-    string s = to_string(size_ciphertext);
-    header = new char[s.size()+1];
-    strcpy(header, to_string(size_ciphertext).c_str());
-
-    // send header and ciphertext
-    unsigned int sent = 0;
-    while (sent < strlen(header)+1) {
-        int s = send(socket, header+sent, strlen(header)+1-sent, MSG_NOSIGNAL);
-        sent += s;
+// Recursively traverse the existed file system
+// Load free_blocks and the directory snapshots
+void traverse_fs(unsigned int inode_block) {
+    fs_inode inode;
+    disk_read(inode_block, (void*)(&inode));
+   
+    num_block_remain--;
+    free_blocks.erase(remove(free_blocks.begin(), free_blocks.end(), inode_block)); 
+    for (unsigned int i = 0; i < inode.size; i++) {
+        if (inode.type == 'f' && inode.blocks[i] == HOLE) continue;
+        unsigned int block = (inode.type == 'f')? data_block(inode.blocks[i]): inode.blocks[i];
+        char data[FS_BLOCKSIZE];
+        if (inode.type == 'f' && dedup_enabled && data_read(inode.blocks[i], data)) {
+            dedup.insert(block_fingerprint(data), inode.blocks[i]);
+        }
+        // a data block shared by several files (or slots of a pack) is counted once
+        if (inode.type == 'f' && dedup.refs[block]++ > 0) continue;
+        num_block_remain--;
+        free_blocks.erase(remove(free_blocks.begin(), free_blocks.end(), block)); 
     }
 
-    sent = 0;
-    while (sent < size_ciphertext) {
-        int s = send(socket, ciphertext+sent, size_ciphertext-sent, MSG_NOSIGNAL);
-        sent += s;
+    if (inode.type == 'f') {
+        return;
+    }
+    
+    dir_snapshot_t *dir = new dir_snapshot_t();
+    dir->gen = 0;
+    dir->owner = inode.owner;
+    fs_direntry* blk_direts = new fs_direntry[FS_DIRENTRIES];    
+    dir_tags[inode_block].assign(inode.size*FS_DIRENTRIES, 0);
+    for (unsigned int i = 0; i < inode.size; i++) {
+        disk_read(inode.blocks[i], (void*)blk_direts);
+        for (unsigned int j = 0; j < FS_DIRENTRIES; j++) {
+            if (blk_direts[j].inode_block == 0) continue;
+            dir_tags[inode_block][i*FS_DIRENTRIES+j] = name_tag(blk_direts[j].name);
+            dir_ref_t ref{blk_direts[j].inode_block, 0};
+            dir_snapshot_t *linked = dir->with(blk_direts[j].name, &ref);
+            delete dir;
+            dir = linked;
+            traverse_fs(blk_direts[j].inode_block);
+        }
     }
+    delete [] blk_direts;
+    dir_publish(inode_block, dir);
+}
 
-    // delete allocated memory
-    delete [] ciphertext;
-    delete [] header;
-    delete [] cleartext;
+// Initialze the list of free blocks(empty fs or used fs) and the directory snapshots
+static void load_fs() {
+    for (unsigned int i = 0; i < FS_DISKSIZE; i++) {
+        free_blocks.push_back(i);
+    } 
+    num_block_remain = FS_DISKSIZE;
+    traverse_fs(0);
 }
 
-// Parse the request body after we get valid username, password, session and sequence number 
-// Get pathname, block number, create type (file/dir), and writing data 
-static bool parse_req(const char* req_begin, request_type type, 
-                  unsigned int size,
-                  string &pathname, unsigned int &block, 
-                  char &cr_type, char* data) {
-    if (size == 0) { return false; }
 
-    if (type == SESSION) {
-        if (size == 1 && req_begin[0] == '\0') {
-            return true;
-        } else {
-            return false;
-        }
-     }
+/* Log-structured writes */
 
-    unsigned int l = 0, r = l;
-    if (req_begin[r] != ' ') { return false; }
-    l = r+1;
-    size -= 1;
-    if (size == 0) { return false; }
+// With FS_SEGMENT_BLOCKS=N the disk is divided into segments of N blocks, and new file
+// data goes to a log: the blocks of the active segment, one after the other. Files
+// appended concurrently are then written sequentially, rather than wherever the free
+// list points. The active segment is the next one, in disk order, whose blocks are all
+// free; with none left, data blocks come off the free list as without the log. Inodes
+// and directory blocks are rewritten in place, since directory entries name inodes by
+// block number.
+// A cleaner thread keeps CLEAN_RESERVE segments free for the log. It picks the segment
+// with the fewest blocks in use, all of them file data not shared with other files or
+// snapshots, and moves them to the log, which frees the segment. Segments live in memory only, and a
+// restart starts a new log.
+
+// The file, and the index in it, of a data block the cleaner may move
+struct block_owner_t {
+    uint32_t inode;                        // 0 if none
+    uint32_t gen;
+    uint32_t index;
+};
+
+// Visit every entry of the tree under directory dir, parents before children, as found
+// in the directory snapshots. visit(ref, is_dir) runs without locks.
+static void walk_tree(unsigned int dir, const function<void(const dir_ref_t&, bool)> &visit) {
+    vector<dir_ref_t> entries;
+    {
+        epoch_guard_t guard;
+        const dir_snapshot_t *snapshot = dir_snapshots[dir].load();
+        if (snapshot == nullptr) { return; }
+        for (const auto &shard : snapshot->shards) {
+            if (!shard) continue;
+            for (const auto &entry : *shard) {
+                entries.push_back(entry.second);
+            }
+        }
+    }
+    for (const dir_ref_t &ref : entries) {
+        bool is_dir = (dir_snapshots[ref.inode_block].load() != nullptr);
+        visit(ref, is_dir);
+        if (is_dir) {
+            walk_tree(ref.inode_block, visit);
+        }
+    }
+}
+
+// Find the owners of the uncompressed data blocks of the files under directory dir
+static void find_owners(unsigned int dir, vector<block_owner_t> &owners) {
+    walk_tree(dir, [&](const dir_ref_t &ref, bool is_dir) {
+        if (is_dir) { return; }
+        fs_inode inode;
+        mm_fs_locks.r_lock(ref.inode_block);
+        if (inode_gen[ref.inode_block] == ref.gen) {
+            disk_read(ref.inode_block, (void*)&inode);
+            for (unsigned int i = 0; inode.type == 'f' && i < inode.size; i++) {
+                if (inode.blocks[i] != HOLE && !(inode.blocks[i] & PACKED)) {
+                    owners[inode.blocks[i]] = block_owner_t{ref.inode_block, ref.gen, i};
+                }
+            }
+        }
+        mm_fs_locks.r_unlock(ref.inode_block);
+    });
+}
+
+// Copy the data blocks at "indexes" of file inode (at inode_block) to the blocks "to",
+// point the file at the copies and drop the old blocks. The caller holds the file's
+// write lock and the mutation gate, has checked that no other file shares the blocks,
+// and has taken the blocks "to" off the free list.
+static void move_blocks(fs_inode &inode, unsigned int inode_block,
+                        const vector<unsigned int> &indexes, const vector<unsigned int> &to) {
+    vector<unsigned int> old;
+    char data[FS_BLOCKSIZE];
+    for (unsigned int i = 0; i < indexes.size(); i++) {
+        old.push_back(inode.blocks[indexes[i]]);
+        disk_read(old.back(), data);
+        dedup.refs[to[i]] = 1;
+        disk_write(to[i], data);
+        if (dedup_enabled) {
+            dedup.insert(dedup.fingerprint(data), to[i]);
+        }
+        inode.blocks[indexes[i]] = to[i];
+    }
+    disk_write(inode_block, (void*)&inode);
+    for (unsigned int block : old) {
+        dedup.put(block);
+    }
+}
+
+// Move data block "block" of a file to a block of the log, unless the file no longer
+// has it, or shares it with another file or a snapshot (which would keep the block
+// where it is). Return true if it moved.
+static bool relocate_block(const block_owner_t &owner, unsigned int block) {
+    mutation_guard_t guard(true);
+    mm_fs_locks.w_lock(owner.inode);
+    fs_inode inode;
+    disk_read(owner.inode, (void*)&inode);
+    if (inode_gen[owner.inode] != owner.gen || inode.type != 'f' ||
+        owner.index >= inode.size || inode.blocks[owner.index] != block ||
+        dedup.refs[block] != 1 || snapshots.shared(block)) {
+        mm_fs_locks.w_unlock(owner.inode);
+        return false;
+    }
+    free_blocks_lock.lock();
+    if (num_block_remain < 1) {
+        free_blocks_lock.unlock();
+        mm_fs_locks.w_unlock(owner.inode);
+        return false;
+    }
+    num_block_remain--;
+    unsigned int moved = pop_data_block();
+    free_blocks_lock.unlock();
+    move_blocks(inode, owner.inode, {owner.index}, {moved});
+    mm_fs_locks.w_unlock(owner.inode);
+    return true;
+}
+
+// Which blocks are free: those on the free list and, with "segment", the rest of the
+// active log segment; caller holds free_blocks_lock
+static vector<bool> free_map(bool segment) {
+    vector<bool> free(FS_DISKSIZE, false);
+    for (unsigned int block : free_blocks) {
+        free[block] = true;
+    }
+    for (unsigned int block = segment_next; segment && block < segment_end; block++) {
+        free[block] = true;
+    }
+    return free;
+}
+
+struct segments_t {
+    static const unsigned int CLEAN_RESERVE = 2;
+
+    unsigned int size = 0;                 // FS_SEGMENT_BLOCKS, 0 if off
+    unsigned int active = 0;               // the segment the log is in
+    unsigned int head = 0;                 // next segment to consider for the log
+    uint64_t opened = 0;                   // segments the log went through
+    uint64_t logged = 0;                   // data blocks written to the log
+    uint64_t scattered = 0;                // ... and off the free list, with no segment free
+    mutex clean_lock;                      // lock for pending
+    condition_variable wake;               // signaled when a segment is opened
+    bool pending = false;                  // a segment was opened since the last pass
+    atomic<uint64_t> cleaned{0};           // segments freed by the cleaner
+    atomic<uint64_t> moved{0};             // blocks it moved
+    atomic<uint64_t> clean_ns{0};
+
+    unsigned int count() const {
+        return FS_DISKSIZE/size;
+    }
+    unsigned int used(const vector<bool> &free, unsigned int segment) const {
+        return size-count_if(free.begin()+segment*size, free.begin()+(segment+1)*size,
+                             [](bool f) { return f; });
+    }
+    // Take the next free segment off the free list for the log; caller holds
+    // free_blocks_lock
+    bool open() {
+        vector<bool> free(free_map(true));
+        for (unsigned int k = 0; k < count(); k++) {
+            unsigned int segment = (head+k)%count();
+            if (used(free, segment) > 0) continue;
+            unsigned int first = segment*size;
+            free_blocks.erase(remove_if(free_blocks.begin(), free_blocks.end(),
+                                        [&](unsigned int block) { return block/size == segment; }),
+                              free_blocks.end());
+            segment_next = first;
+            segment_end = first+size;
+            active = segment;
+            head = (segment+1)%count();
+            opened++;
+            lock_guard<mutex> lk(clean_lock);
+            pending = true;
+            wake.notify_one();
+            return true;
+        }
+        return false;
+    }
+
+    // Free the least used segment, if fewer than CLEAN_RESERVE are free and the free
+    // blocks elsewhere can take its data
+    void clean() {
+        free_blocks_lock.lock();
+        vector<bool> free(free_map(true));
+        unsigned int clean = 0, scattered_free = 0;
+        for (unsigned int segment = 0; segment < count(); segment++) {
+            unsigned int n = used(free, segment);
+            clean += (n == 0 && segment != active);
+            scattered_free += (n > 0 && segment != active)? size-n: 0;
+        }
+        free_blocks_lock.unlock();
+        if (clean >= CLEAN_RESERVE || scattered_free < size) { return; }
+
+        uint64_t start = now_ns();
+        vector<block_owner_t> owners(FS_DISKSIZE);
+        find_owners(0, owners);
+        // blocks a snapshot shares stay where they are (checked before free_blocks_lock,
+        // which snapshots take after theirs)
+        vector<bool> pinned(FS_DISKSIZE, false);
+        for (unsigned int block = 0; block < FS_DISKSIZE; block++) {
+            pinned[block] = (owners[block].inode != 0 && snapshots.shared(block));
+        }
+        // keep the free blocks of the victim off the list while its data moves out
+        free_blocks_lock.lock();
+        free = free_map(true);
+        unsigned int victim = count(), least = size;
+        for (unsigned int segment = 0; segment < count(); segment++) {
+            unsigned int n = used(free, segment);
+            if (segment == active || n == 0 || n >= least) continue;
+            bool movable = true;
+            for (unsigned int block = segment*size; block < (segment+1)*size; block++) {
+                if (!free[block] && (owners[block].inode == 0 || dedup.refs[block] != 1 ||
+                                     pinned[block])) {
+                    movable = false;
+                    break;
+                }
+            }
+            if (movable) {
+                victim = segment;
+                least = n;
+            }
+        }
+        if (victim == count()) {
+            free_blocks_lock.unlock();
+            return;
+        }
+        vector<unsigned int> reserved;
+        for (unsigned int block = victim*size; block < (victim+1)*size; block++) {
+            if (free[block]) {
+                reserved.push_back(block);
+            }
+        }
+        free_blocks.erase(remove_if(free_blocks.begin(), free_blocks.end(),
+                                    [&](unsigned int block) { return block/size == victim; }),
+                          free_blocks.end());
+        num_block_remain -= reserved.size();
+        free_blocks_lock.unlock();
+
+        unsigned int n = 0;
+        for (unsigned int block = victim*size; block < (victim+1)*size; block++) {
+            if (!free[block] && relocate_block(owners[block], block)) {
+                n++;
+            }
+        }
+
+        // a block may have been shared or relinked since the owners were found
+        free_blocks_lock.lock();
+        free_blocks.insert(free_blocks.end(), reserved.begin(), reserved.end());
+        num_block_remain += reserved.size();
+        bool emptied = (used(free_map(true), victim) == 0);
+        free_blocks_lock.unlock();
+        moved += n;
+        cleaned += emptied;
+        clean_ns += now_ns()-start;
+    }
+    // Thread function of the cleaner: a pass whenever the log opens a segment, and at
+    // least every second
+    void cleaner() {
+        while (true) {
+            {
+                unique_lock<mutex> lk(clean_lock);
+                wake.wait_for(lk, chrono::seconds(1), [this] { return pending; });
+                pending = false;
+            }
+            clean();
+        }
+    }
+    // Turn the log on, with the cleaner in a thread of its own unless the caller
+    // runs its passes (the core, see fs_core_clean_segments)
+    void start(unsigned int blocks, bool background = true) {
+        size = blocks;
+        active = count();
+        if (background) {
+            thread cleaner_thread(&segments_t::cleaner, this);
+            cleaner_thread.detach();
+        }
+    }
+
+    string report() {
+        lock_guard<profiled_mutex_t> lock(free_blocks_lock);
+        unsigned int clean = 0;
+        if (size > 0) {
+            vector<bool> free(free_map(true));
+            for (unsigned int segment = 0; segment < count(); segment++) {
+                clean += (used(free, segment) == 0 && segment != active);
+            }
+        }
+        return "{\"enabled\":"+string(size > 0? "true": "false")+
+               ",\"segment_blocks\":"+to_string(size)+
+               ",\"clean_segments\":"+to_string(clean)+
+               ",\"segments_opened\":"+to_string(opened)+
+               ",\"blocks_logged\":"+to_string(logged)+
+               ",\"blocks_scattered\":"+to_string(scattered)+
+               ",\"segments_cleaned\":"+to_string(cleaned.load())+
+               ",\"blocks_moved\":"+to_string(moved.load())+
+               ",\"clean_ns\":"+to_string(clean_ns.load())+"}\n";
+    }
+};
+static segments_t segments;
+
+static unsigned int pop_data_block() {
+    if (segments.size > 0) {
+        if (segment_next == segment_end) {
+            segments.open();
+        }
+        if (segment_next < segment_end) {
+            segments.logged++;
+            unsigned int block = segment_next++;
+            block_born[block] = snap_seq.load();
+            return block;
+        }
+        segments.scattered++;
+    }
+    return pop_free_block();
+}
+
+
+/* Defragmentation */
+
+// The admin command "defrag start" starts a pass of the defragmenter, which runs while
+// the server keeps serving. It first compacts every directory with more direntry blocks
+// than its entries need: the entries of its last blocks move to free slots of the first
+// ones, which are written before the directory drops the last blocks, so that a crash
+// may leave an entry twice but never loses one. Then it moves the blocks of every file
+// stored in more than one run of blocks to a single free run. Each directory or file is
+// changed under its write lock, and the pass reads and writes at most FS_DEFRAG_IOPS
+// blocks per second. The pass skips files with blocks shared with other files or
+// snapshots, or compressed, and leaves free segments to the log-structured writes. The
+// admin command "defrag" reports the fragmentation before and after the last pass.
+
+// Fragmentation of the file system: direntry blocks against the fewest that could hold
+// the entries, runs of consecutive blocks of the files, and runs of free blocks
+struct fragmentation_t {
+    unsigned int dirs = 0;
+    unsigned int dir_blocks = 0;
+    unsigned int dir_blocks_needed = 0;
+    unsigned int files = 0;
+    unsigned int file_blocks = 0;
+    unsigned int file_runs = 0;
+    unsigned int fragmented_files = 0;     // files in more than one run
+    unsigned int free_blocks = 0;
+    unsigned int free_runs = 0;
+    unsigned int largest_free_run = 0;
+
+    void add_dir(unsigned int dir_block) {
+        mm_fs_locks.r_lock(dir_block);
+        fs_inode inode;
+        disk_read(dir_block, (void*)&inode);
+        unsigned int entries = dir_tags[dir_block].size()-
+                               count(dir_tags[dir_block].begin(), dir_tags[dir_block].end(), 0);
+        mm_fs_locks.r_unlock(dir_block);
+        dirs++;
+        dir_blocks += inode.size;
+        dir_blocks_needed += (entries+FS_DIRENTRIES-1)/FS_DIRENTRIES;
+    }
+    void add_file(const fs_inode &inode) {
+        unsigned int runs = 0, prev = 0;
+        for (unsigned int i = 0; i < inode.size; i++) {
+            if (inode.blocks[i] == HOLE) continue;
+            unsigned int block = data_block(inode.blocks[i]);
+            file_blocks++;
+            // slots of one pack block count as one run
+            runs += (runs == 0 || (block != prev && block != prev+1));
+            prev = block;
+        }
+        files++;
+        file_runs += runs;
+        fragmented_files += (runs > 1);
+    }
+    static fragmentation_t measure() {
+        fragmentation_t frag;
+        frag.add_dir(0);
+        walk_tree(0, [&](const dir_ref_t &ref, bool is_dir) {
+            if (is_dir) {
+                frag.add_dir(ref.inode_block);
+                return;
+            }
+            fs_inode inode;
+            mm_fs_locks.r_lock(ref.inode_block);
+            bool found = (inode_gen[ref.inode_block] == ref.gen);
+            if (found) {
+                disk_read(ref.inode_block, (void*)&inode);
+            }
+            mm_fs_locks.r_unlock(ref.inode_block);
+            if (found && inode.type == 'f') {
+                frag.add_file(inode);
+            }
+        });
+        lock_guard<profiled_mutex_t> lock(free_blocks_lock);
+        vector<bool> free(free_map(true));
+        for (unsigned int block = 0, run = 0; block < FS_DISKSIZE; block++) {
+            run = free[block]? run+1: 0;
+            frag.free_blocks += free[block];
+            frag.free_runs += (run == 1);
+            frag.largest_free_run = max(frag.largest_free_run, run);
+        }
+        return frag;
+    }
+    string json() const {
+        return "{\"dirs\":"+to_string(dirs)+",\"dir_blocks\":"+to_string(dir_blocks)+
+               ",\"dir_blocks_needed\":"+to_string(dir_blocks_needed)+
+               ",\"files\":"+to_string(files)+",\"file_blocks\":"+to_string(file_blocks)+
+               ",\"file_runs\":"+to_string(file_runs)+
+               ",\"fragmented_files\":"+to_string(fragmented_files)+
+               ",\"free_blocks\":"+to_string(free_blocks)+",\"free_runs\":"+to_string(free_runs)+
+               ",\"largest_free_run\":"+to_string(largest_free_run)+"}";
+    }
+};
+
+// Move the entries of the last direntry blocks of a directory to free slots of the
+// first ones, and free the last blocks. Return the number of blocks freed.
+static unsigned int compact_dir(unsigned int dir_block, uint32_t gen) {
+    mutation_guard_t guard(true);
+    mm_fs_locks.w_lock(dir_block);
+    fs_inode dir;
+    disk_read(dir_block, (void*)&dir);
+    vector<uint16_t> &tags = dir_tags[dir_block];
+    unsigned int entries = tags.size()-count(tags.begin(), tags.end(), 0);
+    unsigned int needed = (entries+FS_DIRENTRIES-1)/FS_DIRENTRIES;
+    if (inode_gen[dir_block] != gen || dir.type != 'd' || dir.size <= needed) {
+        mm_fs_locks.w_unlock(dir_block);
+        return 0;
+    }
+    // the first blocks have enough free slots for the entries of the last ones
+    unordered_map<unsigned int, vector<fs_direntry> > changed;
+    fs_direntry direts[FS_DIRENTRIES];
+    for (unsigned int block_num = needed; block_num < dir.size; block_num++) {
+        disk_read(dir.blocks[block_num], direts);
+        for (unsigned int j = 0; j < FS_DIRENTRIES; j++) {
+            if (direts[j].inode_block == 0) continue;
+            unsigned int slot = tag_find(tags, 0, 0);
+            vector<fs_direntry> &to = changed[slot/FS_DIRENTRIES];
+            if (to.empty()) {
+                to.resize(FS_DIRENTRIES);
+                disk_read(dir.blocks[slot/FS_DIRENTRIES], to.data());
+            }
+            to[slot%FS_DIRENTRIES] = direts[j];
+            tags[slot] = tags[block_num*FS_DIRENTRIES+j];
+        }
+    }
+    for (auto &block : changed) {
+        disk_write(dir.blocks[block.first], block.second.data());
+    }
+    vector<unsigned int> freed(dir.blocks+needed, dir.blocks+dir.size);
+    dir.size = needed;
+    disk_write(dir_block, (void*)&dir);
+    tags.resize(needed*FS_DIRENTRIES);
+    snapshots.free_all(freed);
+    mm_fs_locks.w_unlock(dir_block);
+    return freed.size();
+}
+
+// Move the blocks of a file in more than one run to the first free run that holds them
+// all, outside the free segments kept for the log. Return the number of blocks moved.
+static unsigned int pack_file(unsigned int inode_block, uint32_t gen) {
+    mutation_guard_t guard(true);
+    mm_fs_locks.w_lock(inode_block);
+    fs_inode inode;
+    disk_read(inode_block, (void*)&inode);
+    if (inode_gen[inode_block] != gen || inode.type != 'f') {
+        mm_fs_locks.w_unlock(inode_block);
+        return 0;
+    }
+    vector<unsigned int> indexes;
+    bool contiguous = true;
+    for (unsigned int i = 0; i < inode.size; i++) {
+        uint32_t ptr = inode.blocks[i];
+        if (ptr == HOLE) continue;
+        if ((ptr & PACKED) || dedup.refs[ptr] != 1 || snapshots.shared(ptr)) {
+            // compressed, or shared with another file or a snapshot
+            mm_fs_locks.w_unlock(inode_block);
+            return 0;
+        }
+        if (!indexes.empty() && ptr != inode.blocks[indexes.back()]+1) {
+            contiguous = false;
+        }
+        indexes.push_back(i);
+    }
+    if (contiguous) {
+        mm_fs_locks.w_unlock(inode_block);
+        return 0;
+    }
+    // take the run off the free list (the active log segment is not on it)
+    unsigned int n = indexes.size();
+    vector<unsigned int> to;
+    free_blocks_lock.lock();
+    vector<bool> free(free_map(false));
+    for (unsigned int segment = 0; segments.size > 0 && segment < segments.count(); segment++) {
+        if (segments.used(free, segment) == 0) {
+            fill(free.begin()+segment*segments.size, free.begin()+(segment+1)*segments.size,
+                 false);
+        }
+    }
+    for (unsigned int block = 0, run = 0; block < FS_DISKSIZE; block++) {
+        run = free[block]? run+1: 0;
+        if (run == n) {
+            for (unsigned int b = block+1-n; b <= block; b++) {
+                to.push_back(b);
+                block_born[b] = snap_seq.load();
+            }
+            free_blocks.erase(remove_if(free_blocks.begin(), free_blocks.end(),
+                                        [&](unsigned int b) { return b+n > block && b <= block; }),
+                              free_blocks.end());
+            num_block_remain -= n;
+            break;
+        }
+    }
+    free_blocks_lock.unlock();
+    if (to.empty()) {
+        mm_fs_locks.w_unlock(inode_block);
+        return 0;
+    }
+    move_blocks(inode, inode_block, indexes, to);
+    mm_fs_locks.w_unlock(inode_block);
+    return n;
+}
+
+struct defrag_t {
+    unsigned int budget = 1000;            // FS_DEFRAG_IOPS: blocks read and written per second
+    mutex defrag_lock;                     // lock for all below
+    bool running = false;
+    unsigned int passes = 0;
+    fragmentation_t before, after;
+    unsigned int dirs_compacted = 0;
+    unsigned int dir_blocks_freed = 0;
+    unsigned int files_packed = 0;
+    unsigned int blocks_moved = 0;
+    unsigned long io_blocks = 0;           // blocks read and written by the pass
+    uint64_t elapsed_ns = 0;
+
+    // Thread function of a pass
+    void pass() {
+        fragmentation_t frag(fragmentation_t::measure());
+        uint64_t start = now_ns();
+        unsigned long io_base = disk_reads+disk_writes;
+        {
+            lock_guard<mutex> lock(defrag_lock);
+            before = frag;
+            after = fragmentation_t();
+            dirs_compacted = dir_blocks_freed = files_packed = blocks_moved = 0;
+        }
+        // after each directory or file, sleep until the blocks read and written so far
+        // fit the budget
+        auto throttle = [&]() {
+            unsigned long io = disk_reads+disk_writes-io_base;
+            uint64_t elapsed = now_ns()-start;
+            {
+                lock_guard<mutex> lock(defrag_lock);
+                io_blocks = io;
+                elapsed_ns = elapsed;
+            }
+            if (budget > 0 && io*1000000000ull/budget > elapsed) {
+                this_thread::sleep_for(chrono::nanoseconds(io*1000000000ull/budget-elapsed));
+            }
+        };
+
+        vector<dir_ref_t> dirs{dir_ref_t{0, inode_gen[0]}}, files;
+        walk_tree(0, [&](const dir_ref_t &ref, bool is_dir) {
+            (is_dir? dirs: files).push_back(ref);
+        });
+        for (const dir_ref_t &dir : dirs) {
+            unsigned int freed = compact_dir(dir.inode_block, dir.gen);
+            {
+                lock_guard<mutex> lock(defrag_lock);
+                dirs_compacted += (freed > 0);
+                dir_blocks_freed += freed;
+            }
+            throttle();
+        }
+        for (const dir_ref_t &file : files) {
+            unsigned int moved = pack_file(file.inode_block, file.gen);
+            {
+                lock_guard<mutex> lock(defrag_lock);
+                files_packed += (moved > 0);
+                blocks_moved += moved;
+            }
+            throttle();
+        }
+
+        frag = fragmentation_t::measure();
+        lock_guard<mutex> lock(defrag_lock);
+        after = frag;
+        io_blocks = disk_reads+disk_writes-io_base;
+        elapsed_ns = now_ns()-start;
+        passes++;
+        running = false;
+    }
+    string start() {
+        lock_guard<mutex> lock(defrag_lock);
+        if (running) { return "error: a pass is running\n"; }
+        running = true;
+        thread defragmenter(&defrag_t::pass, this);
+        defragmenter.detach();
+        return "ok\n";
+    }
+    string report() {
+        lock_guard<mutex> lock(defrag_lock);
+        return "{\"running\":"+string(running? "true": "false")+
+               ",\"passes\":"+to_string(passes)+",\"budget_iops\":"+to_string(budget)+
+               ",\"before\":"+before.json()+",\"after\":"+after.json()+
+               ",\"dirs_compacted\":"+to_string(dirs_compacted)+
+               ",\"dir_blocks_freed\":"+to_string(dir_blocks_freed)+
+               ",\"files_packed\":"+to_string(files_packed)+
+               ",\"blocks_moved\":"+to_string(blocks_moved)+
+               ",\"io_blocks\":"+to_string(io_blocks)+
+               ",\"elapsed_ms\":"+to_string(elapsed_ns/1000000)+"}\n";
+    }
+};
+static defrag_t defrag;
+
+
+/* In-process interface (fs_core.h) */
+
+void fs_core_init() {
+    fs_quiet = disk_quiet = true;
+    load_fs();
+}
+
+int fs_core_init_options(const struct fs_core_options *options) {
+    if (options->segment_blocks > FS_DISKSIZE/2) { return -1; }
+    dedup_enabled = (options->dedup != 0);
+    compress_enabled = (options->compress != 0);
+    fs_core_init();
+    if (options->segment_blocks > 0) {
+        segments.start(options->segment_blocks, false);
+    }
+    return 0;
+}
+
+int fs_core_readblock(const char *username, const char *pathname, unsigned int offset,
+                      void *buf) {
+    if (offset >= FS_MAXFILEBLOCKS) { return -1; }
+    return conduct_operation(pathname, username, offset, 0, nullptr, buf, READ)? 0: -1;
+}
+
+int fs_core_writeblock(const char *username, const char *pathname, unsigned int offset,
+                       const void *buf) {
+    if (offset >= FS_MAXFILEBLOCKS) { return -1; }
+    return conduct_operation(pathname, username, offset, 0, buf, nullptr, WRITE)? 0: -1;
+}
+
+int fs_core_create(const char *username, const char *pathname, char type) {
+    if (type != 'f' && type != 'd') { return -1; }
+    return conduct_operation(pathname, username, 0, type, nullptr, nullptr, CREATE)? 0: -1;
+}
+
+int fs_core_delete(const char *username, const char *pathname) {
+    return conduct_operation(pathname, username, 0, 0, nullptr, nullptr, DELETE)? 0: -1;
+}
+
+int fs_core_readdir(const char *username, const char *pathname, unsigned int cookie,
+                    void *buf) {
+    if (cookie >= FS_MAXFILEBLOCKS*FS_DIRENTRIES) { return -1; }
+    return conduct_operation(pathname, username, cookie, 0, nullptr, buf, READDIR)? 0: -1;
+}
+
+int fs_core_delete_tree(const char *username, const char *pathname) {
+    return conduct_operation(pathname, username, 0, 0, nullptr, nullptr, DELETE_TREE)? 0: -1;
+}
+
+int fs_core_rename(const char *username, const char *pathname, const char *new_pathname) {
+    return conduct_rename(pathname, new_pathname, username)? 0: -1;
+}
+
+int fs_core_stat(const char *username, const char *pathname, char *type_ptr,
+                 unsigned int *size_ptr, char *owner) {
+    fs_inode inode;
+    if (!conduct_operation(pathname, username, 0, 0, nullptr, &inode, STAT)) { return -1; }
+    *type_ptr = inode.type;
+    *size_ptr = inode.size;
+    strcpy(owner, inode.owner);
+    return 0;
+}
+
+int fs_core_append(const char *username, const char *pathname, const void *buf,
+                   unsigned int *offset_ptr) {
+    unsigned int offset;
+    if (!conduct_operation(pathname, username, 0, 0, buf, &offset, APPEND)) { return -1; }
+    *offset_ptr = offset;
+    return 0;
+}
+
+void fs_core_disk_counts(unsigned long *reads_ptr, unsigned long *writes_ptr) {
+    *reads_ptr = disk_reads;
+    *writes_ptr = disk_writes;
+}
+
+unsigned int fs_core_free_blocks() {
+    // the pack block being filled is free while it holds only the packer's reference
+    lock_guard<mutex> pack_lock(packer.pack_lock);
+    lock_guard<profiled_mutex_t> lock(free_blocks_lock);
+    bool pack_free = (packer.open != HOLE && dedup.refs[packer.open] == 1);
+    return free_blocks.size()+(segment_end-segment_next)+pack_free;
+}
+
+int fs_core_snapshot_create(const char *name) {
+    mutation_gate.write_lock();
+    bool created = (snapshots.create(name) == "ok\n");
+    mutation_gate.write_unlock();
+    return created? 0: -1;
+}
+
+int fs_core_snapshot_delete(const char *name) {
+    return snapshots.remove(name) == "ok\n"? 0: -1;
+}
+
+unsigned int fs_core_clean_segments() {
+    if (segments.size == 0) { return 0; }
+    uint64_t cleaned = segments.cleaned;
+    segments.clean();
+    return segments.cleaned-cleaned;
+}
+
+int fs_core_check_refs() {
+    // with the gate held exclusively no mutation, cleaner pass or defrag is under way
+    mutation_gate.write_lock();
+    vector<unsigned int> expected(FS_DISKSIZE, 0);
+    walk_tree(0, [&](const dir_ref_t &ref, bool is_dir) {
+        if (is_dir) { return; }
+        fs_inode inode;
+        disk_read(ref.inode_block, (void*)&inode);
+        for (unsigned int i = 0; i < inode.size; i++) {
+            if (inode.blocks[i] != HOLE) {
+                expected[data_block(inode.blocks[i])]++;
+            }
+        }
+    });
+    bool balanced;
+    {
+        lock_guard<mutex> lock(packer.pack_lock);
+        if (packer.open != HOLE) {
+            expected[packer.open]++;
+        }
+        balanced = equal(expected.begin(), expected.end(), dedup.refs);
+    }
+    {
+        // and the dedup index names only blocks in use
+        lock_guard<mutex> lock(dedup.dedup_lock);
+        for (const auto &entry : dedup.index) {
+            balanced = balanced && dedup.refs[data_block(entry.second)] > 0;
+        }
+    }
+    mutation_gate.write_unlock();
+    return balanced? 0: -1;
+}
+
+unsigned int fs_core_compress(const void *in, unsigned int n, void *out, unsigned int cap) {
+    return lz_compress((const char*)in, n, (char*)out, cap);
+}
+
+int fs_core_decompress(const void *in, unsigned int n, void *out, unsigned int size) {
+    return lz_decompress((const char*)in, n, (char*)out, size)? 0: -1;
+}
+
+#ifndef FS_CORE_ONLY
+
+/* Ingress */
+
+// Requests are admitted against a memory budget (FS_INGRESS_KB). A request is charged
+// its body and its decoded operation from before the body is allocated until it is
+// answered. A connection whose next request doesn't fit waits before receiving it, so
+// clients are slowed down by TCP instead of growing the server. Frames are checked
+// before anything is allocated or decrypted, and every rejection is counted by reason.
+struct ingress_t {
+    unsigned long budget = 64ul << 20;
+    unsigned long used = 0;
+    mutex lock;
+    condition_variable released;
+    atomic<uint64_t> bad_header{0};        // malformed <username> <size> header
+    atomic<uint64_t> unknown_user{0};
+    atomic<uint64_t> oversized{0};         // body longer than any request can be
+    atomic<uint64_t> decrypt_failed{0};    // wrong password or corrupt ciphertext
+    atomic<uint64_t> bad_request{0};       // unknown opcode, or too long for its opcode
+    atomic<uint64_t> waits{0};             // requests that waited for the budget
+
+    void acquire(unsigned long bytes) {
+        unique_lock<mutex> lk(lock);
+        if (used > 0 && used+bytes > budget) {
+            waits++;
+            released.wait(lk, [&] { return used == 0 || used+bytes <= budget; });
+        }
+        used += bytes;
+    }
+    // acquire() without waiting; return false if the bytes don't fit
+    bool try_acquire(unsigned long bytes) {
+        lock_guard<mutex> lk(lock);
+        if (used > 0 && used+bytes > budget) {
+            return false;
+        }
+        used += bytes;
+        return true;
+    }
+    void release(unsigned long bytes) {
+        if (bytes == 0) { return; }
+        lock_guard<mutex> lk(lock);
+        used -= bytes;
+        released.notify_all();
+    }
+    string report() {
+        unsigned long in_use;
+        {
+            lock_guard<mutex> lk(lock);
+            in_use = used;
+        }
+        return "{\"budget_bytes\":"+to_string(budget)+
+               ",\"used_bytes\":"+to_string(in_use)+
+               ",\"waits\":"+to_string(waits.load())+
+               ",\"rejected\":{\"bad_header\":"+to_string(bad_header.load())+
+               ",\"unknown_user\":"+to_string(unknown_user.load())+
+               ",\"oversized\":"+to_string(oversized.load())+
+               ",\"decrypt_failed\":"+to_string(decrypt_failed.load())+
+               ",\"bad_request\":"+to_string(bad_request.load())+"}}\n";
+    }
+};
+static ingress_t ingress;
+
+// Request opcodes, with the longest cleartext each may have after the opcode and its
+// space: session, sequence and the fields parse_req reads
+struct opcode_t {
+    const char* name;
+    request_type type;
+    unsigned int max_body;
+};
+static const opcode_t opcodes[] = {
+    { "FS_SESSION",     SESSION,     2*MAXSIZE_INT+2 },
+    { "FS_PIPELINE",    PIPELINE,    2*MAXSIZE_INT+2 },
+    { "FS_RELEASE",     RELEASE,     2*MAXSIZE_INT+3+FS_MAXPATHNAME },
+    { "FS_CREATE",      CREATE,      2*MAXSIZE_INT+4+FS_MAXPATHNAME+1 },
+    { "FS_DELETE",      DELETE,      2*MAXSIZE_INT+3+FS_MAXPATHNAME },
+    { "FS_READBLOCK",   READ,        3*MAXSIZE_INT+4+FS_MAXPATHNAME },
+    { "FS_READDIR",     READDIR,     3*MAXSIZE_INT+4+FS_MAXPATHNAME },
+    { "FS_DELETE_TREE", DELETE_TREE, 2*MAXSIZE_INT+3+FS_MAXPATHNAME },
+    { "FS_WRITEBLOCK",  WRITE,       3*MAXSIZE_INT+4+FS_MAXPATHNAME+FS_BLOCKSIZE },
+    { "FS_STAT",        STAT,        2*MAXSIZE_INT+3+FS_MAXPATHNAME },
+    { "FS_APPEND",      APPEND,      2*MAXSIZE_INT+3+FS_MAXPATHNAME+FS_BLOCKSIZE },
+    { "FS_RENAME",      RENAME,      2*MAXSIZE_INT+4+2*FS_MAXPATHNAME },
+};
+
+// Longest ciphertext of any request. AES adds an IV and up to a block of padding.
+static const unsigned int CIPHER_OVERHEAD = 32;
+static unsigned int max_ciphertext() {
+    unsigned int longest = 0;
+    for (const opcode_t &opcode : opcodes) {
+        longest = max(longest, (unsigned int)strlen(opcode.name)+1+opcode.max_body);
+    }
+    return longest+CIPHER_OVERHEAD;
+}
+static const unsigned int MAX_CIPHERTEXT = max_ciphertext();
+
+/* utility functions */
+
+// count the number of spaces in a c_string
+static unsigned int count_spaces(const char* str) {
+    int c = 0;
+    for (int i = 0; str[i] != '\0'; i++) {
+        if (str[i] == ' ') {
+            c++;
+        }
+    }
+    return c;
+}
+
+// Transfer a c-string to an unsigned integer.
+// Return true if success, false if failed
+static bool cvt_int(const char* str, int size, unsigned int &num) {
+    if (size==0) { return false; }
+    long long long_int = 0;
+    for (int i = 0; i < size; i++) {
+        if (!isdigit(str[i])) { return false; }
+        long_int = long_int*10 + str[i]-'0';
+    } 
+    if (size > 1 && str[0] == '0') { return false; }
+    if (long_int > numeric_limits<unsigned int>::max()) { return false; }
+    num = (unsigned int)long_int;
+    return true;
+}
+
+// Encrypt and send one message to the client: <size><NULL><ciphertext>, where the
+// cleartext is <tag><NULL><payload>
+static void send_message(int socket, const char* password, const string &tag,
+                         const void* payload, unsigned int payload_size) {
+    char *header, *cleartext, *ciphertext;
+    unsigned int size_cleartext, size_ciphertext;
+    unsigned int tmp_size = tag.size();
+
+    // get the clear text
+    cleartext = new char[tmp_size+1+payload_size];
+    strcpy(cleartext, tag.c_str());
+    for (unsigned int i = 0; i < payload_size; i++) {
+        cleartext[tmp_size+1+i] = ((const char*)payload)[i];
+    }
+    size_cleartext = tmp_size+1+payload_size;
+
+    // ciphertext and header
+    {
+        phase_timer_t timer(PHASE_ENCRYPT);
+        ciphertext = (char*)fs_encrypt(password, cleartext, size_cleartext, &size_ciphertext);
+    }
+    string s = to_string(size_ciphertext);
+    header = new char[s.size()+1];
+    strcpy(header, to_string(size_ciphertext).c_str());
+
+    // send header and ciphertext
+    phase_timer_t timer(PHASE_SEND);
+    unsigned int sent = 0;
+    while (sent < strlen(header)+1) {
+        int s = send(socket, header+sent, strlen(header)+1-sent, MSG_NOSIGNAL);
+        if (s <= 0) break;
+        sent += s;
+    }
+
+    sent = 0;
+    while (sent < size_ciphertext) {
+        int s = send(socket, ciphertext+sent, size_ciphertext-sent, MSG_NOSIGNAL);
+        if (s <= 0) break;
+        sent += s;
+    }
+
+    // delete allocated memory
+    delete [] ciphertext;
+    delete [] header;
+    delete [] cleartext;
+}
+
+// Read an unsigned integer option from the environment, keep the default if unset
+static void env_option(const char* name, unsigned int &value) {
+    const char* str = getenv(name);
+    if (str != nullptr && !cvt_int(str, strlen(str), value)) {
+        cerr << "error: invalid " << name << endl;
+        exit(1);
+    }
+}
+
+// Read a per-user option "user:value,..." from the environment into values
+static void env_user_option(const char* name, unordered_map<string, unsigned int> &values) {
+    const char* str = getenv(name);
+    if (str == nullptr) { return; }
+    stringstream list(str);
+    string item;
+    while (getline(list, item, ',')) {
+        size_t pos = item.find(':');
+        unsigned int value;
+        if (pos == string::npos || pos == 0 ||
+            !cvt_int(item.c_str()+pos+1, item.size()-pos-1, value)) {
+            cerr << "error: invalid " << name << endl;
+            exit(1);
+        }
+        values[item.substr(0, pos)] = value;
+    }
+}
+
+// Results of a STAT or APPEND, sent after the status: " <type> <size> <owner>" (no owner
+// for the root directory) or " <offset>"
+static string result_fields(request_type type, const void* rd_data) {
+    if (type == STAT) {
+        const fs_inode *inode = (const fs_inode*)rd_data;
+        return " "+string(1, inode->type)+" "+to_string(inode->size)+" "+inode->owner;
+    }
+    if (type == APPEND) {
+        unsigned int offset;
+        memcpy(&offset, rd_data, sizeof(offset));
+        return " "+to_string(offset);
+    }
+    return "";
+}
+
+// Send response message to the client, it will not be called if the request was invalid
+// READ and READDIR request: <session> <sequence><NULL><data>
+// STAT request: <session> <sequence> <type> <size> <owner><NULL>
+// APPEND request: <session> <sequence> <offset><NULL>
+// Other request: <session> <sequence><NULL>
+static void send_response(request_type type, size_t session_id, size_t sequence, 
+                         void* rd_data, int socket, const char* password) {
+    string tmp(to_string(session_id)+" "+to_string(sequence)+result_fields(type, rd_data));
+    if (type != READ && type != READDIR) {
+        // only session + sequence
+        send_message(socket, password, tmp, nullptr, 0);
+    } else {
+        // session + sequence + data
+        send_message(socket, password, tmp, rd_data, FS_BLOCKSIZE);
+    }
+}
+
+// Parse the request body after we get valid username, password, session and sequence number 
+// Get pathname, new pathname (RENAME), block number, create type (file/dir), and writing data 
+static bool parse_req(const char* req_begin, request_type type, 
+                  unsigned int size,
+                  string &pathname, string &new_pathname, unsigned int &block, 
+                  char &cr_type, char* data) {
+    if (size == 0) { return false; }
+
+    if (type == SESSION) {
+        if (size == 1 && req_begin[0] == '\0') {
+            return true;
+        } else {
+            return false;
+        }
+     }
+    if (type == PIPELINE) {
+        // optional " LEASE" asks for read leases, reported as cr_type 'L'
+        if (size == 1 && req_begin[0] == '\0') {
+            return true;
+        } else if (size == 7 && memcmp(req_begin, " LEASE", 7) == 0) {
+            cr_type = 'L';
+            return true;
+        } else {
+            return false;
+        }
+     }
+
+    unsigned int l = 0, r = l;
+    if (req_begin[r] != ' ') { return false; }
+    l = r+1;
+    size -= 1;
+    if (size == 0) { return false; }
 
     // pathname
-    for (r = l; (r-l+1) < size && req_begin[r] != ' '; r++);
+    for (r = l; (r-l+1) < size && req_begin[r] != ' ' && req_begin[r] != '\0'; r++);
     for (unsigned int i = 0; i < r-l; i++) {
        if (isspace(req_begin[l+i])) { return false; }
        pathname += req_begin[l+i]; 
     }
-    if (r-l > FS_MAXPATHNAME) { return false; }
-    size -= (r-l+1);
-    l = r+1;
+    if (r-l > FS_MAXPATHNAME) { return false; }
+    size -= (r-l+1);
+    l = r+1;
+
+    switch (type) {
+        case READ: {
+            // block
+            if (size == 0) { return false; }
+            for (r = l; (r-l+1) < size && req_begin[r] != '\0'; r++);
+            if (!cvt_int(req_begin+l, r-l, block)) { return false; }
+            if (block >= FS_MAXFILEBLOCKS) { return false; }
+            size -= (r-l+1);
+            if (req_begin[r] == '\0' && size == 0) {
+                return true; 
+            } else {
+                return false;
+            }
+        } 
+
+        case WRITE: {
+            // block
+            if (size == 0) { return false; }
+            for (r = l; (r-l+1) < size && req_begin[r] != '\0'; r++);
+            if (!cvt_int(req_begin+l, r-l, block)) { return false; }
+            if (block >= FS_MAXFILEBLOCKS) { return false; }
+
+            size -= (r-l+1);
+            l = r+1;
+            if (size != FS_BLOCKSIZE) { return false; }
+            
+            // data
+            for (r = l; (r-l) < size; r++) {
+                data[r-l] = req_begin[r];
+            } 
+            size -= (r-l);
+            if (size != 0 ) { return false; }
+            return true;
+        }
+
+        case CREATE: {
+            if (size != 2) { return false; }
+            cr_type = req_begin[l];
+            if ((cr_type != 'd') && (cr_type != 'f')) { return false; }
+            if (req_begin[l+1] != '\0') { return false; }
+            free_blocks_lock.lock();
+            if (num_block_remain <= 0) { 
+                free_blocks_lock.unlock();
+                return false;
+            } 
+            free_blocks_lock.unlock();
+            return true; 
+        }
+
+        case READDIR: {
+            // slot of the directory to list from: 0, then the next slot given by the
+            // previous page
+            if (size == 0) { return false; }
+            for (r = l; (r-l+1) < size && req_begin[r] != '\0'; r++);
+            if (!cvt_int(req_begin+l, r-l, block)) { return false; }
+            if (block >= FS_MAXFILEBLOCKS*FS_DIRENTRIES) { return false; }
+            size -= (r-l+1);
+            return req_begin[r] == '\0' && size == 0;
+        }
+
+        case RENAME: {
+            // new pathname
+            if (size == 0 || req_begin[r] != ' ') { return false; }
+            for (r = l; (r-l+1) < size && req_begin[r] != '\0'; r++) {
+                if (isspace(req_begin[r])) { return false; }
+                new_pathname += req_begin[r];
+            }
+            if (r-l > FS_MAXPATHNAME) { return false; }
+            size -= (r-l+1);
+            return req_begin[r] == '\0' && size == 0;
+        }
+
+        case APPEND: {
+            // data, right after the pathname
+            if (req_begin[r] != '\0' || size != FS_BLOCKSIZE) { return false; }
+            memcpy(data, req_begin+l, FS_BLOCKSIZE);
+            return true;
+        }
+
+        case DELETE:
+        case DELETE_TREE:
+        case STAT:
+        case RELEASE: {
+            if (size == 0 && req_begin[r] == '\0') {
+                return true;
+            } else {
+                return false;
+            }
+        }
+        default: { break; }
+    }
+    return true;
+};
+
+// Decode the request message from client. Return false as soon as the request is
+// recognized as invalid; op->tagged tells whether session and sequence were known by then.
+// 1. Decrypt the request body
+// 2. Parse the request body
+// 3. Check session and sequence
+static bool decode_request(request_t *request, operation_t *op) {
+    string header(request->header);
+    if (count_spaces(header.c_str()) != 1) return false;
+    int pos = header.find(" ");
+
+    // error handling(EH): 
+    // 1. username is unknown; 
+    // 2. client use the wrong password
+
+    // get username and size from header
+    string username(header.substr(0, pos));
+    string size(header.substr(pos+1));
+
+    // EH1
+    if (UP_map.find(username) == UP_map.end()) {
+        return false;
+    }
+
+    // lookup password and decrypt the body.
+    const char* password = UP_map[username].c_str();
+    const char* buf_ciphertext = request->request_body;
+    unsigned int size_ciphertext;
+    cvt_int(size.c_str(), strlen(size.c_str()), size_ciphertext);
+
+    unsigned int size_cleartext;
+    void *decryptedmessage;
+    {
+        phase_timer_t timer(PHASE_DECRYPT);
+        decryptedmessage = fs_decrypt(password, buf_ciphertext, size_ciphertext, &size_cleartext);
+    }
+
+    // EH2
+    if (decryptedmessage == nullptr) {
+        ingress.decrypt_failed++;
+        return false;
+    }
+    op->username = username;
+    op->password = password;
+
+    // judge the type of request 
+    unsigned int session, sequence;
+    request_type type;
+
+    // Parse the request
+    // Get the type of request, invalid if the request is not in the right format 
+    // or give wrong info (e.g. non-existed file)
+    char* crequest = (char*)decryptedmessage;
+    unsigned int l = 0, r = 0;
+    bool valid = false;
+    // get operation name
+    for (r = 0; r < size_cleartext && crequest[r] != ' '; r++); 
+    string op_str(crequest+l, r-l);
+    for (const opcode_t &opcode : opcodes) {
+        if (op_str == opcode.name) {
+            type = opcode.type;
+            valid = (size_cleartext-r-1 <= opcode.max_body);
+            break;
+        }
+    }
+    if (!valid) {
+        ingress.bad_request++;
+    }
+    l = r+1;
+
+    // get session number
+    if (valid) {
+        for (r = l; r < size_cleartext && crequest[r] != ' '; r++);
+        valid = cvt_int(crequest+l, r-l, session);
+        l = r+1;
+    }
+
+    // get seq num
+    if (valid) {
+        for (r = l; r < size_cleartext && crequest[r] != ' '&&crequest[r] != '\0'; r++);
+        valid = cvt_int(crequest+l, r-l, sequence);
+        l = r+1;
+    }
+    if (!valid) {
+        delete [] (char*)decryptedmessage;
+        return false;
+    }
+    op->type = type;
+    op->session = session;
+    op->sequence = sequence;
+    op->tagged = true;
+
+    // EH3: username -> session and session -> sequence (except for connection requests)
+    if (type != SESSION && type != PIPELINE && type != RELEASE) {
+        ssmap_lock.lock();
+        auto found_user = US_map.find(username);
+        if (found_user == US_map.end() ||
+            found_user->second.find(session) == found_user->second.end() ||
+            SS_map[session] >= sequence) { 
+            ssmap_lock.unlock();
+            delete [] (char*)decryptedmessage;
+            return false;
+        }
+        SS_map[session] = sequence;
+        ssmap_lock.unlock();
+    } 
+    
+    bool parse_succ = parse_req(crequest+r, type, size_cleartext-r, op->pathname,
+                                op->new_pathname, op->block, op->cr_type, op->write_data);
+    delete [] (char*)decryptedmessage;
+    if (!parse_succ) {
+        return false;
+    }
+    if ((type == SESSION || type == PIPELINE || type == RELEASE) && session != 0) {
+        return false;
+    }
+    return true;
+}
+
+/* Fair-share scheduling */
+
+// With FS_QOS_SLOTS=N, at most N requests are conducted at a time and the others wait in
+// a queue per user. A free slot goes to the waiting user with the least virtual time,
+// which advances by 1/share for every request the user gets admitted (FS_QOS_SHARES,
+// "user:share,...", default 1). A user that was idle starts again at the virtual time of
+// the latest admission, so idling earns no credit. A user with a rate limit
+// (FS_QOS_RATES, "user:requests per second,...") waits for its token bucket, which holds
+// a tenth of a second of requests. Within a user's queue, reads go first.
+struct qos_t {
+    struct waiter_t {
+        bool admitted = false;
+        condition_variable cv;
+    };
+    struct user_t {
+        double share = 1;
+        double rate = 0;                   // requests per second, 0 for no limit
+        double tokens = 0;
+        uint64_t refilled_ns = 0;
+        double vtime = 0;
+        deque<waiter_t*> reads;            // READ, READDIR and STAT
+        deque<waiter_t*> others;
+        uint64_t admitted = 0;
+        size_t max_queued = 0;
+        histogram_t wait;                  // time from arrival to admission
+    };
+    unsigned int slots = 0;                // 0: no scheduling
+    unsigned int busy = 0;
+    double vtime = 0;                      // virtual time of the latest admission
+    mutex lock;
+    unordered_map<string, user_t> users;
+
+    // Whether u may be admitted a request now, after refilling its tokens
+    static bool within_rate(user_t &u, uint64_t now) {
+        if (u.rate == 0) { return true; }
+        double burst = max(1.0, u.rate/10);
+        u.tokens = min(burst, u.tokens+(now-u.refilled_ns)*u.rate/1e9);
+        u.refilled_ns = now;
+        return u.tokens >= 1;
+    }
+    // Hand the free slots to waiting requests; caller holds lock
+    void dispatch() {
+        uint64_t now = now_ns();
+        while (busy < slots) {
+            user_t *next = nullptr;
+            for (auto &entry : users) {
+                user_t &u = entry.second;
+                if (u.reads.empty() && u.others.empty()) continue;
+                if (!within_rate(u, now)) continue;
+                if (next == nullptr || u.vtime < next->vtime) { next = &u; }
+            }
+            if (next == nullptr) { return; }
+            deque<waiter_t*> &queue = next->reads.empty()? next->others: next->reads;
+            waiter_t *waiter = queue.front();
+            queue.pop_front();
+            if (next->rate > 0) { next->tokens -= 1; }
+            vtime = next->vtime;
+            next->vtime += 1/next->share;
+            next->admitted++;
+            busy++;
+            waiter->admitted = true;
+            waiter->cv.notify_one();
+        }
+    }
+    // Wait until a request of type by username may be conducted
+    void admit(const string &username, request_type type) {
+        if (slots == 0) { return; }
+        uint64_t start = now_ns();
+        unique_lock<mutex> lk(lock);
+        user_t &u = users[username];
+        if (u.reads.empty() && u.others.empty()) {
+            u.vtime = max(u.vtime, vtime);
+        }
+        waiter_t waiter;
+        deque<waiter_t*> &queue = (type == READ || type == READDIR || type == STAT)?
+                                  u.reads: u.others;
+        queue.push_back(&waiter);
+        u.max_queued = max(u.max_queued, u.reads.size()+u.others.size());
+        dispatch();
+        while (!waiter.admitted) {
+            if (u.rate > 0) {
+                // nobody else dispatches when the only waiters are over their rate
+                waiter.cv.wait_for(lk, chrono::nanoseconds((uint64_t)(1e9/u.rate)));
+                dispatch();
+            } else {
+                waiter.cv.wait(lk);
+            }
+        }
+        u.wait.record(now_ns()-start);
+    }
+    // A request admitted by admit is done
+    void done() {
+        if (slots == 0) { return; }
+        lock_guard<mutex> lk(lock);
+        busy--;
+        dispatch();
+    }
+    string report() {
+        lock_guard<mutex> lk(lock);
+        ostringstream out;
+        out << "{\"slots\":" << slots << ",\"busy\":" << busy << ",\"users\":{";
+        bool first = true;
+        for (auto &entry : users) {
+            user_t &u = entry.second;
+            vector<uint64_t> counts(histogram_t::BUCKETS);
+            for (unsigned int b = 0; b < histogram_t::BUCKETS; b++) {
+                counts[b] = u.wait.counts[b].load(memory_order_relaxed);
+            }
+            out << (first? "": ",") << "\"" << entry.first << "\":{\"share\":" << u.share
+                << ",\"rate\":" << u.rate << ",\"queued\":" << u.reads.size()+u.others.size()
+                << ",\"max_queued\":" << u.max_queued << ",\"admitted\":" << u.admitted
+                << ",\"wait\":{";
+            histogram_fields(out, counts, u.wait.sum.load(memory_order_relaxed));
+            out << "}}";
+            first = false;
+        }
+        out << "}}\n";
+        return out.str();
+    }
+};
+static qos_t qos;
+
+// Holds a scheduling slot for its scope
+struct qos_guard_t {
+    qos_guard_t(const operation_t *op) {
+        qos.admit(op->username, op->type);
+    }
+    ~qos_guard_t() {
+        qos.done();
+    }
+};
+
+
+/* Pipelined connections */
+
+// After FS_PIPELINE, a connection carries any number of requests of the same user.
+// Requests are decoded (and their sequence numbers checked) in arrival order, then each
+// is conducted by its own thread (or a worker of the event loop), so independent requests
+// complete out of order. A request starts once no earlier in-flight request has a path
+// that conflicts with it.
+// Responses carry a status so that failures don't need to close the connection:
+//     <session> <sequence> <status>[ <lease>]<NULL>[data]
+// where status is 0 on success and -1 on failure. With FS_PIPELINE 0 0 LEASE, a
+// successful READ also gets a read lease of <lease> milliseconds (see lease_table_t).
+struct pipeline_t : enable_shared_from_this<pipeline_t> {
+    int socket;
+    string username;
+    const char* password;
+    bool leases = false;                   // grant read leases to this connection
+    bool closed = false;                   // no more messages may be sent
+    bool eof = false;                      // no more requests, finish once drained
+    unsigned long next_order = 0;
+    list<operation_t*> inflight;           // in arrival order
+    mutex pipe_lock;                       // lock for inflight, next_order and eof
+    mutex send_lock;                       // serializes messages on the socket, and closed
+
+    // Whether two pathnames may name the same entity: same path, or one is an
+    // ancestor of the other
+    static bool overlap(const string &a, const string &b) {
+        const string &x = a.size() < b.size()? a: b;
+        const string &y = a.size() < b.size()? b: a;
+        if (y.compare(0, x.size(), x) != 0) { return false; }
+        return y.size() == x.size() || y[x.size()] == '/' || x == "/";
+    }
+    // Whether two requests may touch the same entity; a RENAME touches both its paths
+    static bool conflict(const operation_t *a, const operation_t *b) {
+        if (a->type == SESSION || b->type == SESSION) { return false; }
+        for (const string *x : {&a->pathname, &a->new_pathname}) {
+            for (const string *y : {&b->pathname, &b->new_pathname}) {
+                if (!x->empty() && !y->empty() && overlap(*x, *y)) { return true; }
+            }
+        }
+        return false;
+    }
+    // Whether op has to wait for an earlier request; caller holds pipe_lock
+    bool blocked(const operation_t *op) {
+        for (operation_t *prev : inflight) {
+            if (prev->order >= op->order) { break; }
+            if (conflict(prev, op)) { return true; }
+        }
+        return false;
+    }
+    void respond(const operation_t *op, bool succ) {
+        string tag(to_string(op->session)+" "+to_string(op->sequence)+(succ? " 0": " -1"));
+        if (succ && op->lease_ms > 0) {
+            tag += " "+to_string(op->lease_ms);
+        }
+        if (succ) {
+            tag += result_fields(op->type, op->read_data);
+        }
+        send_lock.lock();
+        if (closed) {
+            // nothing to do
+        } else if (succ && (op->type == READ || op->type == READDIR)) {
+            send_message(socket, password, tag, op->read_data, FS_BLOCKSIZE);
+        } else {
+            send_message(socket, password, tag, nullptr, 0);
+        }
+        send_lock.unlock();
+    }
+    // Ask the client to drop its cached blocks of pathname: REVOKE <pathname><NULL>
+    // The client answers with FS_RELEASE 0 0 <pathname>.
+    void push_revoke(const string &pathname) {
+        send_lock.lock();
+        if (!closed) {
+            send_message(socket, password, "REVOKE "+pathname, nullptr, 0);
+        }
+        send_lock.unlock();
+    }
+    void shutdown() {
+        send_lock.lock();
+        closed = true;
+        send_lock.unlock();
+    }
+    void dispatch(operation_t *op);
+    void launch(operation_t *op);
+    void work(operation_t *op);
+    // No more requests will be dispatched: once the last one completes, drop the
+    // connection's leases and close its socket
+    void close_input();
+    void finish();
+};
+
+
+/* Read leases */
+
+// While a connection holds an unexpired lease on a pathname, its client may serve
+// reads of that file from its cache. Before a write or delete of the pathname is
+// acknowledged, every lease on it is revoked: the holder is told to drop its cached
+// blocks, and the writer waits until the holder releases the lease or it expires.
+struct lease_t {
+    shared_ptr<pipeline_t> holder;
+    chrono::steady_clock::time_point expiry;
+    bool revoking;
+};
+struct lease_table_t {
+    unordered_map<string, list<lease_t> > leases;   // pathname -> leases
+    mutex lease_lock;
+    condition_variable lease_cv;                    // signaled when a lease is released
+
+    // Grant (or extend) a lease before the read, so a write that follows it revokes it
+    void grant(const string &path, const shared_ptr<pipeline_t> &holder) {
+        auto expiry = chrono::steady_clock::now()+chrono::milliseconds(lease_ms);
+        lock_guard<mutex> lk(lease_lock);
+        list<lease_t> &path_leases = leases[path];
+        for (lease_t &lease : path_leases) {
+            if (lease.holder == holder && !lease.revoking) {
+                lease.expiry = expiry;
+                return;
+            }
+        }
+        path_leases.push_back(lease_t{holder, expiry, false});
+    }
+    void release(const string &path, const shared_ptr<pipeline_t> &holder) {
+        lock_guard<mutex> lk(lease_lock);
+        auto found = leases.find(path);
+        if (found == leases.end()) { return; }
+        for (auto it = found->second.begin(); it != found->second.end(); it++) {
+            if (it->holder == holder && it->revoking) {
+                found->second.erase(it);
+                break;
+            }
+        }
+        if (found->second.empty()) {
+            leases.erase(found);
+        }
+        lease_cv.notify_all();
+    }
+    // Revoke all leases on path, and wait until they are released or expired
+    void revoke(const string &path) {
+        unique_lock<mutex> lk(lease_lock);
+        auto found = leases.find(path);
+        if (found == leases.end()) { return; }
+        vector<shared_ptr<pipeline_t> > holders;
+        for (lease_t &lease : found->second) {
+            if (!lease.revoking) {
+                lease.revoking = true;
+                holders.push_back(lease.holder);
+            }
+        }
+        lk.unlock();
+        for (auto &holder : holders) {
+            holder->push_revoke(path);
+        }
+        lk.lock();
 
-    switch (type) {
-        case READ: {
-            // block
-            if (size == 0) { return false; }
-            for (r = l; (r-l+1) < size && req_begin[r] != '\0'; r++);
-            if (!cvt_int(req_begin+l, r-l, block)) { return false; }
-            if (block >= FS_MAXFILEBLOCKS) { return false; }
-            size -= (r-l+1);
-            if (req_begin[r] == '\0' && size == 0) {
-                return true; 
+        while (true) {
+            found = leases.find(path);
+            if (found == leases.end()) { break; }
+            auto now = chrono::steady_clock::now();
+            auto earliest = chrono::steady_clock::time_point::max();
+            for (auto it = found->second.begin(); it != found->second.end(); ) {
+                if (it->expiry <= now) {
+                    it = found->second.erase(it);
+                    continue;
+                }
+                if (it->revoking) {
+                    earliest = min(earliest, it->expiry);
+                }
+                it++;
+            }
+            if (found->second.empty()) {
+                leases.erase(found);
+                break;
+            }
+            // leases granted after the write don't need revoking
+            if (earliest == chrono::steady_clock::time_point::max()) { break; }
+            lease_cv.wait_until(lk, earliest);
+        }
+    }
+    // revoke() of path and every path below it
+    void revoke_tree(const string &path) {
+        vector<string> paths;
+        {
+            lock_guard<mutex> lk(lease_lock);
+            for (auto &entry : leases) {
+                const string &leased = entry.first;
+                if (leased.compare(0, path.size(), path) == 0 &&
+                    (leased.size() == path.size() || leased[path.size()] == '/')) {
+                    paths.push_back(leased);
+                }
+            }
+        }
+        for (const string &leased : paths) {
+            revoke(leased);
+        }
+    }
+    // Drop all leases of a connection that is closing
+    void drop(const shared_ptr<pipeline_t> &holder) {
+        lock_guard<mutex> lk(lease_lock);
+        for (auto it = leases.begin(); it != leases.end(); ) {
+            it->second.remove_if([&](const lease_t &lease) { return lease.holder == holder; });
+            if (it->second.empty()) {
+                it = leases.erase(it);
             } else {
-                return false;
+                it++;
             }
-        } 
+        }
+        lease_cv.notify_all();
+    }
+};
+static lease_table_t lease_table;
 
-        case WRITE: {
-            // block
-            if (size == 0) { return false; }
-            for (r = l; (r-l+1) < size && req_begin[r] != '\0'; r++);
-            if (!cvt_int(req_begin+l, r-l, block)) { return false; }
-            if (block >= FS_MAXFILEBLOCKS) { return false; }
 
-            size -= (r-l+1);
-            l = r+1;
-            if (size != FS_BLOCKSIZE) { return false; }
-            
-            // data
-            for (r = l; (r-l) < size; r++) {
-                data[r-l] = req_begin[r];
-            } 
-            size -= (r-l);
-            if (size != 0 ) { return false; }
-            return true;
+/* Hot standby */
+
+// With FS_REPLICA_PORT=P the server takes one hot standby at a time on 127.0.0.1:P. A
+// standby is a server started with FS_STANDBY=host:P and a disk of its own. When it
+// connects, the primary reads its whole disk under the mutation gate, so the image is
+// consistent, starts logging mutations (see "Log shipping"), and sends the image and
+// then the log. The standby writes the image to its disk, loads it as at startup and
+// replays the log in order, so its caches and directory snapshots stay warm. It serves
+// sessions, reads, listings and stats, and refuses mutations from clients until the
+// admin command "promote" stops the replay and makes it a primary.
+// Shipping is asynchronous: a mutation is acknowledged before the standby has it.
+// Sessions, leases and snapshots taken before the standby attached are not replicated,
+// and a standby that falls FS_LOG_KB behind is detached and has to be restarted. So does
+// one that fails to replay a record: its disk no longer matches the primary's, so it
+// disconnects, and refuses all requests and promotion until a restart copies a new image.
+struct replication_t {
+    atomic<bool> standby{false};           // refuse mutations from clients
+    atomic<bool> diverged{false};          // a record failed to replay: refuse everything
+    atomic<bool> attached{false};          // connected to a standby (or to the primary)
+    int primary = -1;                      // socket to the primary, on a standby
+    mutex apply_lock;                      // held while a record is replayed
+    atomic<uint64_t> attaches{0};          // standbys attached so far
+    atomic<uint64_t> shipped{0};           // records sent to standbys
+    atomic<uint64_t> applied{0};           // records replayed
+    atomic<uint64_t> failed{0};            // records that failed to replay
+};
+static replication_t replication;
+static bool conduct_request(operation_t *op);
+
+static bool send_all(int sock, const char* buf, size_t size) {
+    size_t sent = 0;
+    while (sent < size) {
+        int s = send(sock, buf+sent, size-sent, MSG_NOSIGNAL);
+        if (s <= 0) { return false; }
+        sent += s;
+    }
+    return true;
+}
+
+static bool recv_all(int sock, char* buf, size_t size) {
+    size_t received = 0;
+    while (received < size) {
+        int r = recv(sock, buf+received, size-received, 0);
+        if (r <= 0) { return false; }
+        received += r;
+    }
+    return true;
+}
+
+// Create or delete a snapshot, and log it for the standby
+static string snapshot_command(const string &command, const string &name) {
+    if (command == "create") {
+        mutation_gate.write_lock();
+        string reply(snapshots.create(name));
+        if (reply == "ok\n") {
+            op_log.append("SNAPSHOT_CREATE", "", name);
         }
+        mutation_gate.write_unlock();
+        return reply;
+    }
+    // under the gate, so that a delete is logged if and only if the standby attached
+    // before it
+    mutation_gate.write_lock();
+    string reply(snapshots.remove(name));
+    if (reply == "ok\n") {
+        op_log.append("SNAPSHOT_DELETE", "", name);
+    }
+    mutation_gate.write_unlock();
+    return reply;
+}
 
-        case CREATE: {
-            if (size != 2) { return false; }
-            cr_type = req_begin[l];
-            if ((cr_type != 'd') && (cr_type != 'f')) { return false; }
-            if (req_begin[l+1] != '\0') { return false; }
-            free_blocks_lock.lock();
-            if (num_block_remain <= 0) { 
-                free_blocks_lock.unlock();
-                return false;
-            } 
-            free_blocks_lock.unlock();
-            return true; 
+// Send the disk image and then the log to a standby, until it goes away or falls behind
+static void ship_log(int sock) {
+    vector<char> image((size_t)FS_DISKSIZE*FS_BLOCKSIZE);
+    mutation_gate.write_lock();
+    for (unsigned int i = 0; i < FS_DISKSIZE; i++) {
+        disk_read(i, &image[(size_t)i*FS_BLOCKSIZE]);
+    }
+    op_log.lock.lock();
+    op_log.active = true;
+    op_log.lock.unlock();
+    mutation_gate.write_unlock();
+    replication.attaches++;
+    replication.attached = true;
+
+    bool alive = send_all(sock, image.data(), image.size());
+    while (alive) {
+        deque<string> records;
+        {
+            unique_lock<mutex> lk(op_log.lock);
+            op_log.ready.wait(lk, [] { return !op_log.records.empty() || !op_log.active; });
+            if (!op_log.active) break;
+            records.swap(op_log.records);
+            op_log.queued = 0;
         }
+        for (const string &record : records) {
+            alive = send_all(sock, record.data(), record.size());
+            if (!alive) break;
+            replication.shipped++;
+        }
+    }
+    op_log.lock.lock();
+    op_log.detach();
+    op_log.lock.unlock();
+    replication.attached = false;
+    close(sock);
+}
 
-        case DELETE:  {
-            if (size == 0 && req_begin[r] == '\0') {
-                return true;
-            } else {
-                return false;
-            }
+// Thread function of the replica socket: serve standbys one at a time
+static void replica_service(int listener) {
+    while (true) {
+        int sock = accept(listener, nullptr, nullptr);
+        if (sock == -1) { continue; }
+        ship_log(sock);
+    }
+}
+
+static bool replica_init(unsigned int port) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == -1) { return false; }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (port > 65535 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listener, 1) == -1) {
+        close(listener);
+        return false;
+    }
+    thread replica(replica_service, listener);
+    replica.detach();
+    return true;
+}
+
+// Connect to the primary at "host:port" and copy its disk image to the disk.
+// Call before load_fs.
+static bool standby_init(const char* primary) {
+    string addr_str(primary);
+    size_t colon = addr_str.rfind(':');
+    unsigned int port;
+    if (colon == string::npos ||
+        !cvt_int(addr_str.c_str()+colon+1, addr_str.size()-colon-1, port) || port > 65535) {
+        return false;
+    }
+    struct hostent *host = gethostbyname(addr_str.substr(0, colon).c_str());
+    if (host == nullptr) { return false; }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    memcpy(&addr.sin_addr, host->h_addr, host->h_length);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) { return false; }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return false;
+    }
+    char block[FS_BLOCKSIZE];
+    for (unsigned int i = 0; i < FS_DISKSIZE; i++) {
+        if (!recv_all(sock, block, FS_BLOCKSIZE)) {
+            close(sock);
+            return false;
         }
-        default: { break; }
+        disk_writeblock(i, block);
     }
+    replication.primary = sock;
+    replication.standby = true;
+    replication.attached = true;
     return true;
-};
+}
+
+// Replay one record of the log (see "Log shipping"). Return true if it succeeded.
+static bool apply_record(const string &record) {
+    size_t header_end = record.find('\0');
+    size_t path_end = (header_end == string::npos)? header_end: record.find('\0', header_end+1);
+    size_t new_path_end = (path_end == string::npos)? path_end: record.find('\0', path_end+1);
+    if (new_path_end == string::npos) { return false; }
+    // <kind> <username> <offset> <type>, where the username of a snapshot is empty
+    size_t user_pos = record.find(' ')+1;
+    size_t offset_pos = record.find(' ', user_pos)+1;
+    size_t type_pos = record.find(' ', offset_pos)+1;
+    if (user_pos == 0 || offset_pos == 0 || type_pos == 0 || type_pos+1 != header_end) {
+        return false;
+    }
+    string kind(record, 0, user_pos-1);
+    string name(record, header_end+1, path_end-header_end-1);
+    if (kind == "SNAPSHOT_CREATE") {
+        return snapshot_command("create", name) == "ok\n";
+    }
+    if (kind == "SNAPSHOT_DELETE") {
+        // a snapshot taken before the standby attached was never replicated to it
+        string reply(snapshot_command("delete", name));
+        return reply == "ok\n" || reply == "error: no such snapshot\n";
+    }
+    static const unordered_map<string, request_type> kinds = {
+        {"WRITE", WRITE}, {"CREATE", CREATE}, {"DELETE", DELETE},
+        {"DELETE_TREE", DELETE_TREE}, {"RENAME", RENAME}};
+    auto found = kinds.find(kind);
+    if (found == kinds.end()) { return false; }
+    operation_t op;
+    op.type = found->second;
+    op.replica = true;
+    op.username = record.substr(user_pos, offset_pos-user_pos-1);
+    op.pathname = name;
+    op.new_pathname = record.substr(path_end+1, new_path_end-path_end-1);
+    op.cr_type = record[type_pos];
+    if (!cvt_int(record.c_str()+offset_pos, type_pos-offset_pos-1, op.block)) { return false; }
+    if (op.type == WRITE) {
+        if (record.size() != new_path_end+1+FS_BLOCKSIZE) { return false; }
+        memcpy(op.write_data, record.data()+new_path_end+1, FS_BLOCKSIZE);
+    }
+    return conduct_request(&op);
+}
+
+// Thread function of a standby: replay the primary's log until promoted or disconnected
+static void standby_service(int sock) {
+    while (true) {
+        // <size><NULL><record>
+        string size_str;
+        char c = '\0';
+        while (size_str.size() <= MAXSIZE_INT && recv_all(sock, &c, 1) && c != '\0') {
+            size_str += c;
+        }
+        unsigned int size;
+        if (c != '\0' || !cvt_int(size_str.c_str(), size_str.size(), size) ||
+            size > MAX_RECORD) {
+            break;
+        }
+        string record(size, '\0');
+        if (!recv_all(sock, &record[0], size)) break;
+        lock_guard<mutex> lk(replication.apply_lock);
+        if (!replication.standby) break;
+        if (!apply_record(record)) {
+            replication.failed++;
+            replication.diverged = true;
+            cerr << "standby diverged from the primary; restart it to resync" << endl;
+            break;
+        }
+        replication.applied++;
+    }
+    lock_guard<mutex> lk(replication.apply_lock);
+    close(sock);
+    replication.primary = -1;
+    replication.attached = false;
+}
+
+// Stop replaying the log, after the record being replayed, and accept mutations
+static string promote() {
+    lock_guard<mutex> lk(replication.apply_lock);
+    if (!replication.standby) { return "error: not a standby\n"; }
+    if (replication.diverged) { return "error: diverged from the primary\n"; }
+    replication.standby = false;
+    if (replication.primary != -1) {
+        shutdown(replication.primary, SHUT_RDWR);
+    }
+    return "ok\n";
+}
+
+static string replication_report() {
+    lock_guard<mutex> lk(op_log.lock);
+    return "{\"role\":\""+string(replication.standby? "standby": "primary")+
+           "\",\"attached\":"+(replication.attached? "true": "false")+
+           ",\"diverged\":"+(replication.diverged? "true": "false")+
+           ",\"attaches\":"+to_string(replication.attaches.load())+
+           ",\"log_records\":"+to_string(op_log.appended)+
+           ",\"log_queued_bytes\":"+to_string(op_log.queued)+
+           ",\"log_dropped\":"+to_string(op_log.dropped)+
+           ",\"shipped\":"+to_string(replication.shipped.load())+
+           ",\"applied\":"+to_string(replication.applied.load())+
+           ",\"failed\":"+to_string(replication.failed.load())+"}\n";
+}
+
+
+// decode_request, charging its time to the recv, decrypt and parse phases of op
+static bool timed_decode_request(request_t *request, operation_t *op) {
+    if (!metrics_enabled) {
+        return decode_request(request, op);
+    }
+    uint64_t start = now_ns();
+    uint64_t decrypt_base = phase_ns[PHASE_DECRYPT];
+    bool succ = decode_request(request, op);
+    op->start_ns = request->start_ns;
+    op->phase_times[PHASE_RECV] = request->recv_ns;
+    op->phase_times[PHASE_DECRYPT] = phase_ns[PHASE_DECRYPT]-decrypt_base;
+    op->phase_times[PHASE_PARSE] = now_ns()-start-op->phase_times[PHASE_DECRYPT];
+    return succ;
+}
+
+// Conduct a decoded request. Return true if it succeeded.
+static bool conduct_request(operation_t *op) {
+    if (op->type == PIPELINE) { return true; }
+    if (op->type == RELEASE) { return false; }
+    if (replication.diverged) { return false; }
+    if (op->type == SESSION) {
+        // operation of fs_session
+        ssmap_lock.lock();
+        
+        if (session_max) {
+            // no more sessions avalable
+            ssmap_lock.unlock();
+            return false;
+        }
+        if (session_id == numeric_limits<unsigned int>::max()) {
+            // Num of session reaches to the max
+            session_max = true;
+        }
+        US_map[op->username].insert(session_id);
+        SS_map[session_id] = op->sequence;
+        op->session = session_id++;
+
+        ssmap_lock.unlock();
+        return true;
+    }
+    if (replication.standby && !op->replica &&
+        (op->type == WRITE || op->type == APPEND || op->type == CREATE ||
+         op->type == DELETE || op->type == DELETE_TREE || op->type == RENAME)) {
+        // a standby only serves reads until it is promoted
+        return false;
+    }
+    if (op->type == READ && op->pipe != nullptr && op->pipe->leases) {
+        lease_table.grant(op->pathname, op->pipe);
+        op->lease_ms = lease_ms;
+    }
+    bool succ;
+    {
+        // revoking leases below waits for other clients, not for a slot
+        qos_guard_t slot(op);
+        if (op->type == RENAME) {
+            succ = conduct_rename(op->pathname, op->new_pathname, op->username.c_str());
+        } else {
+            succ = conduct_operation(op->pathname, op->username.c_str(), op->block,
+                                     op->cr_type, op->write_data, op->read_data, op->type);
+        }
+    }
+    if (succ && (op->type == WRITE || op->type == APPEND || op->type == DELETE)) {
+        lease_table.revoke(op->pathname);
+    } else if (succ && (op->type == DELETE_TREE || op->type == RENAME)) {
+        lease_table.revoke_tree(op->pathname);
+    }
+    return succ;
+}
 
 // Handle the request message from client. Return immediately if the request is recognized
 // as invalid.
-// 1. Decrypt the request body
-// 2. Parse the request body
-// 3. Conduct the operations
-// 4. Send response
-static void message_handler(request_t *request, int socket) {
-    string header(request->header);
-    string body(request->request_body);
-    if (count_spaces(header.c_str()) != 1) return;
-    int pos = header.find(" ");
+// 1. Decode the request
+// 2. Conduct the operations
+// 3. Send response
+// Return true if the request asked to keep the connection open for pipelining.
+static bool message_handler(request_t *request, int socket, operation_t *op) {
+    if (!timed_decode_request(request, op)) {
+        return false;
+    }
+    uint64_t base[NUM_PHASES];
+    metrics_snapshot(base);
+    bool succ = conduct_request(op);
+    if (succ) {
+        send_response(op->type, op->session, op->sequence, op->read_data, socket, op->password);
+    }
+    if (metrics_enabled) {
+        metrics_record(op->type, op->start_ns, op->phase_times, base);
+    }
+    return succ && op->type == PIPELINE;
+}
 
-    // error handling(EH): 
-    // 1. username is unknown; 
-    // 2. client use the wrong password
+void pipeline_t::dispatch(operation_t *op) {
+    pipe_lock.lock();
+    op->order = next_order++;
+    inflight.push_back(op);
+    bool ready = !blocked(op);
+    op->started = ready;
+    pipe_lock.unlock();
+    if (ready) {
+        launch(op);
+    }
+}
 
-    // get username and size from header
-    string username(header.substr(0, pos));
-    string size(header.substr(pos+1));
+void pipeline_t::work(operation_t *op) {
+    shared_ptr<pipeline_t> self(op->pipe);
+    uint64_t base[NUM_PHASES];
+    metrics_snapshot(base);
+    bool succ = conduct_request(op);
+    respond(op, succ);
+    if (metrics_enabled) {
+        metrics_record(op->type, op->start_ns, op->phase_times, base);
+    }
 
-    // EH1
-    if (UP_map.find(username) == UP_map.end()) {
+    // start the requests that were waiting for this one
+    vector<operation_t*> ready;
+    unique_lock<mutex> lk(pipe_lock);
+    inflight.remove(op);
+    for (operation_t *next : inflight) {
+        if (!next->started && !blocked(next)) {
+            next->started = true;
+            ready.push_back(next);
+        }
+    }
+    bool drained = eof && inflight.empty();
+    lk.unlock();
+    ingress.release(op->charge);
+    delete op;
+    for (operation_t *next : ready) {
+        launch(next);
+    }
+    if (drained) {
+        finish();
+    }
+}
+
+void pipeline_t::close_input() {
+    pipe_lock.lock();
+    eof = true;
+    bool drained = inflight.empty();
+    pipe_lock.unlock();
+    if (drained) {
+        finish();
+    }
+}
+
+void pipeline_t::finish() {
+    lease_table.drop(shared_from_this());
+    shutdown();
+    close(socket);
+}
+
+
+// Longest request header: <username> <size><NULL>
+static const unsigned int MAX_HEADER = FS_MAXUSERNAME+2+MAXSIZE_INT;
+
+// Check the header of a request, received up to its NULL or MAX_HEADER bytes, and
+// strip the NULL. Return false if the header is malformed, the user is unknown or the
+// size is more than any request needs. Otherwise message_size is the size of the body.
+static bool check_header(request_t &request, unsigned int &message_size) {
+    if (request.header.size() == MAX_HEADER ||
+        count_spaces(request.header.c_str())!=1) {
+        ingress.bad_header++;
+        return false;
+    }
+    request.header.pop_back();
+    size_t pos = request.header.find(' ');    
+    string username_str(request.header.substr(0, pos));
+    string size_str(request.header.substr(pos+1));
+
+    if (username_str.size() > FS_MAXUSERNAME ||
+        !cvt_int(size_str.c_str(), strlen(size_str.c_str()), message_size)) {
+        ingress.bad_header++;
+        return false;
+    }
+    if (UP_map.find(username_str) == UP_map.end()) {
+        ingress.unknown_user++;
+        return false;
+    }
+    if (message_size == 0 || message_size > MAX_CIPHERTEXT) {
+        ingress.oversized++;
+        return false;
+    }
+    return true;
+}
+
+// Receive one request: <username> <size><NULL><ciphertext>
+// Return false if the connection is closed or check_header fails; the body is not
+// received then. Otherwise the request holds request.charge bytes of the ingress budget.
+static bool receive_request(int socket, request_t &request) {
+    char buf;
+    unsigned int message_size;
+    request.header = "";
+    request.request_body = nullptr;
+    request.charge = 0;
+
+    // Receive header
+    while (true) {
+        int byteReceived = recv(socket, &buf, 1, 0);
+        if (byteReceived <= 0) {
+            return false;
+        }
+        if (request.header.empty() && metrics_enabled) {
+            request.start_ns = now_ns();
+        }
+        request.header += buf;
+        if (buf == '\0') break;
+        if (request.header.size() == MAX_HEADER) break;
+    }
+    if (!check_header(request, message_size)) {
+        return false;
+    }
+
+    // Receive request body
+    request.charge = message_size+sizeof(operation_t);
+    ingress.acquire(request.charge);
+    request.request_body = new char[message_size]; 
+    if (recv(socket, request.request_body, message_size, MSG_WAITALL) != (int)message_size) {
+        delete [] request.request_body;
+        request.request_body = nullptr;
+        ingress.release(request.charge);
+        return false;
+    }
+    if (metrics_enabled) {
+        request.recv_ns = now_ns()-request.start_ns;
+    }
+    return true;
+}
+
+// Serve a connection after FS_PIPELINE until the client closes it
+// Set up a pipelined connection opened by a successful FS_PIPELINE request
+static shared_ptr<pipeline_t> open_pipeline(int socket, const operation_t &opener) {
+    shared_ptr<pipeline_t> pipe(new pipeline_t());
+    pipe->socket = socket;
+    pipe->username = opener.username;
+    pipe->password = opener.password;
+    pipe->leases = (opener.cr_type == 'L');
+    return pipe;
+}
+
+// Decode a request received on a pipelined connection and dispatch it. Takes over the
+// request body and charge. Return false if the connection has to be closed.
+static bool pipeline_request(const shared_ptr<pipeline_t> &pipe, request_t &request) {
+    operation_t *op = new operation_t();
+    op->charge = request.charge;
+    bool decode_succ = timed_decode_request(&request, op);
+    delete [] request.request_body;
+    request.request_body = nullptr;
+    if (op->tagged && op->username != pipe->username) {
+        // every request on the connection uses the opener's password
+        ingress.release(op->charge);
+        delete op;
+        return false;
+    }
+    if (decode_succ && op->type == RELEASE) {
+        lease_table.release(op->pathname, pipe);
+        ingress.release(op->charge);
+        delete op;
+        return true;
+    }
+    if (!decode_succ || op->type == PIPELINE) {
+        if (!op->tagged) {
+            ingress.release(op->charge);
+            delete op;
+            return false;
+        }
+        pipe->respond(op, false);
+        ingress.release(op->charge);
+        delete op;
+        return true;
+    }
+    op->pipe = pipe;
+    pipe->dispatch(op);
+    return true;
+}
+
+// Receive the requests of a pipelined connection until it closes; the pipeline closes
+// the socket when they have completed
+static void pipeline_service(int socket, const operation_t &opener) {
+    shared_ptr<pipeline_t> pipe(open_pipeline(socket, opener));
+    request_t request;
+    while (receive_request(socket, request) && pipeline_request(pipe, request)) {
+    }
+    pipe->close_input();
+}
+
+// Thread function for each client request
+static void service(int socket) {
+    // Get request information 
+    request_t request;
+    if (!receive_request(socket, request)) {
+        close(socket);
         return;
     }
+    
+    // Deal with the request
+    operation_t op;
+    bool pipelined = message_handler(&request, socket, &op);
+    delete [] request.request_body;
+    ingress.release(request.charge);
 
-    // lookup password and decrypt the body.
-    const char* password = UP_map[username].c_str();
-    const char* buf_ciphertext = request->request_body;
-    unsigned int size_ciphertext;
-    cvt_int(size.c_str(), strlen(size.c_str()), size_ciphertext);
-
-    unsigned int size_cleartext;
-    void *decryptedmessage;
-    decryptedmessage = fs_decrypt(password, buf_ciphertext, size_ciphertext, &size_cleartext);
-
-    // EH2
-    if (decryptedmessage == nullptr) {
-        return;
+    if (pipelined) {
+        pipeline_service(socket, op);
+    } else {
+        close(socket);
     }
+}
 
-    // judge the type of request 
-    unsigned int session, sequence;
-    char cr_type;
-    string pathname;
-    unsigned int block;
 
-    request_type type;
+/* Event loops */
 
-    // Parse the request
-    // Get the type of request, invalid if the request is not in the right format 
-    // or give wrong info (e.g. non-existed file)
-    char* crequest = (char*)decryptedmessage;
-    unsigned int l = 0, r = 0;
-    // get operation name
-    for (r = 0; r < size_cleartext && crequest[r] != ' '; r++); 
-    string op_str(crequest+l, r-l);
-    if  (op_str.compare("FS_SESSION") == 0)    { 
-        type = SESSION; 
-        if (size_cleartext-r-1 > 2*MAXSIZE_INT+2) { return; }
-    } 
-    else if (op_str.compare("FS_CREATE") == 0)     { 
-        type = CREATE;  
-        if (size_cleartext-r-1 > 2*MAXSIZE_INT+4+FS_MAXPATHNAME+1) { return; }
-    } 
-    else if (op_str.compare("FS_DELETE") == 0)     { 
-        type = DELETE;  
-        if (size_cleartext-r-1 > 2*MAXSIZE_INT+3+FS_MAXPATHNAME) { return; }
-    } 
-    else if (op_str.compare("FS_READBLOCK") == 0)  { 
-        type = READ;    
-        if (size_cleartext-r-1 > 3*MAXSIZE_INT+4+FS_MAXPATHNAME) { return; }
-    } 
-    else if (op_str.compare("FS_WRITEBLOCK") == 0) { 
-        type = WRITE;   
-        if (size_cleartext-r-1 > 3*MAXSIZE_INT+4+FS_MAXPATHNAME+FS_BLOCKSIZE) { return; }
-    } 
-    else                                           { return;}
-    l = r+1;
+// With FS_EVENT_LOOPS=N, connections don't get a thread each. N event loop threads wait
+// for their connections with epoll and receive requests piecewise as bytes arrive, and a
+// pool of FS_WORKERS threads (default 16) conducts the complete ones. A connection that
+// is idle, or slow to send a request, holds no thread, and neither does a pipelined
+// request that waits for a conflicting one. A worker still blocks while it conducts a
+// request (on inode locks, the disk, a scheduling slot or a lease revocation) and while
+// it sends the response.
+// As in the thread per connection mode, the first request of a connection is conducted
+// before more are received, and pipelined requests are decoded in arrival order, on the
+// connection's event loop. A request that doesn't fit the ingress budget leaves its
+// connection unread until it does.
+struct work_queue_t {
+    unsigned int threads = 0;              // 0 if event loops are disabled
+    deque<function<void()> > tasks;
+    unsigned int busy = 0;
+    mutex lock;                            // lock for tasks and busy
+    condition_variable ready;              // signaled when a task is submitted
 
-    // get session number
-    for (r = l; r < size_cleartext && crequest[r] != ' '; r++);
-    if (!cvt_int(crequest+l, r-l, session)) { return; }
-    l = r+1;
+    void submit(function<void()> task) {
+        lock_guard<mutex> lk(lock);
+        tasks.push_back(move(task));
+        ready.notify_one();
+    }
+    // Thread function of a worker
+    void run() {
+        unique_lock<mutex> lk(lock);
+        while (true) {
+            ready.wait(lk, [&] { return !tasks.empty(); });
+            function<void()> task(move(tasks.front()));
+            tasks.pop_front();
+            busy++;
+            lk.unlock();
+            task();
+            lk.lock();
+            busy--;
+        }
+    }
+};
+static work_queue_t workers;
 
-    // get seq num
-    for (r = l; r < size_cleartext && crequest[r] != ' '&&crequest[r] != '\0'; r++);
-    if (!cvt_int(crequest+l, r-l, sequence)) { return; }
-    l = r+1;
+struct event_loop_t;
+struct connection_t {
+    int socket;
+    event_loop_t *loop;
+    request_t request;                     // being received, or conducted by a worker
+    string pending;                        // bytes received past the current request
+    unsigned int message_size = 0;
+    unsigned int received = 0;             // bytes of the body received
+    bool in_body = false;                  // the header has been checked
+    bool starved = false;                  // waiting for the ingress budget
+    shared_ptr<pipeline_t> pipe;           // set once FS_PIPELINE succeeded
+};
 
-    // EH3: username -> session and session -> sequence (except for fs_session)
-    if (type != SESSION) {
-        ssmap_lock.lock();
-        if (US_map.find(username) == US_map.end()) {
-            ssmap_lock.unlock();
-            return;
+struct event_loop_t {
+    enum progress_t { MORE, BUSY, STARVED, CLOSE };
+    int epoll_fd;
+    int wake_fd;                           // eventfd, written when a connection resumes
+    mutex resume_lock;
+    vector<connection_t*> resumed;         // first request done, receive more
+    list<connection_t*> starved;           // waiting for the ingress budget
+    atomic<unsigned long> connections{0};
+
+    bool init() {
+        epoll_fd = epoll_create1(0);
+        wake_fd = eventfd(0, EFD_NONBLOCK);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        return epoll_fd != -1 && wake_fd != -1 &&
+               epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) == 0;
+    }
+    // Wait for the next bytes of conn; each connection is armed for one event at a time,
+    // so only its event loop thread receives from it
+    void arm(connection_t *conn, int op) {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, op, conn->socket, &event) == -1) {
+            cerr << "epoll_ctl error" << endl;
         }
-        auto found_sesh = US_map[username].find(session);
-        if (found_sesh == US_map[username].end() || SS_map[session] >= sequence) { 
-            ssmap_lock.unlock();
-            return;
+    }
+    void add(int socket) {
+        connection_t *conn = new connection_t();
+        conn->socket = socket;
+        conn->loop = this;
+        connections++;
+        arm(conn, EPOLL_CTL_ADD);
+    }
+    // Hand a connection back to its event loop from a worker
+    void resume(connection_t *conn) {
+        resume_lock.lock();
+        resumed.push_back(conn);
+        resume_lock.unlock();
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("write");
+        }
+    }
+    // Forget conn; a pipelined connection's socket is closed once its requests complete
+    void remove(connection_t *conn) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->socket, nullptr);
+        delete [] conn->request.request_body;
+        ingress.release(conn->request.charge);
+        if (conn->pipe != nullptr) {
+            conn->pipe->close_input();
+        } else {
+            close(conn->socket);
+        }
+        connections--;
+        delete conn;
+    }
+    progress_t receive(connection_t *conn);
+    void handle(connection_t *conn) {
+        switch (receive(conn)) {
+            case MORE: arm(conn, EPOLL_CTL_MOD); break;
+            case BUSY: break;
+            case STARVED: starved.push_back(conn); break;
+            case CLOSE: remove(conn); break;
+        }
+    }
+    // Thread function of an event loop
+    void run() {
+        struct epoll_event events[64];
+        while (true) {
+            // retry starved connections every millisecond
+            int ready = epoll_wait(epoll_fd, events, 64, starved.empty()? -1: 1);
+            for (int i = 0; i < ready; i++) {
+                if (events[i].data.ptr != nullptr) {
+                    handle((connection_t*)events[i].data.ptr);
+                    continue;
+                }
+                uint64_t count;
+                if (read(wake_fd, &count, sizeof(count)) != sizeof(count)) { continue; }
+                vector<connection_t*> conns;
+                resume_lock.lock();
+                conns.swap(resumed);
+                resume_lock.unlock();
+                for (connection_t *conn : conns) {
+                    handle(conn);
+                }
+            }
+            list<connection_t*> retry;
+            retry.swap(starved);
+            for (connection_t *conn : retry) {
+                handle(conn);
+            }
         }
-        SS_map[session] = sequence;
-        ssmap_lock.unlock();
-    } 
-    
-    char write_data[FS_BLOCKSIZE];
-    bool parse_succ = parse_req(crequest+r, type, size_cleartext-r, pathname, block, cr_type, write_data);
-    delete [] (char*)decryptedmessage;
-    if (!parse_succ) {
-        return;
     }
+};
+static vector<unique_ptr<event_loop_t> > event_loops;
 
-    // Conduct requests
-    if (type == SESSION) {
-        // operation of fs_session
-        if (session != 0) {
-            return;
+// Conduct the first request of a connection, on a worker
+static void first_request(connection_t *conn) {
+    request_t &request = conn->request;
+    operation_t op;
+    bool pipelined = message_handler(&request, conn->socket, &op);
+    delete [] request.request_body;
+    request.request_body = nullptr;
+    ingress.release(request.charge);
+    request.charge = 0;
+    if (pipelined) {
+        conn->pipe = open_pipeline(conn->socket, op);
+        conn->loop->resume(conn);
+    } else {
+        conn->loop->remove(conn);
+    }
+}
+
+// Receive what has arrived on conn, and handle each request once it is complete:
+//     MORE     wait for more bytes
+//     BUSY     the first request was handed to a worker, which resumes the connection
+//     STARVED  the next request doesn't fit the ingress budget yet
+//     CLOSE    the connection is closed, or has to be
+event_loop_t::progress_t event_loop_t::receive(connection_t *conn) {
+    request_t &request = conn->request;
+    while (true) {
+        if (!conn->in_body) {
+            // header, from the bytes left over from the last request first
+            size_t end = conn->pending.find('\0');
+            if (end == string::npos && conn->pending.size() < MAX_HEADER) {
+                char buf[MAX_HEADER];
+                int n = recv(conn->socket, buf, MAX_HEADER-conn->pending.size(), MSG_DONTWAIT);
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { return MORE; }
+                if (n <= 0) { return CLOSE; }
+                if (conn->pending.empty() && metrics_enabled) {
+                    request.start_ns = now_ns();
+                }
+                conn->pending.append(buf, n);
+                continue;
+            }
+            size_t length = (end == string::npos)? MAX_HEADER: end+1;
+            request.header = conn->pending.substr(0, length);
+            conn->pending.erase(0, length);
+            if (!check_header(request, conn->message_size)) { return CLOSE; }
+            conn->in_body = true;
         }
-        ssmap_lock.lock();
-        
-        if (session_max) {
-            // no more sessions avalable
-            ssmap_lock.unlock();
-            return;
+        if (request.request_body == nullptr) {
+            unsigned long charge = conn->message_size+sizeof(operation_t);
+            if (!ingress.try_acquire(charge)) {
+                if (!conn->starved) {
+                    ingress.waits++;
+                    conn->starved = true;
+                }
+                return STARVED;
+            }
+            conn->starved = false;
+            request.charge = charge;
+            request.request_body = new char[conn->message_size];
+            conn->received = min((size_t)conn->message_size, conn->pending.size());
+            memcpy(request.request_body, conn->pending.data(), conn->received);
+            conn->pending.erase(0, conn->received);
         }
-        if (session_id == numeric_limits<unsigned int>::max()) {
-            // Num of session reaches to the max
-            session_max = true;
+        if (conn->received < conn->message_size) {
+            int n = recv(conn->socket, request.request_body+conn->received,
+                         conn->message_size-conn->received, MSG_DONTWAIT);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { return MORE; }
+            if (n <= 0) { return CLOSE; }
+            conn->received += n;
+            continue;
         }
-        US_map[username].insert(session_id);
-        SS_map[session_id] = sequence;
-        session = session_id++;
 
-        ssmap_lock.unlock();
+        // a whole request
+        conn->in_body = false;
+        if (metrics_enabled) {
+            request.recv_ns = now_ns()-request.start_ns;
+        }
+        if (conn->pipe == nullptr) {
+            workers.submit([conn] { first_request(conn); });
+            return BUSY;
+        }
+        bool keep = pipeline_request(conn->pipe, request);
+        request.charge = 0;
+        if (!keep) { return CLOSE; }
+        if (!conn->pending.empty() && metrics_enabled) {
+            request.start_ns = now_ns();
+        }
     }
-    const char* c_username = username.c_str();
-    char read_data[FS_BLOCKSIZE];
-    bool op_succ = conduct_operation(pathname, c_username, block, cr_type, write_data, read_data, type);
-    if (!op_succ) {
-       return;
+}
+
+// Start count event loops and the workers; return false on failure
+static bool event_loops_init(unsigned int count, unsigned int worker_count) {
+    for (unsigned int i = 0; i < count; i++) {
+        event_loop_t *loop = new event_loop_t();
+        event_loops.emplace_back(loop);
+        if (!loop->init()) { return false; }
+        thread loop_thread(&event_loop_t::run, loop);
+        loop_thread.detach();
+    }
+    workers.threads = worker_count;
+    for (unsigned int i = 0; i < worker_count; i++) {
+        thread worker(&work_queue_t::run, &workers);
+        worker.detach();
     }
-    send_response(type, session, sequence, read_data, socket, password);
+    return true;
 }
 
-// Recursively traverse the existed file system
-// Load free_blocks and fs_locks
-void traverse_fs(unsigned int inode_block) {
-    fs_inode inode;
-    disk_readblock(inode_block, (void*)(&inode));
-   
-    num_block_remain--;
-    free_blocks.erase(remove(free_blocks.begin(), free_blocks.end(), inode_block)); 
-    for (unsigned int i = 0; i < inode.size; i++) {
-        num_block_remain--;
-        free_blocks.erase(remove(free_blocks.begin(), free_blocks.end(), inode.blocks[i])); 
+// Serve a new connection with an event loop, or a thread of its own
+static void serve_connection(int socket) {
+    static atomic<unsigned long> next_loop{0};
+    if (event_loops.empty()) {
+        thread request(service, socket);
+        request.detach();
+    } else {
+        event_loops[next_loop++ % event_loops.size()]->add(socket);
     }
-    mm_fs_locks.add_lock(inode_block);
+}
 
-    if (inode.type == 'f' || inode.size == 0) {
-        return;
+void pipeline_t::launch(operation_t *op) {
+    if (workers.threads > 0) {
+        workers.submit([op] { op->pipe->work(op); });
+    } else {
+        thread worker(&pipeline_t::work, this, op);
+        worker.detach();
     }
-    
-    fs_direntry* blk_direts = new fs_direntry[FS_DIRENTRIES];    
-    for (unsigned int i = 0; i < inode.size; i++) {
-        disk_readblock(inode.blocks[i], (void*)blk_direts);
-        for (unsigned int j = 0; j < FS_DIRENTRIES; j++) {
-            if (blk_direts[j].inode_block == 0) continue;
-            traverse_fs(blk_direts[j].inode_block);
-        }
+}
+
+static string event_loops_report() {
+    unsigned long connections = 0;
+    for (auto &loop : event_loops) {
+        connections += loop->connections.load();
     }
-    delete [] blk_direts;
+    lock_guard<mutex> lk(workers.lock);
+    return "{\"event_loops\":"+to_string(event_loops.size())+
+           ",\"connections\":"+to_string(connections)+
+           ",\"workers\":"+to_string(workers.threads)+
+           ",\"busy_workers\":"+to_string(workers.busy)+
+           ",\"queued\":"+to_string(workers.tasks.size())+"}\n";
 }
 
-// Thread function for each client request
-static void service(int socket) {
-    // Get request information 
-    string buffer;
-    char buf;
-    unsigned int message_size;
-    request_t request;
-    char username[FS_MAXUSERNAME+1];
-    buffer = "";
-    unsigned int total_bytes = 0;
 
-    // Receive header
+/* Admin socket */
+
+// Reports on the running server are served on the unix domain socket named by
+// FS_ADMIN_SOCKET, one client at a time. A client sends one command line and reads the
+// report until EOF.
+//     metrics      latency histograms per request type and phase (needs FS_METRICS=1)
+//     locks [N]    lock contention, with the N most waited-for inodes (needs FS_LOCKPROF=1)
+//     locks reset  clear the lock contention counters
+//     snapshot create <name> / snapshot delete <name> / snapshot [list]
+//     dedup        data blocks, references, blocks saved and hashing cost
+//     compression  blocks stored compressed and as they are, pack blocks, compression cost
+//     ingress      ingress memory budget in use, waits for it, and rejected requests
+//     qos          per-user shares, rates, queue depths and waits for a slot (FS_QOS_SLOTS)
+//     acceptors    cores and connections accepted of each listening socket (FS_ACCEPTORS)
+//     events       connections on event loops, and busy and queued workers (FS_EVENT_LOOPS)
+//     replication  role, standby attached, and log records shipped or replayed
+//     promote      make a hot standby (FS_STANDBY) a primary
+//     segments     blocks written to the log and segments freed by the cleaner (FS_SEGMENT_BLOCKS)
+//     defrag start / defrag   start a defragmenter pass / fragmentation before and after it
+typedef string (*admin_command_t)(const string &args);
+static unordered_map<string, admin_command_t> admin_commands;
+
+// Thread function of the admin socket
+static void admin_service(int listener) {
     while (true) {
-        int byteReceived = recv(socket, &buf, 1, 0);
-        if (byteReceived <= 0) {
-            perror("recv");
+        int conn = accept(listener, nullptr, nullptr);
+        if (conn == -1) { continue; }
+        // a client that doesn't send its line, or read the reply, holds up the others
+        // for a second at most
+        struct timeval timeout = {1, 0};
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        string line;
+        char c;
+        while (line.size() < FS_MAXPATHNAME && read(conn, &c, 1) == 1 && c != '\n') {
+            line += c;
         }
-        request.header += buf;
-        total_bytes++;
-        if (buf == '\0') break;
-        if (total_bytes == FS_MAXUSERNAME+2+MAXSIZE_INT) break;
+        size_t pos = line.find(' ');
+        string command(line.substr(0, pos));
+        string args(pos == string::npos? "": line.substr(pos+1));
+        auto found = admin_commands.find(command);
+        string reply(found == admin_commands.end()? "unknown command\n": found->second(args));
+        unsigned int sent = 0;
+        while (sent < reply.size()) {
+            int s = write(conn, reply.c_str()+sent, reply.size()-sent);
+            if (s <= 0) break;
+            sent += s;
+        }
+        close(conn);
     }
-    if (total_bytes==FS_MAXUSERNAME+12 || 
-        count_spaces(request.header.c_str())!=1) {
-        close(socket);
-        return;
+}
+
+static bool admin_init(const char* path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) { return false; }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == -1) { return false; }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listener, 10) == -1) {
+        close(listener);
+        return false;
     }
-    size_t pos = request.header.find(' ');    
-    string username_str(request.header.substr(0, pos));
-    string size_str(request.header.substr(pos+1));
+    thread admin(admin_service, listener);
+    admin.detach();
+    return true;
+}
 
-    if (username_str.size() > FS_MAXUSERNAME ||
-        !cvt_int(size_str.c_str(), strlen(size_str.c_str()), message_size)) {
-        close(socket);
+
+/* Acceptors */
+
+// With FS_ACCEPTORS=N the server listens on N sockets bound to its port with SO_REUSEPORT,
+// and the kernel spreads new connections over them. Each socket has an acceptor thread
+// pinned to a group of cores, and the threads that serve its connections inherit the
+// pinning, so a request is received, conducted and answered on the cores that accepted
+// its connection. The cores are ordered by NUMA node before they are split into groups,
+// so a group only spans nodes when there are fewer groups than nodes.
+struct acceptor_t {
+    int sock = -1;
+    vector<int> cpus;                      // empty if not pinned
+    atomic<unsigned long> accepted{0};
+};
+static vector<unique_ptr<acceptor_t> > acceptors;
+
+// NUMA node of cpu, 0 if unknown
+static unsigned int cpu_node(int cpu) {
+    DIR *dir = opendir(("/sys/devices/system/cpu/cpu"+to_string(cpu)).c_str());
+    if (dir == nullptr) { return 0; }
+    unsigned int node = 0;
+    while (struct dirent *entry = readdir(dir)) {
+        if (strncmp(entry->d_name, "node", 4) == 0 &&
+            cvt_int(entry->d_name+4, strlen(entry->d_name+4), node)) {
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+// Create count acceptors over the cores the server may run on, or one unpinned
+// acceptor if count is 0
+static void acceptors_init(unsigned int count) {
+    if (count == 0) {
+        acceptors.emplace_back(new acceptor_t());
         return;
     }
+    cpu_set_t allowed;
+    vector<pair<unsigned int, int> > cores;    // (node, cpu)
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cores.push_back(make_pair(cpu_node(cpu), cpu));
+            }
+        }
+    }
+    sort(cores.begin(), cores.end());
+    for (unsigned int i = 0; i < count; i++) {
+        acceptor_t *acceptor = new acceptor_t();
+        acceptors.emplace_back(acceptor);
+        if (cores.empty()) continue;
+        // with more acceptors than cores, several share a core
+        size_t first = i*cores.size()/count;
+        size_t last = max(first+1, (i+1)*cores.size()/count);
+        for (size_t c = first; c < last; c++) {
+            acceptor->cpus.push_back(cores[c].second);
+        }
+    }
+}
 
-    strcpy(username, username_str.c_str());
+// Open a socket listening on port, 0 for any port. Return -1 on failure.
+static int listen_socket(int port, bool reuseport) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        cerr << "socket error" << endl;
+        return -1;
+    }
+    int one = 1;
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        close(sock);
+        cerr << "setsockopt error" << endl;
+        return -1;
+    }
+    struct sockaddr_in addrServer;
+    addrServer.sin_family = AF_INET;
+    addrServer.sin_port = htons(port);
+    addrServer.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr *)&addrServer, sizeof(addrServer)) == -1) {
+        close(sock);
+        cerr << "bind error" << endl;
+        return -1;
+    }
+    if (listen(sock, SOMAXCONN) == -1) {
+        close(sock);
+        cerr << "listen error" << endl;
+        return -1;
+    }
+    return sock;
+}
 
-    // Receive response body
-    request.request_body = new char[message_size]; 
-    recv(socket, request.request_body, message_size, MSG_WAITALL);
-    
-    // Deal with the request
-    message_handler(&request, socket);
+// Thread function of an acceptor: accept connections and hand them to serve_connection
+static void acceptor_service(acceptor_t *acceptor) {
+    if (!acceptor->cpus.empty()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu : acceptor->cpus) {
+            CPU_SET(cpu, &cpus);
+        }
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+            cerr << "sched_setaffinity error" << endl;
+        }
+    }
+    struct sockaddr_in addrClient;
+    while (true) {
+        socklen_t addr_size = sizeof(addrClient);
+        int newConnect = accept(acceptor->sock, (struct sockaddr *)&addrClient, &addr_size);
+        if (newConnect == -1) {
+            cerr << "accept error" << endl;
+            continue;
+        }
+        acceptor->accepted++;
+        serve_connection(newConnect);
+    }
+}
 
-    delete [] request.request_body;
-    close(socket);
+static string acceptors_report() {
+    ostringstream out;
+    out << "{\"acceptors\":[";
+    for (size_t i = 0; i < acceptors.size(); i++) {
+        out << (i == 0? "": ",") << "{\"cpus\":[";
+        for (size_t c = 0; c < acceptors[i]->cpus.size(); c++) {
+            out << (c == 0? "": ",") << acceptors[i]->cpus[c];
+        }
+        out << "],\"accepted\":" << acceptors[i]->accepted.load() << "}";
+    }
+    out << "]}\n";
+    return out.str();
 }
 
 int main (int argc, char** argv) {
@@ -1011,7 +5050,7 @@ int main (int argc, char** argv) {
     // 1. get server and server_port from arguments
     // 2. read the lists of usernames and passwords from stdin
     // 3. initialze the list of free blocks(empty fs or used fs)
-    // 4. set up the socket 
+    // 4. set up the listening sockets
     
     // get server and server_port from arguments
     if (argc > 2) {
@@ -1025,6 +5064,100 @@ int main (int argc, char** argv) {
         server_port = 0; 
     }
     
+    // read the server options from the environment
+    unsigned int metrics = 0;
+    env_option("FS_LEASE_MS", lease_ms);
+    unsigned int lockprof = 0;
+    env_option("FS_METRICS", metrics);
+    env_option("FS_LOCKPROF", lockprof);
+    unsigned int quiet = 0;
+    env_option("FS_QUIET", quiet);
+    unsigned int dedup_option = 0;
+    env_option("FS_DEDUP", dedup_option);
+    dedup_enabled = (dedup_option != 0);
+    unsigned int compress_option = 0;
+    env_option("FS_COMPRESS", compress_option);
+    compress_enabled = (compress_option != 0);
+    env_option("FS_QOS_SLOTS", qos.slots);
+    unordered_map<string, unsigned int> shares, rates;
+    env_user_option("FS_QOS_SHARES", shares);
+    env_user_option("FS_QOS_RATES", rates);
+    for (auto &share : shares) {
+        if (share.second == 0) {
+            cerr << "error: invalid FS_QOS_SHARES" << endl;
+            exit(1);
+        }
+        qos.users[share.first].share = share.second;
+    }
+    for (auto &rate : rates) {
+        qos.users[rate.first].rate = rate.second;
+    }
+    unsigned int acceptor_count = 0;
+    env_option("FS_ACCEPTORS", acceptor_count);
+    acceptors_init(acceptor_count);
+    unsigned int loop_count = 0;
+    unsigned int worker_count = 16;
+    env_option("FS_EVENT_LOOPS", loop_count);
+    env_option("FS_WORKERS", worker_count);
+    unsigned int ingress_kb = ingress.budget >> 10;
+    env_option("FS_INGRESS_KB", ingress_kb);
+    ingress.budget = (unsigned long)ingress_kb << 10;
+    unsigned int log_kb = op_log.limit >> 10;
+    env_option("FS_LOG_KB", log_kb);
+    op_log.limit = (unsigned long)log_kb << 10;
+    unsigned int replica_port = 0;
+    env_option("FS_REPLICA_PORT", replica_port);
+    const char* primary = getenv("FS_STANDBY");
+    unsigned int segment_blocks = 0;
+    env_option("FS_SEGMENT_BLOCKS", segment_blocks);
+    env_option("FS_DEFRAG_IOPS", defrag.budget);
+    if (segment_blocks > FS_DISKSIZE/2) {
+        cerr << "error: invalid FS_SEGMENT_BLOCKS" << endl;
+        exit(1);
+    }
+    fs_quiet = disk_quiet = (quiet != 0);
+    metrics_enabled = (metrics != 0);
+    lockprof_enabled = (lockprof != 0);
+    if (metrics_enabled) {
+        metrics_init();
+    }
+    admin_commands["metrics"] = [](const string &) { return metrics_report(); };
+    admin_commands["locks"] = [](const string &args) {
+        if (args == "reset") {
+            mm_fs_locks.reset_stats();
+            return string("ok\n");
+        }
+        unsigned int top = 10;
+        cvt_int(args.c_str(), args.size(), top);
+        return mm_fs_locks.report(top);
+    };
+    admin_commands["dedup"] = [](const string &) { return dedup.report(); };
+    admin_commands["compression"] = [](const string &) { return packer.report(); };
+    admin_commands["ingress"] = [](const string &) { return ingress.report(); };
+    admin_commands["qos"] = [](const string &) { return qos.report(); };
+    admin_commands["acceptors"] = [](const string &) { return acceptors_report(); };
+    admin_commands["events"] = [](const string &) { return event_loops_report(); };
+    admin_commands["replication"] = [](const string &) { return replication_report(); };
+    admin_commands["promote"] = [](const string &) { return promote(); };
+    admin_commands["segments"] = [](const string &) { return segments.report(); };
+    admin_commands["defrag"] = [](const string &args) {
+        return args == "start"? defrag.start(): defrag.report();
+    };
+    admin_commands["snapshot"] = [](const string &args) {
+        size_t pos = args.find(' ');
+        string command(args.substr(0, pos));
+        string name(pos == string::npos? "": args.substr(pos+1));
+        if (command == "create" || command == "delete") {
+            return snapshot_command(command, name);
+        }
+        return snapshots.report();
+    };
+    const char* admin_path = getenv("FS_ADMIN_SOCKET");
+    if (admin_path != nullptr && !admin_init(admin_path)) {
+        cerr << "admin socket error" << endl;
+        return 1;
+    }
+
     // read the lists of usernames and passwords from stdin
     string line;
     char username[FS_MAXUSERNAME+1]; 
@@ -1035,60 +5168,57 @@ int main (int argc, char** argv) {
         UP_map[username] = password;
     }
     
-    // initialze the list of free blocks(empty fs or used fs)
-    // initialize the fs_locks
-    for (unsigned int i = 0; i < FS_DISKSIZE; i++) {
-        free_blocks.push_back(i);
-    } 
-    num_block_remain = FS_DISKSIZE;
-    traverse_fs(0);
-    
-    // socket
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        cerr << "socket error" << endl;
+    // a standby starts from the disk image of the primary
+    if (primary != nullptr && !standby_init(primary)) {
+        cerr << "standby error" << endl;
         return 1;
     }
 
-    int newConnect;
-    struct sockaddr_in addrServer;
-    struct sockaddr_in addrClient;
-
-    // bind
-    addrServer.sin_family = AF_INET;
-    addrServer.sin_port = htons(server_port);
-    addrServer.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (bind(sock, (struct sockaddr *)&addrServer, sizeof(addrServer)) == -1) {
-        close(sock);
-        cerr << "bind error" << endl;
-        return 1;
+    // initialze the list of free blocks(empty fs or used fs)
+    // initialize the directory snapshots
+    load_fs();
+    if (segment_blocks > 0) {
+        segments.start(segment_blocks);
     }
-    int rval;
-    socklen_t len = sizeof(addrServer);
-    rval = getsockname(sock, (struct sockaddr *)&addrServer, &len);
-    if (rval != 0) {
-        cerr << "get sockname failed" << endl;
-        return 1;
+    if (replication.standby) {
+        thread standby(standby_service, replication.primary);
+        standby.detach();
     }
-    cout << "\n@@@ port " << ntohs(addrServer.sin_port) << endl;
-    
-    // listen
-    if (listen(sock, 10) == -1) {
-        close(sock);
-        cerr << "listen error" << endl;
+    if (replica_port != 0 && !replica_init(replica_port)) {
+        cerr << "replica socket error" << endl;
         return 1;
     }
-    socklen_t addr_size = sizeof(addrClient);
     
-    // while loop to accept, send/receive 
-    while (true) {
-        newConnect = accept(sock, (struct sockaddr *)&addrClient, &addr_size);
-        if (newConnect == -1) {
-            close(sock);
-            cerr << "accept error" << endl;
-            continue;
+    // listen on the port, on one socket per acceptor
+    // (the first socket picks the port if none was given)
+    bool reuseport = (acceptor_count > 0);
+    for (auto &acceptor : acceptors) {
+        acceptor->sock = listen_socket(server_port, reuseport);
+        if (acceptor->sock == -1) {
+            return 1;
         }
-        thread request(service, newConnect);
-        request.detach();
+        struct sockaddr_in addrServer;
+        socklen_t len = sizeof(addrServer);
+        if (getsockname(acceptor->sock, (struct sockaddr *)&addrServer, &len) != 0) {
+            cerr << "get sockname failed" << endl;
+            return 1;
+        }
+        server_port = ntohs(addrServer.sin_port);
+    }
+    cout << "\n@@@ port " << server_port << endl;
+
+    // start the event loops, if connections are served by them
+    if (loop_count > 0 && (worker_count == 0 || !event_loops_init(loop_count, worker_count))) {
+        cerr << "event loop error" << endl;
+        return 1;
+    }
+
+    // accept connections, the first acceptor on this thread
+    for (size_t i = 1; i < acceptors.size(); i++) {
+        thread acceptor(acceptor_service, acceptors[i].get());
+        acceptor.detach();
     }
+    acceptor_service(acceptors[0].get());
 }
+
+#endif /* FS_CORE_ONLY */
@@ -0,0 +1,305 @@
+/*
+ * fs_bench.cpp
+ *
+ * Load generator for the file server. Runs a set of workloads from N client
+ * threads through the client library and reports throughput and latency per
+ * operation. Runs are reproducible for a given seed.
+ *
+ * usage: fs_bench <hostname> <port> [-t threads] [-n ops per thread]
+ *                 [-s seed] [-w workload,...] [-u username] [-p password]
+ */
+#include "fs_client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+
+using namespace std;
+
+static unsigned int num_threads = 4;
+static unsigned int ops_per_thread = 1000;
+static unsigned int seed = 1;
+static const char *username = "user1";
+static const char *password = "password1";
+
+static const unsigned int READ_FILES = 16;       // read_heavy: files
+static const unsigned int READ_BLOCKS = 8;       // read_heavy: blocks per file
+static const unsigned int DEEP_DEPTH = 8;        // deep_paths: directories above the file
+
+// Latencies of one operation type, in nanoseconds
+struct op_stats_t {
+    vector<uint64_t> latencies;
+    unsigned int errors = 0;
+};
+
+// Per-thread client state: its own session and sequence numbers
+struct client_t {
+    unsigned int session = 0;
+    unsigned int sequence = 0;
+    mt19937 rng;
+    map<string, op_stats_t> stats;             // operation -> latencies
+
+    // Run one client call and record its latency under op
+    int timed(const string &op, const function<int()> &call) {
+        auto start = chrono::steady_clock::now();
+        int rc = call();
+        auto end = chrono::steady_clock::now();
+        op_stats_t &s = stats[op];
+        s.latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(end-start).count());
+        if (rc != 0) {
+            s.errors++;
+        }
+        return rc;
+    }
+    int open_session() {
+        sequence = 0;
+        return fs_session(username, password, &session, sequence++);
+    }
+    int readblock(const string &path, unsigned int offset, char *buf) {
+        return fs_readblock(username, password, session, sequence++, path.c_str(), offset, buf);
+    }
+    int writeblock(const string &path, unsigned int offset, const char *buf) {
+        return fs_writeblock(username, password, session, sequence++, path.c_str(), offset, buf);
+    }
+    int create(const string &path, char type) {
+        return fs_create(username, password, session, sequence++, path.c_str(), type);
+    }
+    int remove(const string &path) {
+        return fs_delete(username, password, session, sequence++, path.c_str());
+    }
+};
+
+// A workload: untimed setup and teardown on one client, and the timed body run by
+// every thread
+struct workload_t {
+    string name;
+    function<void(client_t&)> setup;
+    function<void(client_t&, unsigned int)> run;   // client, thread index
+    function<void(client_t&)> teardown;
+};
+
+static string deep_dir(unsigned int depth) {
+    string path;
+    for (unsigned int i = 0; i < depth; i++) {
+        path += "/d"+to_string(i);
+    }
+    return path;
+}
+
+static vector<workload_t> make_workloads() {
+    vector<workload_t> workloads;
+    char block[FS_BLOCKSIZE];
+    memset(block, 'b', FS_BLOCKSIZE);
+
+    // read_heavy: 95% random block reads, 5% overwrites, over a set of shared files
+    workloads.push_back(workload_t{"read_heavy",
+        [=](client_t &c) {
+            c.create("/bench_r", 'd');
+            for (unsigned int f = 0; f < READ_FILES; f++) {
+                string path("/bench_r/f"+to_string(f));
+                c.create(path, 'f');
+                for (unsigned int b = 0; b < READ_BLOCKS; b++) {
+                    c.writeblock(path, b, block);
+                }
+            }
+        },
+        [=](client_t &c, unsigned int) {
+            char buf[FS_BLOCKSIZE];
+            for (unsigned int i = 0; i < ops_per_thread; i++) {
+                string path("/bench_r/f"+to_string(c.rng()%READ_FILES));
+                unsigned int offset = c.rng()%READ_BLOCKS;
+                if (c.rng()%100 < 95) {
+                    c.timed("read", [&] { return c.readblock(path, offset, buf); });
+                } else {
+                    c.timed("write", [&] { return c.writeblock(path, offset, block); });
+                }
+            }
+        },
+        [](client_t &c) {
+            for (unsigned int f = 0; f < READ_FILES; f++) {
+                c.remove("/bench_r/f"+to_string(f));
+            }
+            c.remove("/bench_r");
+        }});
+
+    // append_heavy: every thread appends to its own file, starting over when it is full
+    workloads.push_back(workload_t{"append_heavy",
+        [](client_t &c) { c.create("/bench_a", 'd'); },
+        [=](client_t &c, unsigned int t) {
+            string path("/bench_a/t"+to_string(t));
+            c.create(path, 'f');
+            unsigned int size = 0;
+            for (unsigned int i = 0; i < ops_per_thread; i++) {
+                if (size == FS_MAXFILEBLOCKS) {
+                    c.timed("delete", [&] { return c.remove(path); });
+                    c.timed("create", [&] { return c.create(path, 'f'); });
+                    size = 0;
+                }
+                c.timed("append", [&] { return c.writeblock(path, size, block); });
+                size++;
+            }
+            c.remove(path);
+        },
+        [](client_t &c) { c.remove("/bench_a"); }});
+
+    // churn: create and delete files in one shared directory
+    workloads.push_back(workload_t{"churn",
+        [](client_t &c) { c.create("/bench_c", 'd'); },
+        [=](client_t &c, unsigned int t) {
+            for (unsigned int i = 0; i < ops_per_thread/2; i++) {
+                string path("/bench_c/t"+to_string(t)+"_"+to_string(c.rng()%1000));
+                c.timed("create", [&] { return c.create(path, 'f'); });
+                c.timed("delete", [&] { return c.remove(path); });
+            }
+        },
+        [](client_t &c) { c.remove("/bench_c"); }});
+
+    // deep_paths: reads of a file below a long chain of directories
+    workloads.push_back(workload_t{"deep_paths",
+        [=](client_t &c) {
+            for (unsigned int d = 1; d <= DEEP_DEPTH; d++) {
+                c.create(deep_dir(d), 'd');
+            }
+            string path(deep_dir(DEEP_DEPTH)+"/f");
+            c.create(path, 'f');
+            for (unsigned int b = 0; b < READ_BLOCKS; b++) {
+                c.writeblock(path, b, block);
+            }
+        },
+        [=](client_t &c, unsigned int) {
+            char buf[FS_BLOCKSIZE];
+            string path(deep_dir(DEEP_DEPTH)+"/f");
+            for (unsigned int i = 0; i < ops_per_thread; i++) {
+                unsigned int offset = c.rng()%READ_BLOCKS;
+                c.timed("read", [&] { return c.readblock(path, offset, buf); });
+            }
+        },
+        [](client_t &c) {
+            c.remove(deep_dir(DEEP_DEPTH)+"/f");
+            for (unsigned int d = DEEP_DEPTH; d >= 1; d--) {
+                c.remove(deep_dir(d));
+            }
+        }});
+
+    // many_sessions: every request runs in a new session
+    workloads.push_back(workload_t{"many_sessions",
+        [=](client_t &c) {
+            c.create("/bench_s", 'f');
+            c.writeblock("/bench_s", 0, block);
+        },
+        [=](client_t &c, unsigned int) {
+            char buf[FS_BLOCKSIZE];
+            for (unsigned int i = 0; i < ops_per_thread/2; i++) {
+                c.timed("session", [&] { return c.open_session(); });
+                c.timed("read", [&] { return c.readblock("/bench_s", 0, buf); });
+            }
+        },
+        [](client_t &c) { c.remove("/bench_s"); }});
+
+    return workloads;
+}
+
+static uint64_t percentile(const vector<uint64_t> &sorted, double q) {
+    if (sorted.empty()) { return 0; }
+    size_t idx = (size_t)(q*sorted.size());
+    return sorted[min(idx, sorted.size()-1)];
+}
+
+static void run_workload(const workload_t &w) {
+    client_t admin;
+    admin.rng.seed(seed);
+    if (admin.open_session() != 0) {
+        cerr << "error: cannot open a session" << endl;
+        exit(1);
+    }
+    w.setup(admin);
+
+    vector<client_t> clients(num_threads);
+    for (unsigned int t = 0; t < num_threads; t++) {
+        clients[t].rng.seed(seed*1000003+t);
+        if (clients[t].open_session() != 0) {
+            cerr << "error: cannot open a session" << endl;
+            exit(1);
+        }
+    }
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (unsigned int t = 0; t < num_threads; t++) {
+        threads.push_back(thread(w.run, ref(clients[t]), t));
+    }
+    for (thread &t : threads) {
+        t.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+    w.teardown(admin);
+
+    // merge the threads' latencies per operation
+    map<string, op_stats_t> merged;
+    for (client_t &c : clients) {
+        for (auto &entry : c.stats) {
+            op_stats_t &m = merged[entry.first];
+            m.latencies.insert(m.latencies.end(), entry.second.latencies.begin(),
+                               entry.second.latencies.end());
+            m.errors += entry.second.errors;
+        }
+    }
+    for (auto &entry : merged) {
+        vector<uint64_t> &lat = entry.second.latencies;
+        sort(lat.begin(), lat.end());
+        printf("%-14s %-8s %8zu %7u %12.1f %10.1f %10.1f %10.1f\n",
+               w.name.c_str(), entry.first.c_str(), lat.size(), entry.second.errors,
+               lat.size()/seconds, percentile(lat, 0.5)/1000.0,
+               percentile(lat, 0.99)/1000.0, percentile(lat, 0.999)/1000.0);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        cerr << "usage: " << argv[0] << " <hostname> <port> [-t threads] [-n ops] [-s seed]"
+             << " [-w workload,...] [-u username] [-p password]" << endl;
+        exit(1);
+    }
+    const char *hostname = argv[1];
+    uint16_t port = atoi(argv[2]);
+    string selected;
+    optind = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:s:w:u:p:")) != -1) {
+        switch (opt) {
+            case 't': num_threads = atoi(optarg); break;
+            case 'n': ops_per_thread = atoi(optarg); break;
+            case 's': seed = atoi(optarg); break;
+            case 'w': selected = optarg; break;
+            case 'u': username = optarg; break;
+            case 'p': password = optarg; break;
+            default: exit(1);
+        }
+    }
+    if (num_threads == 0 || fs_clientinit(hostname, port) != 0) {
+        cerr << "error: invalid arguments" << endl;
+        exit(1);
+    }
+
+    printf("# fs_bench threads=%u ops=%u seed=%u\n", num_threads, ops_per_thread, seed);
+    printf("%-14s %-8s %8s %7s %12s %10s %10s %10s\n", "workload", "op", "count", "errors",
+           "ops_per_sec", "p50_us", "p99_us", "p999_us");
+    for (const workload_t &w : make_workloads()) {
+        if (!selected.empty() && ("," + selected + ",").find("," + w.name + ",") == string::npos) {
+            continue;
+        }
+        run_workload(w);
+    }
+    return 0;
+}
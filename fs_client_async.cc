@@ -0,0 +1,813 @@
+/*
+ * fs_client_async.cc
+ *
+ * Non-blocking client library. Operations are sent over persistent pipelined
+ * connections (see FS_PIPELINE in fs.cc) and matched with their responses
+ * by session and sequence. With shards, each operation goes to the server
+ * that owns the top-level directory of its pathname.
+ */
+#include "fs_client_async.h"
+#include "fs_crypt.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <iostream>
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <list>
+#include <condition_variable>
+
+using namespace std;
+
+/* Data structures */
+
+// One submitted operation
+struct async_op_t {
+    fs_handle_t handle;
+    unsigned int session;
+    unsigned int sequence;
+    void *read_buf;                        // destination of READ data
+    unsigned int *session_ptr;             // destination of a new session
+    char *type_ptr;                        // destinations of STAT results
+    unsigned int *size_ptr;
+    char *owner;
+    unsigned int *offset_ptr;              // destination of the APPEND offset
+    fs_callback_t callback;
+    void *arg;
+    string cache_key;                      // set if a READ may fill the cache
+    unsigned int offset;
+    unsigned long cache_epoch;             // invalidations of cache_key before sending
+    chrono::steady_clock::time_point sent;
+};
+
+// A persistent pipelined connection of one user
+struct connection_t {
+    int socket = -1;
+    unsigned long id = 0;                  // never reused, unlike the connection's address
+    string username;
+    string password;
+    bool dead = false;
+    mutex send_lock;                       // one request on the socket at a time
+    mutex pending_lock;                    // lock for pending, last_sequence, sessions and dead
+    map<pair<unsigned int, unsigned int>, async_op_t*> pending;  // (session, sequence) -> op
+    unordered_map<unsigned int, unsigned int> last_sequence;     // session -> largest sent
+    unordered_set<unsigned int> sessions;  // sessions the server accepted on the connection
+};
+
+// A file server: server 0 is given to fs_async_init, the others by fs_async_shard
+struct server_t {
+    struct sockaddr_in addr;
+    // username -> pool of connections, a session always uses slot session % pool_size
+    unordered_map<string, vector<shared_ptr<connection_t> > > pools;
+};
+static bool initialized = false;
+static vector<server_t> servers;
+static unsigned int pool_size = 1;
+static unsigned long connection_ids = 0;   // connections opened so far
+static mutex pool_lock;                    // lock for the pools and connection_ids
+
+// Shards: top-level directory name -> server. A session is a session of server 0, and
+// has a session of its own on each other server, opened along with it.
+static unordered_map<string, unsigned int> shards;
+static unordered_map<unsigned int, vector<unsigned int> > shard_sessions;
+static mutex session_lock;                 // lock for shard_sessions
+
+// completed operations without callback, not reaped yet
+static unsigned long next_handle = 1;
+static deque<pair<fs_handle_t, int> > completions;
+static unordered_map<fs_handle_t, int> done;       // handle -> status
+static mutex completion_lock;                       // lock for all of the above
+static condition_variable completion_cv;
+static int completion_fd = -1;
+
+// Completions of operations that finish without a response (cache hits, renames
+// between servers), delivered by the completer thread so that callbacks never run on
+// the submitting thread
+static deque<pair<async_op_t*, int> > deferred;
+static bool completer_started = false;
+// never destroyed, since the completer waits on them until the process exits
+static mutex &deferred_lock = *new mutex();         // lock for deferred
+static condition_variable &deferred_cv = *new condition_variable();
+
+// Client block cache. Blocks are cached under read leases (FS_PIPELINE 0 0 LEASE): a
+// cached block is used until its lease expires, or until the server revokes the lease
+// because the file was written or deleted.
+struct cache_entry_t {
+    string key;                            // username<NULL>pathname
+    unsigned int offset;
+    unsigned long connection;              // id of the connection holding the lease
+    char data[FS_BLOCKSIZE];
+    chrono::steady_clock::time_point expiry;
+};
+static unsigned int cache_capacity = 0;    // 0 if the cache is disabled
+static list<cache_entry_t> cache_lru;      // most recently used first
+static map<pair<string, unsigned int>, list<cache_entry_t>::iterator> cache_index;
+// Files with reads in flight that may fill the cache; a read's block is cached only if
+// the file wasn't invalidated since it was sent. A file leaves with its last read.
+struct cache_file_t {
+    unsigned long epoch = 0;               // invalidations
+    unsigned int reads = 0;                // reads in flight
+};
+static unordered_map<string, cache_file_t> cache_files;  // key -> file
+static mutex cache_lock;                   // lock for all of the above
+
+
+/* utility functions */
+
+// Send the whole buffer, return false on failure
+static bool send_all(int socket, const char *buf, unsigned int size) {
+    unsigned int sent = 0;
+    while (sent < size) {
+        int s = send(socket, buf+sent, size-sent, MSG_NOSIGNAL);
+        if (s <= 0) { return false; }
+        sent += s;
+    }
+    return true;
+}
+
+// Encrypt cleartext and send it as one request: <username> <size><NULL><ciphertext>
+static bool send_request(int socket, const string &username, const string &password,
+                         const string &cleartext) {
+    unsigned int size_ciphertext;
+    char *ciphertext = (char*)fs_encrypt(password.c_str(), cleartext.data(),
+                                         cleartext.size(), &size_ciphertext);
+    string header(username+" "+to_string(size_ciphertext));
+    bool succ = send_all(socket, header.c_str(), header.size()+1) &&
+                send_all(socket, ciphertext, size_ciphertext);
+    delete [] ciphertext;
+    return succ;
+}
+
+// Receive one response and decrypt it into cleartext, return false on failure
+static bool receive_response(int socket, const string &password, string &cleartext) {
+    string header;
+    char c;
+    while (true) {
+        if (recv(socket, &c, 1, 0) <= 0) { return false; }
+        if (c == '\0') { break; }
+        header += c;
+        if (header.size() > 10) { return false; }
+    }
+    unsigned int size_ciphertext = strtoul(header.c_str(), nullptr, 10);
+    if (size_ciphertext == 0) { return false; }
+    char *ciphertext = new char[size_ciphertext];
+    if (recv(socket, ciphertext, size_ciphertext, MSG_WAITALL) != (int)size_ciphertext) {
+        delete [] ciphertext;
+        return false;
+    }
+    unsigned int size_cleartext;
+    char *buf = (char*)fs_decrypt(password.c_str(), ciphertext, size_ciphertext,
+                                  &size_cleartext);
+    delete [] ciphertext;
+    if (buf == nullptr) { return false; }
+    cleartext.assign(buf, size_cleartext);
+    delete [] buf;
+    return true;
+}
+
+static int connect_server(unsigned int server) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) { return -1; }
+    if (connect(sock, (struct sockaddr*)&servers[server].addr, sizeof(sockaddr_in)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Deliver the completion of op, and free it
+static void complete(async_op_t *op, int status) {
+    if (op->callback != nullptr) {
+        op->callback(op->handle, status, op->arg);
+    } else {
+        completion_lock.lock();
+        completions.push_back(make_pair(op->handle, status));
+        done[op->handle] = status;
+        uint64_t one = 1;
+        if (write(completion_fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("write");
+        }
+        completion_cv.notify_all();
+        completion_lock.unlock();
+    }
+    delete op;
+}
+
+// Deliver the completion of op from the completer thread
+static void complete_later(async_op_t *op, int status) {
+    lock_guard<mutex> lk(deferred_lock);
+    deferred.push_back(make_pair(op, status));
+    deferred_cv.notify_one();
+}
+
+// Thread function of the completer
+static void completer() {
+    while (true) {
+        unique_lock<mutex> lk(deferred_lock);
+        deferred_cv.wait(lk, [] { return !deferred.empty(); });
+        pair<async_op_t*, int> entry = deferred.front();
+        deferred.pop_front();
+        lk.unlock();
+        complete(entry.first, entry.second);
+    }
+}
+
+static async_op_t *new_op(fs_callback_t callback, void *arg) {
+    async_op_t *op = new async_op_t();
+    op->callback = callback;
+    op->arg = arg;
+    completion_lock.lock();
+    op->handle = next_handle++;
+    completion_lock.unlock();
+    return op;
+}
+
+
+/* Client block cache */
+
+static string cache_key(const string &username, const char *pathname) {
+    string key(username);
+    key += '\0';
+    key += pathname;
+    return key;
+}
+
+// Copy a block cached under a lease of connection into buf, return false on a miss
+static bool cache_lookup(const string &key, unsigned int offset, unsigned long connection,
+                         void *buf) {
+    lock_guard<mutex> lk(cache_lock);
+    auto found = cache_index.find(make_pair(key, offset));
+    if (found == cache_index.end() || found->second->connection != connection) {
+        return false;
+    }
+    auto entry = found->second;
+    if (entry->expiry <= chrono::steady_clock::now()) {
+        cache_index.erase(found);
+        cache_lru.erase(entry);
+        return false;
+    }
+    memcpy(buf, entry->data, FS_BLOCKSIZE);
+    cache_lru.splice(cache_lru.begin(), cache_lru, entry);
+    return true;
+}
+
+// A read that may fill the cache was answered: cache its block if it was read under a
+// lease of connection (lease_ms > 0), unless the file was invalidated since the read
+// was sent
+static void cache_read_done(const async_op_t *op, unsigned int lease_ms,
+                            unsigned long connection) {
+    lock_guard<mutex> lk(cache_lock);
+    auto file = cache_files.find(op->cache_key);
+    bool current = (file->second.epoch == op->cache_epoch);
+    if (--file->second.reads == 0) {
+        cache_files.erase(file);
+    }
+    if (lease_ms == 0 || !current) { return; }
+    auto found = cache_index.find(make_pair(op->cache_key, op->offset));
+    if (found != cache_index.end()) {
+        cache_lru.erase(found->second);
+        cache_index.erase(found);
+    }
+    cache_lru.push_front(cache_entry_t());
+    cache_entry_t &entry = cache_lru.front();
+    entry.key = op->cache_key;
+    entry.offset = op->offset;
+    entry.connection = connection;
+    memcpy(entry.data, op->read_buf, FS_BLOCKSIZE);
+    entry.expiry = op->sent+chrono::milliseconds(lease_ms);
+    cache_index[make_pair(op->cache_key, op->offset)] = cache_lru.begin();
+    if (cache_lru.size() > cache_capacity) {
+        cache_index.erase(make_pair(cache_lru.back().key, cache_lru.back().offset));
+        cache_lru.pop_back();
+    }
+}
+
+// Drop all cached blocks of a file
+static void cache_invalidate(const string &key) {
+    lock_guard<mutex> lk(cache_lock);
+    auto file = cache_files.find(key);
+    if (file != cache_files.end()) {
+        file->second.epoch++;
+    }
+    auto it = cache_index.lower_bound(make_pair(key, 0u));
+    while (it != cache_index.end() && it->first.first == key) {
+        cache_lru.erase(it->second);
+        it = cache_index.erase(it);
+    }
+}
+
+// Drop all cached blocks of the files at and below a path
+static void cache_invalidate_tree(const string &key) {
+    lock_guard<mutex> lk(cache_lock);
+    for (auto &entry : cache_files) {
+        const string &file = entry.first;
+        if (file.compare(0, key.size(), key) == 0 &&
+            (file.size() == key.size() || file[key.size()] == '/')) {
+            entry.second.epoch++;
+        }
+    }
+    auto it = cache_index.lower_bound(make_pair(key, 0u));
+    while (it != cache_index.end() && it->first.first.compare(0, key.size(), key) == 0) {
+        const string &file = it->first.first;
+        if (file.size() == key.size() || file[key.size()] == '/') {
+            cache_lru.erase(it->second);
+            it = cache_index.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+
+/* Shards */
+
+// Server of pathname: the server of its top-level directory's shard, or server 0
+static unsigned int route(const char *pathname) {
+    if (shards.empty() || pathname[0] != '/') { return 0; }
+    const char *end = strchr(pathname+1, '/');
+    auto found = shards.find(end == nullptr? string(pathname+1): string(pathname+1, end));
+    return found == shards.end()? 0: found->second;
+}
+
+// Session on server of a session; return false if it has none there
+static bool route_session(unsigned int session, unsigned int server,
+                          unsigned int &server_session) {
+    if (server == 0) {
+        server_session = session;
+        return true;
+    }
+    lock_guard<mutex> lk(session_lock);
+    auto found = shard_sessions.find(session);
+    if (found == shard_sessions.end()) { return false; }
+    server_session = found->second[server];
+    return true;
+}
+
+// Open a session on server with a one-shot connection, return false on failure
+static bool open_session(unsigned int server, const string &username,
+                         const string &password, unsigned int sequence,
+                         unsigned int &session) {
+    string cleartext("FS_SESSION 0 "+to_string(sequence));
+    cleartext += '\0';
+    int sock = connect_server(server);
+    if (sock == -1) { return false; }
+    unsigned int reply_sequence;
+    bool succ = send_request(sock, username, password, cleartext) &&
+                receive_response(sock, password, cleartext) &&
+                sscanf(cleartext.c_str(), "%u %u", &session, &reply_sequence) == 2;
+    close(sock);
+    return succ;
+}
+
+
+/* Connections */
+
+// Thread function for each connection: match responses to pending operations.
+// Response: <session> <sequence> <status>[ <lease>|<results>]<NULL>[data]
+// The server may also revoke a read lease at any time: REVOKE <pathname><NULL>
+static void connection_reader(shared_ptr<connection_t> conn) {
+    string cleartext;
+    while (receive_response(conn->socket, conn->password, cleartext)) {
+        if (cleartext.compare(0, 7, "REVOKE ") == 0) {
+            string pathname(cleartext.c_str()+7);
+            cache_invalidate(cache_key(conn->username, pathname.c_str()));
+            string release("FS_RELEASE 0 0 "+pathname);
+            release += '\0';
+            lock_guard<mutex> send_lk(conn->send_lock);
+            send_request(conn->socket, conn->username, conn->password, release);
+            continue;
+        }
+        unsigned int session, sequence, lease_ms = 0;
+        int status, tag_size = 0;
+        if (sscanf(cleartext.c_str(), "%u %u %d%n", &session, &sequence, &status,
+                   &tag_size) < 3) {
+            break;
+        }
+        const char *results = cleartext.c_str()+tag_size;
+        conn->pending_lock.lock();
+        auto found = conn->pending.find(make_pair(session, sequence));
+        if (found == conn->pending.end()) {
+            conn->pending_lock.unlock();
+            continue;
+        }
+        async_op_t *op = found->second;
+        conn->pending.erase(found);
+        if (status == 0) {
+            conn->sessions.insert(session);
+        }
+        conn->pending_lock.unlock();
+
+        size_t data_pos = strlen(cleartext.c_str())+1;
+        if (status == 0 && op->type_ptr != nullptr) {
+            char owner[FS_MAXUSERNAME+2] = "";
+            if (sscanf(results, " %c %u %11s", op->type_ptr, op->size_ptr, owner) < 2 ||
+                strlen(owner) > FS_MAXUSERNAME) {
+                status = -1;
+            } else {
+                strcpy(op->owner, owner);
+            }
+        } else if (status == 0 && op->offset_ptr != nullptr) {
+            if (sscanf(results, " %u", op->offset_ptr) != 1) { status = -1; }
+        } else if (status == 0 && op->read_buf != nullptr) {
+            sscanf(results, " %u", &lease_ms);
+            if (cleartext.size() != data_pos+FS_BLOCKSIZE) {
+                status = -1;
+            } else {
+                memcpy(op->read_buf, cleartext.data()+data_pos, FS_BLOCKSIZE);
+            }
+        }
+        if (!op->cache_key.empty()) {
+            cache_read_done(op, status == 0? lease_ms: 0, conn->id);
+        }
+        complete(op, status == 0? 0: -1);
+    }
+
+    // connection lost: fail everything still in flight
+    conn->pending_lock.lock();
+    conn->dead = true;
+    map<pair<unsigned int, unsigned int>, async_op_t*> lost;
+    lost.swap(conn->pending);
+    conn->pending_lock.unlock();
+    for (auto &entry : lost) {
+        if (!entry.second->cache_key.empty()) {
+            cache_read_done(entry.second, 0, conn->id);
+        }
+        complete(entry.second, -1);
+    }
+    conn->send_lock.lock();
+    close(conn->socket);
+    conn->send_lock.unlock();
+}
+
+// Open a pipelined connection to server for username
+static shared_ptr<connection_t> open_connection(unsigned int server, const string &username,
+                                                const string &password) {
+    int sock = connect_server(server);
+    if (sock == -1) { return nullptr; }
+    string cleartext(cache_capacity > 0? "FS_PIPELINE 0 0 LEASE": "FS_PIPELINE 0 0");
+    cleartext += '\0';
+    if (!send_request(sock, username, password, cleartext) ||
+        !receive_response(sock, password, cleartext)) {
+        close(sock);
+        return nullptr;
+    }
+    shared_ptr<connection_t> conn(new connection_t());
+    conn->socket = sock;
+    conn->id = ++connection_ids;
+    conn->username = username;
+    conn->password = password;
+    thread reader(connection_reader, conn);
+    reader.detach();
+    return conn;
+}
+
+// Get the connection to server that carries session, opening it if needed. A connection
+// with another password is replaced, so its cached blocks aren't served to the caller.
+static shared_ptr<connection_t> get_connection(unsigned int server, const string &username,
+                                               const string &password,
+                                               unsigned int session) {
+    lock_guard<mutex> lk(pool_lock);
+    vector<shared_ptr<connection_t> > &pool = servers[server].pools[username];
+    if (pool.empty()) {
+        pool.resize(pool_size);
+    }
+    shared_ptr<connection_t> &conn = pool[session % pool_size];
+    if (conn != nullptr) {
+        lock_guard<mutex> conn_lk(conn->pending_lock);
+        if (conn->dead || conn->password != password) {
+            conn = nullptr;
+        }
+    }
+    if (conn == nullptr) {
+        conn = open_connection(server, username, password);
+    }
+    return conn;
+}
+
+// Send op on its session's connection to the server of pathname. The request is
+//     <opcode> <session> <sequence> <pathname><fields><NULL>[data]
+// with the session of op->session on that server. A READ with op->cache_key set is
+// served from the cache instead if it can be.
+static fs_handle_t submit(const char *username, const char *password, async_op_t *op,
+                          const char *opcode, const char *pathname, const string &fields,
+                          const void *data = nullptr) {
+    fs_handle_t handle = op->handle;
+    unsigned int server = route(pathname);
+    if (!initialized || !route_session(op->session, server, op->session)) {
+        delete op;
+        return 0;
+    }
+    string cleartext(string(opcode)+" "+to_string(op->session)+" "+
+                     to_string(op->sequence)+" "+pathname+fields);
+    cleartext += '\0';
+    if (data != nullptr) {
+        cleartext.append((const char*)data, FS_BLOCKSIZE);
+    }
+    shared_ptr<connection_t> conn = get_connection(server, username, password, op->session);
+    if (conn == nullptr) {
+        delete op;
+        return 0;
+    }
+
+    // keep sequences increasing on the wire
+    lock_guard<mutex> send_lk(conn->send_lock);
+    conn->pending_lock.lock();
+    auto last = conn->last_sequence.find(op->session);
+    if (conn->dead || (last != conn->last_sequence.end() && last->second >= op->sequence)) {
+        conn->pending_lock.unlock();
+        delete op;
+        return 0;
+    }
+    conn->last_sequence[op->session] = op->sequence;
+    if (!op->cache_key.empty() && conn->sessions.count(op->session) > 0 &&
+        cache_lookup(op->cache_key, op->offset, conn->id, op->read_buf)) {
+        // the server accepted the session, and leased the block, on this connection
+        conn->pending_lock.unlock();
+        complete_later(op, 0);
+        return handle;
+    }
+    if (!op->cache_key.empty()) {
+        lock_guard<mutex> cache_lk(cache_lock);
+        cache_file_t &file = cache_files[op->cache_key];
+        file.reads++;
+        op->cache_epoch = file.epoch;
+        op->sent = chrono::steady_clock::now();
+    }
+    conn->pending[make_pair(op->session, op->sequence)] = op;
+    conn->pending_lock.unlock();
+
+    // a failed send closes the connection, and the reader fails op
+    if (!send_request(conn->socket, username, password, cleartext)) {
+        shutdown(conn->socket, SHUT_RDWR);
+    }
+    return handle;
+}
+
+
+/* Client interface */
+
+int fs_async_init(const char *hostname, uint16_t port, unsigned int connections) {
+    struct hostent *host = gethostbyname(hostname);
+    if (host == nullptr || connections == 0) {
+        cerr << "fs_async_init: invalid server or pool size" << endl;
+        return -1;
+    }
+    lock_guard<mutex> lk(pool_lock);
+    if (completion_fd == -1) {
+        completion_fd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+        if (completion_fd == -1) {
+            perror("eventfd");
+            return -1;
+        }
+    }
+    servers.assign(1, server_t());
+    memset(&servers[0].addr, 0, sizeof(sockaddr_in));
+    servers[0].addr.sin_family = AF_INET;
+    servers[0].addr.sin_port = htons(port);
+    memcpy(&servers[0].addr.sin_addr, host->h_addr, host->h_length);
+    pool_size = connections;
+    shards.clear();
+    if (!completer_started) {
+        thread(completer).detach();
+        completer_started = true;
+    }
+    initialized = true;
+    return 0;
+}
+
+int fs_async_shard(const char *name, const char *hostname, uint16_t port) {
+    struct hostent *host = gethostbyname(hostname);
+    if (!initialized || host == nullptr || name[0] == '\0' || strchr(name, '/') != nullptr ||
+        strlen(name) > FS_MAXFILENAME) {
+        return -1;
+    }
+    lock_guard<mutex> lk(pool_lock);
+    server_t server;
+    memset(&server.addr, 0, sizeof(sockaddr_in));
+    server.addr.sin_family = AF_INET;
+    server.addr.sin_port = htons(port);
+    memcpy(&server.addr.sin_addr, host->h_addr, host->h_length);
+    // shards on the same server share its connections and sessions
+    unsigned int index = servers.size();
+    for (unsigned int i = 0; i < servers.size(); i++) {
+        if (memcmp(&servers[i].addr, &server.addr, sizeof(sockaddr_in)) == 0) {
+            index = i;
+        }
+    }
+    if (index == servers.size()) {
+        servers.push_back(server);
+    }
+    shards[name] = index;
+    return 0;
+}
+
+// Sessions are rare, so they use one-shot connections like fs_session
+fs_handle_t fs_session_async(const char *username, const char *password,
+                             unsigned int *session_ptr, unsigned int sequence,
+                             fs_callback_t callback, void *arg) {
+    if (!initialized) { return 0; }
+    async_op_t *op = new_op(callback, arg);
+    op->sequence = sequence;
+    op->session_ptr = session_ptr;
+    fs_handle_t handle = op->handle;
+    string user(username), pass(password);
+    thread worker([op, user, pass]() {
+        vector<unsigned int> sessions(servers.size());
+        bool succ = true;
+        for (unsigned int server = 0; succ && server < servers.size(); server++) {
+            succ = open_session(server, user, pass, op->sequence, sessions[server]);
+        }
+        if (succ) {
+            if (servers.size() > 1) {
+                lock_guard<mutex> lk(session_lock);
+                shard_sessions[sessions[0]] = sessions;
+            }
+            *op->session_ptr = sessions[0];
+        }
+        complete(op, succ? 0: -1);
+    });
+    worker.detach();
+    return handle;
+}
+
+fs_handle_t fs_readblock_async(const char *username, const char *password,
+                               unsigned int session, unsigned int sequence,
+                               const char *pathname, unsigned int offset, void *buf,
+                               fs_callback_t callback, void *arg) {
+    async_op_t *op = new_op(callback, arg);
+    op->session = session;
+    op->sequence = sequence;
+    op->read_buf = buf;
+    op->offset = offset;
+    if (cache_capacity > 0) {
+        op->cache_key = cache_key(username, pathname);
+    }
+    return submit(username, password, op, "FS_READBLOCK", pathname, " "+to_string(offset));
+}
+
+fs_handle_t fs_writeblock_async(const char *username, const char *password,
+                                unsigned int session, unsigned int sequence,
+                                const char *pathname, unsigned int offset,
+                                const void *buf, fs_callback_t callback, void *arg) {
+    async_op_t *op = new_op(callback, arg);
+    op->session = session;
+    op->sequence = sequence;
+    if (cache_capacity > 0) {
+        cache_invalidate(cache_key(username, pathname));
+    }
+    return submit(username, password, op, "FS_WRITEBLOCK", pathname, " "+to_string(offset),
+                  buf);
+}
+
+fs_handle_t fs_create_async(const char *username, const char *password,
+                            unsigned int session, unsigned int sequence,
+                            const char *pathname, char type,
+                            fs_callback_t callback, void *arg) {
+    async_op_t *op = new_op(callback, arg);
+    op->session = session;
+    op->sequence = sequence;
+    return submit(username, password, op, "FS_CREATE", pathname, string(" ")+type);
+}
+
+fs_handle_t fs_delete_async(const char *username, const char *password,
+                            unsigned int session, unsigned int sequence,
+                            const char *pathname, fs_callback_t callback, void *arg) {
+    async_op_t *op = new_op(callback, arg);
+    op->session = session;
+    op->sequence = sequence;
+    if (cache_capacity > 0) {
+        cache_invalidate(cache_key(username, pathname));
+    }
+    return submit(username, password, op, "FS_DELETE", pathname, "");
+}
+
+fs_handle_t fs_readdir_async(const char *username, const char *password,
+                             unsigned int session, unsigned int sequence,
+                             const char *pathname, unsigned int cookie, void *buf,
+                             fs_callback_t callback, void *arg) {
+    async_op_t *op = new_op(callback, arg);
+    op->session = session;
+    op->sequence = sequence;
+    op->read_buf = buf;
+    return submit(username, password, op, "FS_READDIR", pathname, " "+to_string(cookie));
+}
+
+fs_handle_t fs_delete_tree_async(const char *username, const char *password,
+                                 unsigned int session, unsigned int sequence,
+                                 const char *pathname, fs_callback_t callback, void *arg) {
+    async_op_t *op = new_op(callback, arg);
+    op->session = session;
+    op->sequence = sequence;
+    if (cache_capacity > 0) {
+        cache_invalidate_tree(cache_key(username, pathname));
+    }
+    return submit(username, password, op, "FS_DELETE_TREE", pathname, "");
+}
+
+fs_handle_t fs_rename_async(const char *username, const char *password,
+                            unsigned int session, unsigned int sequence,
+                            const char *pathname, const char *new_pathname,
+                            fs_callback_t callback, void *arg) {
+    async_op_t *op = new_op(callback, arg);
+    op->session = session;
+    op->sequence = sequence;
+    if (route(pathname) != route(new_pathname)) {
+        // the blocks would have to be copied between servers
+        fs_handle_t handle = op->handle;
+        complete_later(op, -1);
+        return handle;
+    }
+    if (cache_capacity > 0) {
+        cache_invalidate_tree(cache_key(username, pathname));
+    }
+    return submit(username, password, op, "FS_RENAME", pathname, string(" ")+new_pathname);
+}
+
+fs_handle_t fs_stat_async(const char *username, const char *password,
+                          unsigned int session, unsigned int sequence,
+                          const char *pathname, char *type_ptr,
+                          unsigned int *size_ptr, char *owner,
+                          fs_callback_t callback, void *arg) {
+    async_op_t *op = new_op(callback, arg);
+    op->session = session;
+    op->sequence = sequence;
+    op->type_ptr = type_ptr;
+    op->size_ptr = size_ptr;
+    op->owner = owner;
+    return submit(username, password, op, "FS_STAT", pathname, "");
+}
+
+fs_handle_t fs_append_async(const char *username, const char *password,
+                            unsigned int session, unsigned int sequence,
+                            const char *pathname, const void *buf,
+                            unsigned int *offset_ptr,
+                            fs_callback_t callback, void *arg) {
+    async_op_t *op = new_op(callback, arg);
+    op->session = session;
+    op->sequence = sequence;
+    op->offset_ptr = offset_ptr;
+    if (cache_capacity > 0) {
+        cache_invalidate(cache_key(username, pathname));
+    }
+    return submit(username, password, op, "FS_APPEND", pathname, "", buf);
+}
+
+int fs_async_cache(unsigned int blocks) {
+    if (!initialized || blocks == 0) { return -1; }
+    lock_guard<mutex> lk(pool_lock);
+    for (server_t &server : servers) {
+        server.pools.clear();
+    }
+    cache_capacity = blocks;
+    return 0;
+}
+
+int fs_async_fd() {
+    return completion_fd;
+}
+
+int fs_async_poll(fs_handle_t *handle_ptr, int *status_ptr) {
+    lock_guard<mutex> lk(completion_lock);
+    if (completions.empty()) { return 0; }
+    *handle_ptr = completions.front().first;
+    *status_ptr = completions.front().second;
+    completions.pop_front();
+    done.erase(*handle_ptr);
+    uint64_t one;
+    if (read(completion_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("read");
+    }
+    return 1;
+}
+
+int fs_async_wait(fs_handle_t handle) {
+    unique_lock<mutex> lk(completion_lock);
+    completion_cv.wait(lk, [&] { return done.find(handle) != done.end(); });
+    int status = done[handle];
+    done.erase(handle);
+    for (auto it = completions.begin(); it != completions.end(); it++) {
+        if (it->first == handle) {
+            completions.erase(it);
+            break;
+        }
+    }
+    uint64_t one;
+    if (read(completion_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("read");
+    }
+    return status;
+}
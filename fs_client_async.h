@@ -0,0 +1,188 @@
+/*
+ * fs_client_async.h
+ *
+ * Non-blocking interface for clients of the file server.
+ */
+
+#ifndef _FS_CLIENT_ASYNC_H_
+#define _FS_CLIENT_ASYNC_H_
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "fs_param.h"
+
+/*
+ * Handle of a submitted operation.  0 is never a valid handle.
+ */
+typedef unsigned long fs_handle_t;
+
+/*
+ * Completion callback.  status is 0 if the operation succeeded and -1 if it
+ * failed, with the same failure causes as the matching call in fs_client.h.
+ * Callbacks run on a library thread and should not block.
+ */
+typedef void (*fs_callback_t)(fs_handle_t handle, int status, void *arg);
+
+/*
+ * Initialize the asynchronous client library.
+ * The location of the file server is specified by (hostname, port).
+ * Each user gets a pool of "connections" persistent pipelined connections,
+ * opened on first use.  All requests of one session travel on the same
+ * connection, in the order they were submitted.
+ *
+ * fs_async_init returns 0 on success, -1 on failure.
+ */
+extern int fs_async_init(const char *hostname, uint16_t port,
+                         unsigned int connections);
+
+/*
+ * Enable a client-side cache of up to "blocks" recently read blocks.  Blocks
+ * are cached under read leases granted by the server, which revokes them
+ * before a write or delete of the file completes, so a cached read never
+ * returns data older than an acknowledged write.  A read is served from the
+ * cache only on the connection that read the block, for a session the server
+ * has accepted on it with the same password.  It still uses its sequence
+ * number, and completes without a request to the server.
+ * Call after fs_async_init and before submitting operations.
+ *
+ * fs_async_cache returns 0 on success, -1 on failure.
+ */
+extern int fs_async_cache(unsigned int blocks);
+
+/*
+ * Serve the top-level directory "name" (e.g. "user_a" for /user_a and
+ * everything below it) from the file server at (hostname, port), which has a
+ * disk of its own.  Other pathnames go to the server given to fs_async_init.
+ * fs_session_async opens a session on every server, and the session it
+ * returns is used for all of them.  A rename between servers fails, and
+ * listing "/" only lists the directories of the first server.
+ * Call after fs_async_init and before opening sessions.
+ *
+ * fs_async_shard returns 0 on success, -1 on failure.
+ */
+extern int fs_async_shard(const char *name, const char *hostname, uint16_t port);
+
+/*
+ * Submit an operation.  The arguments are those of the matching call in
+ * fs_client.h, plus the completion callback and its argument.  buf (for
+ * reads and writes) and session_ptr must stay valid until completion.
+ * Within a session, operations must be submitted with increasing sequence
+ * numbers; a submission that breaks this fails immediately.
+ *
+ * If callback is nullptr, the completion is kept until it is reaped by
+ * fs_async_poll or fs_async_wait.  Otherwise callback is called once the
+ * operation completes, and the handle cannot be waited on.
+ *
+ * Each returns the handle of the operation, or 0 if it could not be
+ * submitted.
+ *
+ * All submission functions are thread safe.
+ */
+extern fs_handle_t fs_session_async(const char *username, const char *password,
+                                    unsigned int *session_ptr,
+                                    unsigned int sequence,
+                                    fs_callback_t callback, void *arg);
+
+extern fs_handle_t fs_readblock_async(const char *username, const char *password,
+                                      unsigned int session, unsigned int sequence,
+                                      const char *pathname, unsigned int offset,
+                                      void *buf,
+                                      fs_callback_t callback, void *arg);
+
+extern fs_handle_t fs_writeblock_async(const char *username, const char *password,
+                                       unsigned int session, unsigned int sequence,
+                                       const char *pathname, unsigned int offset,
+                                       const void *buf,
+                                       fs_callback_t callback, void *arg);
+
+extern fs_handle_t fs_create_async(const char *username, const char *password,
+                                   unsigned int session, unsigned int sequence,
+                                   const char *pathname, char type,
+                                   fs_callback_t callback, void *arg);
+
+extern fs_handle_t fs_delete_async(const char *username, const char *password,
+                                   unsigned int session, unsigned int sequence,
+                                   const char *pathname,
+                                   fs_callback_t callback, void *arg);
+
+/*
+ * List directory "pathname" one page at a time.  The first call passes
+ * cookie 0.  On completion buf (FS_BLOCKSIZE bytes) holds a page:
+ *
+ *     <next cookie><NULL><type><name><NULL>...<type><name><NULL><NULL>
+ *
+ * where type is 'f' or 'd'.  The cookie of the next page is given as a
+ * decimal number, and is 0 after the last page.  The root directory can be
+ * listed with pathname "/".  Entries created, deleted, or moved by the
+ * defragmenter while the directory is listed may be missed; others are listed
+ * once.
+ *
+ * Delete "pathname" and, if it is a directory, everything below it.  Either
+ * all of it is deleted or, if any of it is not owned by the user, none.
+ */
+extern fs_handle_t fs_readdir_async(const char *username, const char *password,
+                                    unsigned int session, unsigned int sequence,
+                                    const char *pathname, unsigned int cookie,
+                                    void *buf,
+                                    fs_callback_t callback, void *arg);
+
+extern fs_handle_t fs_delete_tree_async(const char *username, const char *password,
+                                        unsigned int session, unsigned int sequence,
+                                        const char *pathname,
+                                        fs_callback_t callback, void *arg);
+
+/*
+ * Move file or directory "pathname" to "new_pathname", in the same directory
+ * or another one, without copying its blocks.  new_pathname must not exist,
+ * and a directory can't be moved below itself.
+ */
+extern fs_handle_t fs_rename_async(const char *username, const char *password,
+                                   unsigned int session, unsigned int sequence,
+                                   const char *pathname, const char *new_pathname,
+                                   fs_callback_t callback, void *arg);
+
+/*
+ * Get the type ('f' or 'd'), size in blocks and owner of "pathname".  owner
+ * must have room for FS_MAXUSERNAME+1 bytes, and is empty for the root
+ * directory "/".  The results are stored when the operation completes.
+ *
+ * Write buf (FS_BLOCKSIZE bytes) as a new block at the end of file
+ * "pathname".  Concurrent appends to a file each get their own block.  The
+ * offset written is stored in *offset_ptr when the operation completes.
+ */
+extern fs_handle_t fs_stat_async(const char *username, const char *password,
+                                 unsigned int session, unsigned int sequence,
+                                 const char *pathname, char *type_ptr,
+                                 unsigned int *size_ptr, char *owner,
+                                 fs_callback_t callback, void *arg);
+
+extern fs_handle_t fs_append_async(const char *username, const char *password,
+                                   unsigned int session, unsigned int sequence,
+                                   const char *pathname, const void *buf,
+                                   unsigned int *offset_ptr,
+                                   fs_callback_t callback, void *arg);
+
+/*
+ * File descriptor that is readable while completed operations without a
+ * callback are waiting to be reaped.  Use it with poll/select/epoll, then
+ * call fs_async_poll until it returns 0.
+ */
+extern int fs_async_fd();
+
+/*
+ * Reap one completed operation without blocking.  The handle and status are
+ * returned in *handle_ptr and *status_ptr.
+ *
+ * fs_async_poll returns 1 if an operation was reaped, 0 if none is waiting.
+ */
+extern int fs_async_poll(fs_handle_t *handle_ptr, int *status_ptr);
+
+/*
+ * Block until the operation completes, and reap it.
+ *
+ * fs_async_wait returns the status of the operation (0 or -1).
+ */
+extern int fs_async_wait(fs_handle_t handle);
+
+#endif /* _FS_CLIENT_ASYNC_H_ */
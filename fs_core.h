@@ -0,0 +1,126 @@
+/*
+ * fs_core.h
+ *
+ * In-process interface to the file system core of the file server, without
+ * sockets, sessions or encryption.  Compile fs.cc with -DFS_CORE_ONLY to
+ * link the core into another program, together with libfs_server.o for the
+ * disk of the file server or fs_memdisk.cc for an in-memory disk.
+ */
+
+#ifndef _FS_CORE_H_
+#define _FS_CORE_H_
+
+#include "fs_param.h"
+
+/*
+ * Initialize the core from the file system on the disk.
+ * Call once, before any other call.
+ */
+extern void fs_core_init();
+
+/*
+ * The options of the file server that change how blocks are stored, for
+ * fs_core_init_options: FS_DEDUP (dedup), FS_COMPRESS (compress) and
+ * FS_SEGMENT_BLOCKS (segment_blocks, 0 for no log).
+ */
+struct fs_core_options {
+    int dedup;
+    int compress;
+    unsigned int segment_blocks;
+};
+
+/*
+ * fs_core_init with options.  Returns 0 on success, -1 if the options are
+ * invalid.  Unlike in the file server, the segment cleaner only runs in
+ * fs_core_clean_segments.
+ */
+extern int fs_core_init_options(const struct fs_core_options *options);
+
+/*
+ * Operations on the file system on behalf of "username", with the semantics
+ * of the matching calls in fs_client.h.  Each returns 0 on success, -1 on
+ * failure.
+ *
+ * All operations are thread safe.
+ */
+extern int fs_core_readblock(const char *username, const char *pathname,
+                             unsigned int offset, void *buf);
+
+extern int fs_core_writeblock(const char *username, const char *pathname,
+                              unsigned int offset, const void *buf);
+
+extern int fs_core_create(const char *username, const char *pathname,
+                          char type);
+
+extern int fs_core_delete(const char *username, const char *pathname);
+
+/*
+ * Directory listing, tree delete and rename, with the semantics of
+ * fs_readdir_async, fs_delete_tree_async and fs_rename_async in
+ * fs_client_async.h.
+ */
+extern int fs_core_readdir(const char *username, const char *pathname,
+                           unsigned int cookie, void *buf);
+
+extern int fs_core_delete_tree(const char *username, const char *pathname);
+
+extern int fs_core_rename(const char *username, const char *pathname,
+                          const char *new_pathname);
+
+/*
+ * File status and append, with the semantics of fs_stat_async and
+ * fs_append_async in fs_client_async.h.
+ */
+extern int fs_core_stat(const char *username, const char *pathname,
+                        char *type_ptr, unsigned int *size_ptr, char *owner);
+
+extern int fs_core_append(const char *username, const char *pathname,
+                          const void *buf, unsigned int *offset_ptr);
+
+/*
+ * Number of disk blocks read and written by the calling thread so far.
+ */
+extern void fs_core_disk_counts(unsigned long *reads_ptr,
+                                unsigned long *writes_ptr);
+
+/*
+ * Number of free disk blocks.
+ */
+extern unsigned int fs_core_free_blocks();
+
+/*
+ * Create and delete a snapshot, read through /.snapshot/<name>/<path>, as the
+ * "snapshot create" and "snapshot delete" admin commands.  Each returns 0 on
+ * success, -1 on failure.
+ */
+extern int fs_core_snapshot_create(const char *name);
+
+extern int fs_core_snapshot_delete(const char *name);
+
+/*
+ * Run one pass of the segment cleaner.  Returns the number of segments it
+ * freed.
+ */
+extern unsigned int fs_core_clean_segments();
+
+/*
+ * Check that the reference count of every data block matches the files that
+ * point to it, and that the dedup index names only blocks in use.  Returns 0
+ * if so, -1 if not.
+ */
+extern int fs_core_check_refs();
+
+/*
+ * The block codec of FS_COMPRESS.  fs_core_compress compresses n bytes of
+ * "in" into at most cap bytes of "out", and returns the compressed size, or 0
+ * if it doesn't fit.  fs_core_decompress decompresses n bytes of "in" into
+ * exactly "size" bytes of "out", and returns 0 on success, -1 if the input is
+ * corrupt.
+ */
+extern unsigned int fs_core_compress(const void *in, unsigned int n, void *out,
+                                     unsigned int cap);
+
+extern int fs_core_decompress(const void *in, unsigned int n, void *out,
+                              unsigned int size);
+
+#endif /* _FS_CORE_H_ */
@@ -0,0 +1,37 @@
+/*
+ * fs_memdisk.cc
+ *
+ * In-memory stand-in for the disk interface of fs_server.h.  Link it instead
+ * of libfs_server.o to run the file system core (fs_core.h) without a disk
+ * image.  The disk starts as a freshly created file system.
+ */
+#include "fs_server.h"
+
+#include <string.h>
+#include <assert.h>
+
+std::mutex cout_lock;
+bool fs_quiet = true;
+bool disk_quiet = true;
+
+static char disk[FS_DISKSIZE*FS_BLOCKSIZE];
+
+// Block 0 holds the inode of the root directory: empty and owned by all users
+static struct memdisk_init_t {
+    memdisk_init_t() {
+        fs_inode root;
+        memset(&root, 0, sizeof(root));
+        root.type = 'd';
+        memcpy(disk, &root, sizeof(root));
+    }
+} memdisk_init;
+
+void disk_readblock(unsigned int block, void *buf) {
+    assert(block < FS_DISKSIZE);
+    memcpy(buf, disk+block*FS_BLOCKSIZE, FS_BLOCKSIZE);
+}
+
+void disk_writeblock(unsigned int block, const void *buf) {
+    assert(block < FS_DISKSIZE);
+    memcpy(disk+block*FS_BLOCKSIZE, buf, FS_BLOCKSIZE);
+}
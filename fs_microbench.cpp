@@ -0,0 +1,502 @@
+/*
+ * fs_microbench.cpp
+ *
+ * Microbenchmarks of the file system core (fs_core.h) on the in-memory disk
+ * (fs_memdisk.cc), without sockets or encryption.  Reports time and disk blocks read and
+ * written per operation.
+ *
+ * usage: fs_microbench [-n iterations]
+ */
+#include "fs_core.h"
+#include "fs_server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+
+using namespace std;
+
+static const char *username = "user1";
+static unsigned int iterations = 10000;
+
+static string deep_dir(const string &base, unsigned int depth) {
+    string path(base);
+    for (unsigned int i = 0; i < depth; i++) {
+        path += "/d"+to_string(i);
+    }
+    return path;
+}
+
+static void check(int rc, const char *what, const string &path) {
+    if (rc != 0) {
+        fprintf(stderr, "error: %s %s failed\n", what, path.c_str());
+        exit(1);
+    }
+}
+
+// Time n calls of op (each given its index), excluding the untimed prepare step
+// before each call, and print one result line
+static void measure(const char *name, unsigned int param, unsigned int n,
+                    const function<void(unsigned int)> &prepare,
+                    const function<void(unsigned int)> &op) {
+    unsigned long reads0, writes0, reads1, writes1;
+    unsigned long reads = 0, writes = 0;
+    chrono::nanoseconds elapsed(0);
+    for (unsigned int i = 0; i < n; i++) {
+        if (prepare) { prepare(i); }
+        fs_core_disk_counts(&reads0, &writes0);
+        auto start = chrono::steady_clock::now();
+        op(i);
+        elapsed += chrono::steady_clock::now()-start;
+        fs_core_disk_counts(&reads1, &writes1);
+        reads += reads1-reads0;
+        writes += writes1-writes0;
+    }
+    printf("%-14s %6u %8u %10.1f %8.2f %8.2f\n", name, param, n,
+           (double)elapsed.count()/n, (double)reads/n, (double)writes/n);
+    fflush(stdout);
+}
+
+// Reads and stats of a file below "depth" directories
+static void bench_lookup_depth(unsigned int depth) {
+    string base("/depth"+to_string(depth));
+    check(fs_core_create(username, base.c_str(), 'd'), "create", base);
+    for (unsigned int d = 1; d <= depth; d++) {
+        check(fs_core_create(username, deep_dir(base, d).c_str(), 'd'), "create", deep_dir(base, d));
+    }
+    string path(deep_dir(base, depth)+"/f");
+    char buf[FS_BLOCKSIZE];
+    memset(buf, 'l', FS_BLOCKSIZE);
+    check(fs_core_create(username, path.c_str(), 'f'), "create", path);
+    check(fs_core_writeblock(username, path.c_str(), 0, buf), "write", path);
+
+    measure("lookup_depth", depth, iterations, nullptr, [&](unsigned int) {
+        check(fs_core_readblock(username, path.c_str(), 0, buf), "read", path);
+    });
+    measure("stat_depth", depth, iterations, nullptr, [&](unsigned int) {
+        char type, owner[FS_MAXUSERNAME+1];
+        unsigned int size;
+        check(fs_core_stat(username, path.c_str(), &type, &size, owner), "stat", path);
+    });
+
+    check(fs_core_delete(username, path.c_str()), "delete", path);
+    for (unsigned int d = depth; d >= 1; d--) {
+        check(fs_core_delete(username, deep_dir(base, d).c_str()), "delete", deep_dir(base, d));
+    }
+    check(fs_core_delete(username, base.c_str()), "delete", base);
+}
+
+// Lookups of the last entry, and create/delete of one more entry, in a
+// directory of "entries" files
+static void bench_fanout(unsigned int entries) {
+    string dir("/fanout"+to_string(entries));
+    check(fs_core_create(username, dir.c_str(), 'd'), "create", dir);
+    for (unsigned int e = 0; e < entries; e++) {
+        string path(dir+"/f"+to_string(e));
+        check(fs_core_create(username, path.c_str(), 'f'), "create", path);
+    }
+    string last(dir+"/f"+to_string(entries-1));
+    char buf[FS_BLOCKSIZE];
+    memset(buf, 'f', FS_BLOCKSIZE);
+    check(fs_core_writeblock(username, last.c_str(), 0, buf), "write", last);
+
+    measure("fanout_lookup", entries, iterations, nullptr, [&](unsigned int) {
+        check(fs_core_readblock(username, last.c_str(), 0, buf), "read", last);
+    });
+    string extra(dir+"/extra");
+    measure("fanout_create", entries, iterations, [&](unsigned int i) {
+        if (i > 0) { check(fs_core_delete(username, extra.c_str()), "delete", extra); }
+    }, [&](unsigned int) {
+        check(fs_core_create(username, extra.c_str(), 'f'), "create", extra);
+    });
+    check(fs_core_delete(username, extra.c_str()), "delete", extra);
+
+    for (unsigned int e = 0; e < entries; e++) {
+        string path(dir+"/f"+to_string(e));
+        check(fs_core_delete(username, path.c_str()), "delete", path);
+    }
+    check(fs_core_delete(username, dir.c_str()), "delete", dir);
+}
+
+// Appends to a file, by writes at an offset tracked here and by fs_core_append,
+// starting over with a new file when it is full
+static void bench_append() {
+    string path("/append");
+    char buf[FS_BLOCKSIZE];
+    memset(buf, 'a', FS_BLOCKSIZE);
+    unsigned int size = FS_MAXFILEBLOCKS;
+    measure("append", 0, iterations, [&](unsigned int i) {
+        if (size == FS_MAXFILEBLOCKS) {
+            if (i > 0) { check(fs_core_delete(username, path.c_str()), "delete", path); }
+            check(fs_core_create(username, path.c_str(), 'f'), "create", path);
+            size = 0;
+        }
+    }, [&](unsigned int) {
+        check(fs_core_writeblock(username, path.c_str(), size++, buf), "write", path);
+    });
+    measure("append_op", 0, iterations, [&](unsigned int) {
+        if (size == FS_MAXFILEBLOCKS) {
+            check(fs_core_delete(username, path.c_str()), "delete", path);
+            check(fs_core_create(username, path.c_str(), 'f'), "create", path);
+            size = 0;
+        }
+    }, [&](unsigned int) {
+        unsigned int offset;
+        check(fs_core_append(username, path.c_str(), buf, &offset), "append", path);
+        if (offset != size++) { check(-1, "append", path); }
+    });
+    check(fs_core_delete(username, path.c_str()), "delete", path);
+}
+
+// Writes of the last block of an empty file, leaving holes before it
+static void bench_sparse() {
+    string path("/sparse");
+    char buf[FS_BLOCKSIZE];
+    memset(buf, 's', FS_BLOCKSIZE);
+    measure("sparse_write", FS_MAXFILEBLOCKS-1, iterations, [&](unsigned int i) {
+        if (i > 0) { check(fs_core_delete(username, path.c_str()), "delete", path); }
+        check(fs_core_create(username, path.c_str(), 'f'), "create", path);
+    }, [&](unsigned int) {
+        check(fs_core_writeblock(username, path.c_str(), FS_MAXFILEBLOCKS-1, buf), "write", path);
+    });
+    check(fs_core_delete(username, path.c_str()), "delete", path);
+}
+
+// Deletes of a file of "blocks" blocks
+static void bench_delete(unsigned int blocks) {
+    string path("/delete");
+    char buf[FS_BLOCKSIZE];
+    memset(buf, 'd', FS_BLOCKSIZE);
+    measure("delete", blocks, iterations/10, [&](unsigned int) {
+        check(fs_core_create(username, path.c_str(), 'f'), "create", path);
+        for (unsigned int b = 0; b < blocks; b++) {
+            check(fs_core_writeblock(username, path.c_str(), b, buf), "write", path);
+        }
+    }, [&](unsigned int) {
+        check(fs_core_delete(username, path.c_str()), "delete", path);
+    });
+}
+
+// Moves of a file of "blocks" blocks to another directory and back
+static void bench_rename(unsigned int blocks) {
+    string from("/rename_from"), to("/rename_to");
+    char buf[FS_BLOCKSIZE];
+    memset(buf, 'r', FS_BLOCKSIZE);
+    check(fs_core_create(username, from.c_str(), 'd'), "create", from);
+    check(fs_core_create(username, to.c_str(), 'd'), "create", to);
+    string paths[2] = {from+"/f", to+"/f"};
+    check(fs_core_create(username, paths[0].c_str(), 'f'), "create", paths[0]);
+    for (unsigned int b = 0; b < blocks; b++) {
+        check(fs_core_writeblock(username, paths[0].c_str(), b, buf), "write", paths[0]);
+    }
+    measure("rename", blocks, iterations, nullptr, [&](unsigned int i) {
+        check(fs_core_rename(username, paths[i%2].c_str(), paths[(i+1)%2].c_str()), "rename",
+              paths[i%2]);
+    });
+    check(fs_core_delete_tree(username, from.c_str()), "delete_tree", from);
+    check(fs_core_delete_tree(username, to.c_str()), "delete_tree", to);
+}
+
+// Listing of a directory of "entries" files, page by page
+static void bench_readdir(unsigned int entries) {
+    string dir("/readdir"+to_string(entries));
+    check(fs_core_create(username, dir.c_str(), 'd'), "create", dir);
+    for (unsigned int e = 0; e < entries; e++) {
+        string path(dir+"/f"+to_string(e));
+        check(fs_core_create(username, path.c_str(), 'f'), "create", path);
+    }
+    measure("readdir", entries, iterations/10, nullptr, [&](unsigned int) {
+        char page[FS_BLOCKSIZE];
+        unsigned int cookie = 0, listed = 0;
+        do {
+            check(fs_core_readdir(username, dir.c_str(), cookie, page), "readdir", dir);
+            cookie = atoi(page);
+            for (const char *entry = page+strlen(page)+1; *entry != '\0';
+                 entry += strlen(entry)+1) {
+                listed++;
+            }
+        } while (cookie != 0);
+        if (listed != entries) { check(-1, "readdir", dir); }
+    });
+    check(fs_core_delete_tree(username, dir.c_str()), "delete_tree", dir);
+}
+
+// Deletes of a directory of "entries" files of one block each: one delete per
+// entry, and one delete_tree
+static void bench_delete_tree(unsigned int entries) {
+    string dir("/tree");
+    char buf[FS_BLOCKSIZE];
+    memset(buf, 't', FS_BLOCKSIZE);
+    auto build = [&](unsigned int) {
+        check(fs_core_create(username, dir.c_str(), 'd'), "create", dir);
+        for (unsigned int e = 0; e < entries; e++) {
+            string path(dir+"/f"+to_string(e));
+            check(fs_core_create(username, path.c_str(), 'f'), "create", path);
+            check(fs_core_writeblock(username, path.c_str(), 0, buf), "write", path);
+        }
+    };
+    measure("delete_each", entries, iterations/100, build, [&](unsigned int) {
+        for (unsigned int e = 0; e < entries; e++) {
+            string path(dir+"/f"+to_string(e));
+            check(fs_core_delete(username, path.c_str()), "delete", path);
+        }
+        check(fs_core_delete(username, dir.c_str()), "delete", dir);
+    });
+    measure("delete_tree", entries, iterations/100, build, [&](unsigned int) {
+        check(fs_core_delete_tree(username, dir.c_str()), "delete_tree", dir);
+    });
+}
+
+// Compression and decompression of random, zero and repetitive blocks with the codec of
+// FS_COMPRESS, with the compressed size as param. Each block must round-trip, and every
+// truncation or corrupted byte of its compressed form must fail to decode, or decode
+// without writing past the block (a truncation, to the block itself).
+static void bench_codec() {
+    static const unsigned int CAP = FS_BLOCKSIZE+FS_BLOCKSIZE/255+16;  // random data grows
+    const char *kinds[] = {"random", "zero", "repetitive"};
+    for (unsigned int k = 0; k < 3; k++) {
+        char block[FS_BLOCKSIZE], packed[CAP], unpacked[FS_BLOCKSIZE+16];
+        for (unsigned int b = 0; b < FS_BLOCKSIZE; b++) {
+            block[b] = (k == 0)? (char)rand(): (k == 1)? 0: "file system "[b%12];
+        }
+        unsigned int n = fs_core_compress(block, FS_BLOCKSIZE, packed, CAP);
+        if (n == 0 || fs_core_decompress(packed, n, unpacked, FS_BLOCKSIZE) != 0 ||
+            memcmp(block, unpacked, FS_BLOCKSIZE) != 0) {
+            check(-1, "codec round trip of", kinds[k]);
+        }
+        for (unsigned int length = 0; length < n; length++) {
+            if (fs_core_decompress(packed, length, unpacked, FS_BLOCKSIZE) == 0 &&
+                memcmp(block, unpacked, FS_BLOCKSIZE) != 0) {
+                check(-1, "codec truncation of", kinds[k]);
+            }
+        }
+        for (unsigned int b = 0; b < n; b++) {
+            char corrupt[CAP];
+            memcpy(corrupt, packed, n);
+            corrupt[b] ^= 0x5a;
+            memset(unpacked+FS_BLOCKSIZE, 'g', 16);
+            fs_core_decompress(corrupt, n, unpacked, FS_BLOCKSIZE);
+            if (memcmp(unpacked+FS_BLOCKSIZE, "gggggggggggggggg", 16) != 0) {
+                check(-1, "codec corruption of", kinds[k]);
+            }
+        }
+
+        measure("compress", n, iterations, nullptr, [&](unsigned int) {
+            fs_core_compress(block, FS_BLOCKSIZE, packed, CAP);
+        });
+        measure("decompress", n, iterations, nullptr, [&](unsigned int) {
+            check(fs_core_decompress(packed, n, unpacked, FS_BLOCKSIZE), "decompress", kinds[k]);
+        });
+    }
+}
+
+static void random_block(unsigned int seed, char *buf) {
+    for (unsigned int b = 0; b < FS_BLOCKSIZE; b++) {
+        buf[b] = (char)rand_r(&seed);
+    }
+}
+
+// Content of version "version" of block "index" of test file "file": every third block is
+// the same in all files, every third compressible text and every third random
+static void mode_block(unsigned int file, unsigned int index, unsigned int version, char *buf) {
+    if (index%3 == 0) {
+        memset(buf, 'a'+version, FS_BLOCKSIZE);
+    } else if (index%3 == 1) {
+        string line("file "+to_string(file)+" block "+to_string(index)+" version "+
+                    to_string(version)+"\n");
+        for (unsigned int b = 0; b < FS_BLOCKSIZE; b++) {
+            buf[b] = line[b%line.size()];
+        }
+    } else {
+        random_block((file*FS_MAXFILEBLOCKS+index)*2+version, buf);
+    }
+}
+
+static void check_block(const string &path, unsigned int file, unsigned int index,
+                        unsigned int version) {
+    char expected[FS_BLOCKSIZE], buf[FS_BLOCKSIZE];
+    mode_block(file, index, version, expected);
+    check(fs_core_readblock(username, path.c_str(), index, buf), "read", path);
+    check(memcmp(buf, expected, FS_BLOCKSIZE) == 0? 0: -1, "content check of", path);
+}
+
+// Fill the disk through the segment log with files written in turns, delete every other
+// one, so that no segment is left clean, and have the cleaner free one
+static void check_cleaner(unsigned int segment_blocks) {
+    static const unsigned int FILES = 32;
+    check(fs_core_create(username, "/fill", 'd'), "create", "/fill");
+    for (unsigned int f = 0; f < FILES; f++) {
+        string path("/fill/f"+to_string(f));
+        check(fs_core_create(username, path.c_str(), 'f'), "create", path);
+    }
+    unsigned int blocks = 0;
+    char buf[FS_BLOCKSIZE];
+    for (unsigned int i = 0; i < FS_MAXFILEBLOCKS && fs_core_free_blocks() > segment_blocks; i++) {
+        for (unsigned int f = 0; f < FILES && fs_core_free_blocks() > segment_blocks; f++) {
+            string path("/fill/f"+to_string(f));
+            random_block(f*FS_MAXFILEBLOCKS+i, buf);
+            check(fs_core_writeblock(username, path.c_str(), i, buf), "write", path);
+            blocks = i+1;
+        }
+    }
+    for (unsigned int f = 1; f < FILES; f += 2) {
+        string path("/fill/f"+to_string(f));
+        check(fs_core_delete(username, path.c_str()), "delete", path);
+    }
+    check(fs_core_clean_segments() > 0? 0: -1, "segment cleaning of", "/fill");
+    check(fs_core_check_refs(), "reference check after cleaning", "/fill");
+    for (unsigned int f = 0; f < FILES; f += 2) {
+        for (unsigned int i = 0; i+1 < blocks; i++) {
+            char expected[FS_BLOCKSIZE];
+            string path("/fill/f"+to_string(f));
+            random_block(f*FS_MAXFILEBLOCKS+i, expected);
+            check(fs_core_readblock(username, path.c_str(), i, buf), "read", path);
+            check(memcmp(buf, expected, FS_BLOCKSIZE) == 0? 0: -1, "content check of", path);
+        }
+    }
+    check(fs_core_delete_tree(username, "/fill"), "delete tree", "/fill");
+}
+
+// Write, overwrite under a snapshot, rename and delete files with the block storage
+// options of the file server, checking the content, the reference counts and that
+// every block is free again at the end
+static void check_mode(const struct fs_core_options &options) {
+    static const unsigned int FILES = 8, BLOCKS = 24;
+    unsigned int free_blocks = fs_core_free_blocks();
+    char buf[FS_BLOCKSIZE];
+    auto path = [](const char *dir, unsigned int f) {
+        return string(dir)+"/f"+to_string(f);
+    };
+
+    check(fs_core_create(username, "/modes", 'd'), "create", "/modes");
+    for (unsigned int f = 0; f < FILES; f++) {
+        check(fs_core_create(username, path("/modes", f).c_str(), 'f'), "create", path("/modes", f));
+        for (unsigned int i = 0; i < BLOCKS; i++) {
+            mode_block(f, i, 0, buf);
+            check(fs_core_writeblock(username, path("/modes", f).c_str(), i, buf), "write",
+                  path("/modes", f));
+        }
+    }
+    check(fs_core_check_refs(), "reference check after writes", "/modes");
+
+    // overwrite every other block; the snapshot keeps the old content
+    check(fs_core_snapshot_create("s"), "snapshot create", "s");
+    for (unsigned int f = 0; f < FILES; f++) {
+        for (unsigned int i = 0; i < BLOCKS; i += 2) {
+            mode_block(f, i, 1, buf);
+            check(fs_core_writeblock(username, path("/modes", f).c_str(), i, buf), "write",
+                  path("/modes", f));
+        }
+    }
+    for (unsigned int f = 0; f < FILES; f++) {
+        for (unsigned int i = 0; i < BLOCKS; i++) {
+            check_block(path("/modes", f), f, i, 1-i%2);
+            check_block(path("/.snapshot/s/modes", f), f, i, 0);
+        }
+    }
+    check(fs_core_check_refs(), "reference check after overwrites", "/modes");
+
+    check(fs_core_rename(username, "/modes/f0", "/modes/g0"), "rename", "/modes/f0");
+    check_block("/modes/g0", 0, 1, 0);
+    check(fs_core_delete(username, "/modes/f1"), "delete", "/modes/f1");
+    check_block("/.snapshot/s/modes/f1", 1, 0, 0);
+    check(fs_core_snapshot_delete("s"), "snapshot delete", "s");
+    check(fs_core_check_refs(), "reference check after snapshot delete", "/modes");
+    check(fs_core_delete_tree(username, "/modes"), "delete tree", "/modes");
+
+    if (options.segment_blocks > 0) {
+        check_cleaner(options.segment_blocks);
+    }
+    check(fs_core_check_refs(), "reference check at the end", "/");
+    if (fs_core_free_blocks() != free_blocks) {
+        fprintf(stderr, "error: %u blocks leaked\n", free_blocks-fs_core_free_blocks());
+        exit(1);
+    }
+}
+
+// check_mode for each combination of options in a child process of its own, as the
+// core is initialized once per process
+static void check_modes() {
+    const struct {
+        const char *name;
+        struct fs_core_options options;
+    } modes[] = {
+        {"plain", {0, 0, 0}},
+        {"dedup", {1, 0, 0}},
+        {"compress", {0, 1, 0}},
+        {"segments", {0, 0, 32}},
+        {"all", {1, 1, 32}},
+    };
+    for (const auto &mode : modes) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            check(fs_core_init_options(&mode.options), "init with options", mode.name);
+            check_mode(mode.options);
+            exit(0);
+        }
+        int status;
+        if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            check(-1, "check of mode", mode.name);
+        }
+        printf("# checked mode %s\n", mode.name);
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n': iterations = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (iterations < 100) {
+        fprintf(stderr, "error: at least 100 iterations\n");
+        exit(1);
+    }
+
+    printf("# fs_microbench iterations=%u\n", iterations);
+    check_modes();
+    fs_core_init();
+    unsigned int free_blocks = fs_core_free_blocks();
+
+    printf("%-14s %6s %8s %10s %8s %8s\n", "benchmark", "param", "ops", "ns_per_op",
+           "reads", "writes");
+    for (unsigned int depth : {1, 2, 4, 8, 16}) {
+        bench_lookup_depth(depth);
+    }
+    for (unsigned int entries : {1u, 8u, 64u, 512u, FS_DIRENTRIES*FS_MAXFILEBLOCKS-1}) {
+        bench_fanout(entries);
+    }
+    bench_append();
+    bench_sparse();
+    for (unsigned int blocks : {0, 1, 16, 124}) {
+        bench_delete(blocks);
+    }
+    for (unsigned int blocks : {1, 124}) {
+        bench_rename(blocks);
+    }
+    for (unsigned int entries : {8u, 64u, 512u}) {
+        bench_readdir(entries);
+        bench_delete_tree(entries);
+    }
+    bench_codec();
+
+    // every benchmark removes what it created
+    if (fs_core_free_blocks() != free_blocks) {
+        fprintf(stderr, "error: %u blocks leaked\n", free_blocks-fs_core_free_blocks());
+        return 1;
+    }
+    return 0;
+}